@@ -0,0 +1,111 @@
+#include "nes/batch.hpp"
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+
+// Runs a list of roms and input movies on all cores at once.
+//
+//   xnes_batch <job list> [options]
+//     --threads n      worker threads, default one per hardware thread
+//     --slice n        frames an instance runs per turn, default 60
+//     --pin            pin worker i to CPU i (Linux)
+//     --no-video       don't draw pixels
+//     --repeat n       run the whole list n times, for load tests
+//
+// The job list has one job per line, "<frames> <rom> [movie.fm2]"; empty
+// lines and lines starting with '#' are skipped. Prints the final frame and
+// RAM hashes of every job (the same as xnes_headless prints for its last
+// frame) and the aggregate speed.
+
+void usage() {
+  printf("usage: xnes_batch <job list> [--threads n] [--slice n] [--pin] "
+         "[--no-video]\n"
+         "                  [--repeat n]\n");
+}
+
+bool read_jobs(const std::string &filename,
+               std::vector<BatchRunner::Job> &jobs) {
+  std::ifstream file(filename);
+  if (!file.is_open())
+    return false;
+  std::map<std::string, std::shared_ptr<const InputMovie>> movies;
+  std::string line;
+  while (std::getline(file, line)) {
+    if (line.empty() || line[0] == '#')
+      continue;
+    std::istringstream fields(line);
+    BatchRunner::Job job;
+    std::string movie_file;
+    if (!(fields >> job.frames >> job.rom))
+      continue;
+    if (fields >> movie_file) {
+      auto &movie = movies[movie_file];
+      if (movie == nullptr) {
+        auto loaded = std::make_shared<InputMovie>();
+        if (!loaded->load(movie_file)) {
+          printf("could not read %s\n", movie_file.c_str());
+          return false;
+        }
+        movie = loaded;
+      }
+      job.movie = movie;
+    }
+    jobs.push_back(job);
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    usage();
+    return 2;
+  }
+  BatchRunner::Options options;
+  uint32_t repeat = 1;
+  for (int i = 2; i < argc; i++) {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (arg == "--threads" && has_value) {
+      options.threads = std::strtoul(argv[++i], nullptr, 10);
+    } else if (arg == "--slice" && has_value) {
+      options.sliceFrames = std::strtoul(argv[++i], nullptr, 10);
+    } else if (arg == "--pin") {
+      options.pinThreads = true;
+    } else if (arg == "--no-video") {
+      options.video = false;
+    } else if (arg == "--repeat" && has_value) {
+      repeat = std::max(1ul, std::strtoul(argv[++i], nullptr, 10));
+    } else {
+      usage();
+      return 2;
+    }
+  }
+
+  std::vector<BatchRunner::Job> list, jobs;
+  if (!read_jobs(argv[1], list)) {
+    printf("could not read %s\n", argv[1]);
+    return 1;
+  }
+  for (uint32_t r = 0; r < repeat; r++)
+    jobs.insert(jobs.end(), list.begin(), list.end());
+
+  BatchRunner::Stats stats = BatchRunner::run(jobs, options);
+
+  int failed = 0;
+  for (const auto &job : jobs) {
+    if (job.ok)
+      printf("%s %u frames video %08x ram %08x %.3f s\n", job.rom.c_str(),
+             job.framesRun, job.frameHash, job.ramHash, job.seconds);
+    else
+      printf("%s could not be loaded\n", job.rom.c_str());
+    failed += !job.ok;
+  }
+  printf("%zu instances, %llu frames in %.3f s on %u threads: %.1f fps "
+         "(%.1fx realtime), %llu steals\n",
+         jobs.size(), (unsigned long long)stats.frames, stats.seconds,
+         stats.threads, stats.fps(), stats.fps() / 60.0988,
+         (unsigned long long)stats.steals);
+  return failed > 0;
+}
@@ -0,0 +1,169 @@
+#include "nes/bus.hpp"
+#include "nes/core.hpp"
+#include <ctime>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Measures how emulation speed depends on the cache, for layout work.
+//
+//   xnes_bench <rom> [options]
+//     --instances n    lean instances, default 64
+//     --frames n       frames each instance runs, default 30
+//
+// Runs the same frames twice on fresh instances, only in another order:
+// one instance after another, so the running one stays in cache, then round
+// robin, one frame each per turn, so every frame starts with its state
+// evicted by the other instances. Prints frames per second of CPU time,
+// which steal time on shared machines doesn't inflate, and on Linux, where
+// the kernel allows it, hardware counters per frame. Also prints the sizes
+// of the main structures.
+
+void usage() {
+  printf("usage: xnes_bench <rom> [--instances n] [--frames n]\n");
+}
+
+struct Counters {
+  static const int COUNT = 4;
+  const char *names[COUNT] = {"cycles", "instructions", "L1D misses",
+                              "LLC misses"};
+  int fds[COUNT] = {-1, -1, -1, -1};
+  uint64_t values[COUNT] = {};
+
+  Counters() {
+#ifdef __linux__
+    const uint64_t l1d_read_miss =
+        PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    const std::pair<uint32_t, uint64_t> events[COUNT] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HW_CACHE, l1d_read_miss},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    };
+    for (int i = 0; i < COUNT; i++) {
+      perf_event_attr attr;
+      std::memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = events[i].first;
+      attr.config = events[i].second;
+      attr.disabled = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+#endif
+  }
+
+  ~Counters() {
+#ifdef __linux__
+    for (int fd : fds)
+      if (fd >= 0)
+        close(fd);
+#endif
+  }
+
+  bool available() const { return fds[0] >= 0; }
+
+  void start() {
+#ifdef __linux__
+    for (int fd : fds)
+      if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+      }
+#endif
+  }
+
+  void stop() {
+#ifdef __linux__
+    for (int i = 0; i < COUNT; i++) {
+      values[i] = 0;
+      if (fds[i] >= 0) {
+        ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fds[i], &values[i], sizeof(values[i])) != sizeof(values[i]))
+          values[i] = 0;
+      }
+    }
+#endif
+  }
+};
+
+void report(const char *name, uint32_t frames, double seconds,
+            const Counters &counters) {
+  printf("%-12s %8.1f fps", name, seconds > 0 ? frames / seconds : 0);
+  if (counters.available())
+    for (int i = 0; i < Counters::COUNT; i++)
+      if (counters.fds[i] >= 0)
+        printf("  %s/frame %.0f", counters.names[i],
+               (double)counters.values[i] / frames);
+  printf("\n");
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    usage();
+    return 2;
+  }
+  uint32_t frames = 30, instances = 64;
+  for (int i = 2; i < argc; i++) {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (arg == "--frames" && has_value) {
+      frames = std::max(1ul, std::strtoul(argv[++i], nullptr, 10));
+    } else if (arg == "--instances" && has_value) {
+      instances = std::max(1ul, std::strtoul(argv[++i], nullptr, 10));
+    } else {
+      usage();
+      return 2;
+    }
+  }
+
+  printf("sizeof NesBus %zu, Cpu6502 %zu, Ppu2C02 %zu, APU %zu\n",
+         sizeof(NesBus), sizeof(Cpu6502), sizeof(Ppu2C02), sizeof(APU));
+
+  NesCore::Options options;
+  options.sampleRate = 0;
+  options.lean = true;
+  std::vector<std::unique_ptr<NesCore>> cores(instances);
+  auto power_on = [&] {
+    for (auto &core : cores) {
+      core = std::make_unique<NesCore>(options);
+      if (!core->loadRom(argv[1]))
+        return false;
+    }
+    return true;
+  };
+
+  Counters counters;
+  if (!counters.available())
+    printf("hardware counters unavailable, timing only\n");
+
+  uint32_t total = frames * instances;
+  for (bool interleaved : {false, true}) {
+    if (!power_on()) {
+      printf("could not load %s\n", argv[1]);
+      return 1;
+    }
+    std::clock_t start = std::clock();
+    counters.start();
+    for (uint32_t f = 0; f < total; f++) {
+      uint32_t i = interleaved ? f % instances : f / frames;
+      cores[i]->bus().drawFrame();
+    }
+    counters.stop();
+    double seconds = (double)(std::clock() - start) / CLOCKS_PER_SEC;
+    report(interleaved ? "round robin" : "one by one", total, seconds,
+           counters);
+  }
+  return 0;
+}
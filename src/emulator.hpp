@@ -1,9 +1,16 @@
 #pragma once
 
+#include "latency.hpp"
 #include "nes/bus.hpp"
+#include "nes/netplay.hpp"
+#include "nes/rewind.hpp"
+#include "nes/run_ahead.hpp"
+#include "nes/state_io.hpp"
 #include "platform_wasm.hpp"
+#include "rom_index.hpp"
 #include <algorithm>
 #include <filesystem>
+#include <set>
 
 namespace fs = std::filesystem;
 namespace xn {
@@ -22,31 +29,36 @@ const std::map<SDL_GameControllerButton, uint8_t> gamepad_button_map = {
 };
 
 struct PulseGraph {
-  static const size_t MAX_SAMPLES = 512;
-  size_t sampleCount = 0;
+  static const size_t MAX_SAMPLES = APU::ScopeTaps::SAMPLES;
   std::array<float, MAX_SAMPLES> samples;
   std::string label;
-  float volume = 0.1;
+  float volume = 1.0;
   float *volume_ptr = &volume;
+  bool mute = false;
+  bool *mute_ptr = &mute;
+  const xn::ScopeRingBuffer<float, MAX_SAMPLES> *tap = nullptr;
 
   PulseGraph() {}
 
-  PulseGraph(const std::string &label, float volume = 0.1)
+  PulseGraph(const std::string &label, float volume = 1.0)
       : label(label), volume(volume) {
     std::memset(samples.data(), 0, sizeof(samples));
   }
 
-  void addSample(float new_sample) {
-    std::rotate(samples.begin(), samples.begin() + 1, samples.end());
-    samples[0] = new_sample;
-  }
-
   static float sampleFunc(void *argv, int i) {
     float *buf = (float *)argv;
     return buf[i];
   }
 
+  // Plots the channel's last MAX_SAMPLES outputs before mixing, one point
+  // per audio output sample (about 12 ms at 44.1 kHz), oldest on the left.
+  // Values are the raw channel output on a -1 to 1 scale, before the volume
+  // slider and mute. Keeps the previous trace if the writer lapped the
+  // snapshot
   void draw() {
+    std::array<float, MAX_SAMPLES> latest;
+    if (tap != nullptr && tap->snapshot(latest.data()))
+      samples = latest;
     ImGui::PlotLines(label.c_str(), sampleFunc, (void *)samples.data(),
                      MAX_SAMPLES, 0, NULL, -1.0f, 1.0f, ImVec2(0, 80));
   }
@@ -54,14 +66,43 @@ struct PulseGraph {
 
 struct SoundController {
   float volumeGlobal;
+  bool drawn = false;
+  APU::ScopeTaps scope;
   std::vector<PulseGraph> channels = {
-      PulseGraph("Square 1"), PulseGraph("Square 2"), PulseGraph("Noise", 0.2)};
+      PulseGraph("Square 1"), PulseGraph("Square 2"), PulseGraph("Noise")};
 
   void draw(NesBus &nes) {
+    drawn = true;
     ImGui::Checkbox("Mute", &Sound.muted);
-    channels[0].volume_ptr = &nes.apu.pulseChannel_1.volume;
-    channels[1].volume_ptr = &nes.apu.pulseChannel_2.volume;
-    channels[2].volume_ptr = &nes.apu.noiseChannel.volume;
+#if USE_AUDIO_THREAD
+    ImGui::Text("Buffered: %zu / %zu samples (rate x%.4f)",
+                Sound.sampleRing.size(), Sound.sampleRing.capacity(),
+                Sound.rateRatio.load());
+    ImGui::Text("Underruns: %u  Overruns: %u", Sound.underrunCount.load(),
+                Sound.overrunCount.load());
+#endif
+    bool audio_only = nes.ppu.audioOnly;
+    if (ImGui::Checkbox("Audio only (skip video)", &audio_only)) {
+      std::lock_guard<std::mutex> lock(nes.guard);
+      nes.setAudioOnly(audio_only);
+    }
+#if USE_AUDIO_THREAD
+    ImGui::Text("Emulation speed: x%.1f realtime",
+                nes.realtimeFactor[audio_only].load());
+    if (nes.audioOnlySpeedup() > 0) {
+      ImGui::SameLine();
+      ImGui::Text("(audio only x%.2f faster)", nes.audioOnlySpeedup());
+    }
+#endif
+    ImGui::SameLine();
+    bool nonlinear = nes.apu.mixer.mode == ApuMixer::MIX_NONLINEAR;
+    if (ImGui::Checkbox("NES DAC mixing", &nonlinear))
+      nes.apu.mixer.mode =
+          nonlinear ? ApuMixer::MIX_NONLINEAR : ApuMixer::MIX_LINEAR;
+    for (size_t i = 0; i < channels.size(); i++) {
+      channels[i].volume_ptr = &nes.apu.mixer.channels[i].gain;
+      channels[i].mute_ptr = &nes.apu.mixer.channels[i].mute;
+    }
     // ImGui::SliderFloat("Volume", &volumeGlobal, 0.0, 1.0);
 
     // ImGui::SliderInt("Pulse Channel 1 iterations",
@@ -70,10 +111,20 @@ struct SoundController {
     //                  &nes.apu.pulseChannel_2.pulse.harmonics, 1, 40);
     for (auto &c : channels) {
       std::string full_label = c.label + " volume";
+      ImGui::Checkbox(("##mute " + c.label).c_str(), c.mute_ptr);
+      ImGui::SameLine();
       ImGui::SliderFloat(full_label.c_str(), c.volume_ptr, 0.0, 1.0);
     }
-    for (auto &c : channels)
-      c.draw();
+    for (size_t i = 0; i < channels.size(); i++) {
+      channels[i].tap = &scope.channels[i];
+      channels[i].draw();
+    }
+  }
+
+  // the scope taps only record samples while the audio panel is on screen
+  void endFrame() {
+    scope.active.store(drawn, std::memory_order_relaxed);
+    drawn = false;
   }
 
 } soundController;
@@ -82,31 +133,27 @@ struct RomManager {
   std::string romDirectory;
   std::string activeRom;
   int activeRomIndex = 0;
-  std::vector<std::string> filenames;
+  std::vector<std::string> filenames; // visible in the rom list
+  std::vector<std::string> labels;
+
+  RomIndex index;
+  std::vector<RomIndex::Entry> entries; // latest index snapshot
+  uint32_t indexVersion = ~0u;
+  bool supportedOnly = true;
+  bool hideDuplicates = true;
 
   RomManager() {}
 
-  void setDirectory(const std::string &rom_dir) {
+  void setDirectory(const std::string &rom_dir, const std::string &index_path,
+                    bool threaded = USE_AUDIO_THREAD) {
     romDirectory = rom_dir;
-    filenames.clear();
-    for (const auto &entry : fs::directory_iterator(romDirectory)) {
-      std::string rom = entry.path().string();
-
-      auto it = rom.find(rom_dir);
-      if (it != std::string::npos) {
-        rom.erase(it, rom_dir.length());
-      }
-      std::string ext = ".nes";
-      if (rom.find(ext) == rom.size() - ext.size())
-        filenames.push_back(rom);
-    }
+    index.open(rom_dir, index_path, threaded);
+    refresh();
   }
 
   void setActiveRom(NesBus &nes, const std::string &rom_path) {
-    auto it = std::find(filenames.begin(), filenames.end(), rom_path);
-    if (it != filenames.end()) {
-      activeRomIndex = it - filenames.begin();
-    }
+    activeRom = rom_path;
+    refresh();
 
     if (nes.loadRom(getActiveRomPath()) < 0) {
       std::cerr << "Rom not found!\n";
@@ -114,30 +161,76 @@ struct RomManager {
     }
   }
 
-  std::string getActiveRomPath() const {
-    return romDirectory + filenames[activeRomIndex];
-  }
+  std::string getActiveRomPath() const { return romDirectory + activeRom; }
+
+  std::string getActiveRom() const { return activeRom; }
 
-  std::string getActiveRom() const { return filenames[activeRomIndex]; }
+  // rebuild the visible list from the index, the active rom always stays
+  void refresh() {
+    indexVersion = index.version;
+    entries = index.snapshot();
+    filenames.clear();
+    labels.clear();
+    std::set<std::string> seen;
+    bool has_active = false;
+    for (const RomIndex::Entry &e : entries) {
+      bool active = e.filename == activeRom;
+      if (!active && supportedOnly && !e.supported())
+        continue;
+      if (!active && hideDuplicates && e.valid && !seen.insert(e.sha1).second)
+        continue;
+      has_active |= active;
+      filenames.push_back(e.filename);
+      labels.push_back(e.valid ? e.filename + " (mapper " +
+                                     std::to_string(e.mapper) + ")"
+                               : e.filename + " (invalid)");
+    }
+    if (!has_active && !activeRom.empty()) { // not indexed yet
+      filenames.push_back(activeRom);
+      labels.push_back(activeRom);
+    }
+    auto it = std::find(filenames.begin(), filenames.end(), activeRom);
+    activeRomIndex = it - filenames.begin();
+  }
 
   void update(NesBus &nes) {
     ImGui::Text("Roms:");
     ImGui::Separator();
+    bool changed = index.version != indexVersion;
+    changed |= ImGui::Checkbox("Supported only", &supportedOnly);
+    ImGui::SameLine();
+    changed |= ImGui::Checkbox("Hide duplicates", &hideDuplicates);
+    if (index.scanning)
+      ImGui::Text("Indexing %zu / %zu (%zu hashed)", index.scanned.load(),
+                  index.total.load(), index.hashed.load());
+    if (changed)
+      refresh();
+
     int prev_index = activeRomIndex;
-    unsigned i = 0;
-    for (const std::string &f : filenames) {
-      ImGui::RadioButton(f.c_str(), &activeRomIndex, i++);
+    for (size_t i = 0; i < labels.size(); i++) {
+      ImGui::RadioButton(labels[i].c_str(), &activeRomIndex, i);
     }
     if (activeRomIndex != prev_index) {
+      std::string prev_rom = activeRom;
+      activeRom = filenames[activeRomIndex];
       nes.guard.lock();
       nes.init();
-      nes.loadRom(getActiveRomPath());
+      if (nes.loadRom(getActiveRomPath()) < 0) {
+        activeRom = prev_rom; // keep running the previous rom
+        activeRomIndex = prev_index;
+      }
       nes.reset();
       nes.guard.unlock();
     }
   }
 } romManager;
 
+// save state slots, deduplicated and compressed when "save_store" is set
+SaveStore saveStore;
+
+// save state files, written and read on a background thread
+StateIo stateIo;
+
 struct WindowLayout {
   bool horizontalPanel;
   double frameScale;
@@ -196,6 +289,7 @@ void update_palette_texture(NesBus &nes,
 }
 
 void updateControllerState(NesBus &nes, sdl::Gamepad &gamepad) {
+  uint8_t prev = nes.controller[0];
   for (auto &[k, v] : gamepad_button_map) {
     if (SDL_GameControllerGetButton(gamepad.ctrl, k)) {
       nes.controller[0] |= v;
@@ -203,16 +297,20 @@ void updateControllerState(NesBus &nes, sdl::Gamepad &gamepad) {
       nes.controller[0] &= (~v);
     }
   }
-
-  if (SDL_GameControllerGetButton(gamepad.ctrl,
-                                  SDL_CONTROLLER_BUTTON_LEFTSHOULDER)) {
-    nes.loadState("quicksave.save");
-  }
-
-  if (SDL_GameControllerGetButton(gamepad.ctrl,
-                                  SDL_CONTROLLER_BUTTON_RIGHTSHOULDER)) {
-    nes.saveState("quicksave.save");
-  }
+  latencyProbe.onInput(0, prev, nes.controller[0]);
+
+  // quickload / quicksave once per press, not every frame they're held
+  static bool load_held = false, save_held = false;
+  bool load = SDL_GameControllerGetButton(gamepad.ctrl,
+                                          SDL_CONTROLLER_BUTTON_LEFTSHOULDER);
+  bool save = SDL_GameControllerGetButton(gamepad.ctrl,
+                                          SDL_CONTROLLER_BUTTON_RIGHTSHOULDER);
+  if (load && !load_held)
+    stateIo.load(nes, "quicksave.save");
+  if (save && !save_held)
+    stateIo.save(nes, "quicksave.save");
+  load_held = load;
+  save_held = save;
 }
 
 void updateEmulatorOptions(NesBus &nes, sdl::WindowGL &window,
@@ -222,12 +320,16 @@ void updateEmulatorOptions(NesBus &nes, sdl::WindowGL &window,
 
   if (ImGui::Button("Save")) {
     print("saving ", romManager.getActiveRom(), ".save\n");
-    nes.saveState(romManager.getActiveRom() + ".save");
+    stateIo.save(nes, romManager.getActiveRom() + ".save");
   }
   ImGui::SameLine();
   if (ImGui::Button("Load")) {
     print("loading ", romManager.getActiveRom(), ".save\n");
-    nes.loadState(romManager.getActiveRom() + ".save");
+    stateIo.load(nes, romManager.getActiveRom() + ".save");
+  }
+  if (stateIo.store != nullptr) {
+    ImGui::SameLine();
+    ImGui::Text("%zu slots", stateIo.store->slotCount());
   }
 
   ImGui::Text("window size: (%d, %d)", window.dimensions.x,
@@ -249,6 +351,44 @@ void updateEmulatorOptions(NesBus &nes, sdl::WindowGL &window,
   }
 }
 
+void updateRewindInfo(RewindBuffer &rewind) {
+  ImGui::Button("Rewind (hold)");
+  // the keyboard shortcut sets `held` too, only release what we pressed
+  static bool pressed = false;
+  if (ImGui::IsItemActive() != pressed) {
+    pressed = !pressed;
+    rewind.held = pressed;
+  }
+  ImGui::SameLine();
+  ImGui::Text("%.1f s, %.1f / %.0f MB",
+              rewind.snapshots * rewind.interval / 60.0f,
+              rewind.bytesUsed / (1024.0f * 1024.0f),
+              rewind.budget() / (1024.0f * 1024.0f));
+}
+
+void updateRunAheadInfo(RunAhead &runAhead) {
+  int frames = runAhead.frames;
+  if (ImGui::SliderInt("Run-ahead frames", &frames, 0, 4))
+    runAhead.frames = frames;
+  bool threaded = runAhead.threaded;
+  if (ImGui::Checkbox("Run ahead on a second core", &threaded))
+    runAhead.threaded = threaded;
+}
+
+void updateNetplayInfo(RollbackSession &netplay) {
+  ImGui::Text("Netplay, player %d", netplay.player() + 1);
+  ImGui::Separator();
+  ImGui::Text("frame %u, inputs confirmed to %u",
+              (uint32_t)netplay.currentFrame, (uint32_t)netplay.confirmedFrame);
+  ImGui::Text("%u rollbacks, %u frames re-simulated, last %u",
+              (uint32_t)netplay.rollbacks, (uint32_t)netplay.resimulated,
+              (uint32_t)netplay.lastRollback);
+  ImGui::Text("%u frames waiting on the peer", (uint32_t)netplay.stalls);
+  if (netplay.desynced())
+    ImGui::TextColored(ImVec4(1, 0.3f, 0.3f, 1), "desynced at frame %u",
+                       (uint32_t)netplay.desyncFrame);
+}
+
 void updateCpuInfo(NesBus &nes, float &emulation_speed) {
   const auto &r = nes.cpu.registers;
   std::bitset<8> status{nes.cpu.registers.P};
@@ -264,18 +404,13 @@ void updateCpuInfo(NesBus &nes, float &emulation_speed) {
   ImGui::RadioButton("Cycle counting", &emulation_mode, 0);
   ImGui::RadioButton("Fastest", &emulation_mode, 1);
   if (emulation_mode != emulation_mode_prev) {
+    // the emulation thread calls into the table while it runs
+    std::lock_guard<std::mutex> lock(nes.guard);
     if (emulation_mode == 0) {
-      Instruction::setCycleCounts(nes.cpu.instructionMap);
-      // unknown instructions
-      for (const auto &i : dead_cells) {
-        nes.cpu.instructionMap[Instruction::Index::pack(i)].toUnknown();
-        nes.cpu.instructionMap[Instruction::Index::pack(i)].callback =
-            nes.cpu.instrCallbacks.at("NOP");
-        nes.cpu.instructionMap[Instruction::Index::pack(i)].addrmodeCallback =
-            nes.cpu.addrModeCallbacks.at("#");
-      }
+      // back to the real cycle counts
+      nes.cpu.createInstructionSet();
     } else if (emulation_mode == 1) {
-      for (auto &[k, v] : nes.cpu.instructionMap)
+      for (Instruction &v : nes.cpu.instructionMap)
         v.cycles = 2;
     }
   }
@@ -357,6 +492,30 @@ void updateApuInfo(NesBus &nes, SoundController &soundController) {
   soundController.draw(nes);
 }
 
+void updateLatencyInfo(LatencyProbe &probe, NesBus &nes) {
+  ImGui::NewLine();
+  ImGui::Text("Input latency");
+  ImGui::Separator();
+  ImGui::Checkbox("Measure", &probe.enabled);
+  ImGui::SameLine();
+  if (ImGui::Button("Clear"))
+    probe.clear();
+  ImGui::Text("%-6s %6s %8s %8s %8s %8s", "ms", "count", "p50", "p90", "p99",
+              "max");
+  for (int s = 0; s < LatencyProbe::STAGE_COUNT; s++) {
+    auto p = probe.percentiles((LatencyProbe::Stage)s);
+    ImGui::Text("%-6s %6zu %8.1f %8.1f %8.1f %8.1f",
+                LatencyProbe::stageNames[s], p.count, p.p50, p.p90, p.p99,
+                p.max);
+  }
+  ImGui::Text("Changes never seen by the game: %llu",
+              (unsigned long long)probe.dropped);
+  // should settle back to about the buffered audio after muting or rewinding
+  uint64_t emulated = nes.audioSampleCount, played = Sound.sampleClock.emulated;
+  ImGui::Text("Audio clock: %lld samples behind emulation",
+              (long long)(emulated - played));
+}
+
 void toggleButton(const char *labelTrue, const char *labelFalse, bool &toggle) {
   if (toggle) {
     if (ImGui::Button(labelTrue))
@@ -0,0 +1,130 @@
+#include "nes/bus.hpp"
+#include "nes/core.hpp"
+#include "nes/movie.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <set>
+#include <string>
+
+// Runs a rom as fast as possible with no window or audio device, for
+// throughput measurements and batch checks on machines without a display.
+//
+//   xnes_headless <rom> <frames> [movie.fm2] [options]
+//     --quiet          no per-frame hashes
+//     --no-video       don't draw pixels (the frame hash stays constant)
+//     --lean           draw palette indices only, see NesCore::Options::lean
+//     --dump a,b,c     write these frames as PPM images
+//     --dump-every n   write every nth frame
+//     --out dir        directory for dumped frames, default "."
+//
+// Prints one line per frame with a CRC-32 of the framebuffer and of CPU RAM
+// plus PRG-RAM, then the emulation speed.
+
+static const double NTSC_FPS = 60.0988;
+static const double CPU_MHZ = 1.789773;
+
+void usage() {
+  printf("usage: xnes_headless <rom> <frames> [movie.fm2] [--quiet] "
+         "[--no-video]\n"
+         "                     [--lean] [--dump a,b,c] [--dump-every n] "
+         "[--out dir]\n");
+}
+
+bool write_ppm(const std::string &filename, const NesPixel *pixels) {
+  FILE *file = fopen(filename.c_str(), "wb");
+  if (file == nullptr)
+    return false;
+  fprintf(file, "P6\n%u %u\n255\n", NesCore::WIDTH, NesCore::HEIGHT);
+  fwrite(pixels, sizeof(NesPixel), NesCore::WIDTH * NesCore::HEIGHT, file);
+  return fclose(file) == 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    usage();
+    return 2;
+  }
+  std::string rom = argv[1];
+  uint32_t frames = std::strtoul(argv[2], nullptr, 10);
+  std::string movie_file, out_dir = ".";
+  bool quiet = false, video = true, lean = false;
+  std::set<uint32_t> dumps;
+  uint32_t dump_every = 0;
+  for (int i = 3; i < argc; i++) {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (arg == "--quiet") {
+      quiet = true;
+    } else if (arg == "--no-video") {
+      video = false;
+    } else if (arg == "--lean") {
+      lean = true;
+    } else if (arg == "--dump" && has_value) {
+      for (char *s = argv[++i]; *s != '\0';) {
+        char *end;
+        dumps.insert(std::strtoul(s, &end, 10));
+        s = *end == ',' ? end + 1 : end + std::strlen(end);
+      }
+    } else if (arg == "--dump-every" && has_value) {
+      dump_every = std::strtoul(argv[++i], nullptr, 10);
+    } else if (arg == "--out" && has_value) {
+      out_dir = argv[++i];
+    } else if (arg[0] != '-' && movie_file.empty()) {
+      movie_file = arg;
+    } else {
+      usage();
+      return 2;
+    }
+  }
+
+  InputMovie movie;
+  if (!movie_file.empty() && !movie.load(movie_file)) {
+    printf("could not read %s\n", movie_file.c_str());
+    return 1;
+  }
+  NesCore::Options options;
+  options.sampleRate = 0;
+  options.video = video;
+  options.lean = lean;
+  NesCore core(options);
+  if (!core.loadRom(rom)) {
+    printf("could not load %s\n", rom.c_str());
+    return 1;
+  }
+  NesBus &nes = core.bus();
+
+  std::chrono::steady_clock::duration emulating{};
+  uint64_t cpu_cycles = 0;
+  for (uint32_t f = 0; f < frames; f++) {
+    InputMovie::Frame input = movie.at(f);
+    if (input.reset)
+      nes.reset();
+    nes.controller[0] = input.ports[0];
+    nes.controller[1] = input.ports[1];
+
+    uint32_t start_clock = nes.systemClockCount;
+    auto start = std::chrono::steady_clock::now();
+    nes.drawFrame();
+    emulating += std::chrono::steady_clock::now() - start;
+    cpu_cycles += (uint32_t)(nes.systemClockCount - start_clock) / 3;
+
+    if (!quiet)
+      printf("frame %u video %08x ram %08x\n", f, core.frameHash(),
+             core.ramHash());
+    if (dumps.count(f) || (dump_every > 0 && f % dump_every == 0)) {
+      char name[32];
+      snprintf(name, sizeof(name), "/frame_%06u.ppm", f);
+      if (!write_ppm(out_dir + name, core.frame()))
+        printf("could not write %s%s\n", out_dir.c_str(), name);
+    }
+  }
+
+  double seconds = std::chrono::duration<double>(emulating).count();
+  double fps = seconds > 0 ? frames / seconds : 0;
+  double mhz = seconds > 0 ? cpu_cycles / seconds / 1e6 : 0;
+  printf("%u frames in %.3f s: %.1f fps (%.2fx realtime), %.2f MHz CPU "
+         "(%.2fx a %.6f MHz NES)\n",
+         frames, seconds, fps, fps / NTSC_FPS, mhz, mhz / CPU_MHZ, CPU_MHZ);
+  return 0;
+}
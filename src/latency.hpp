@@ -0,0 +1,224 @@
+#pragma once
+#include "util/xn_ring_buffer.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+/**
+ * Maps samples leaving the audio queue back to NesBus::audioSampleCount
+ *
+ * Besides emulated audio, the emulation thread's blocks can hold silence
+ * (rewinding, waiting on a netplay peer), and samples that don't fit in the
+ * ring are dropped. So the producer marks each block with the index of its
+ * first emulated sample, and the consumer turns the samples it takes out,
+ * played or skipped while muted, back into sample indices.
+ *
+ * produced() from one thread and consumed() from one other, like the ring.
+ * */
+struct AudioClock {
+  // after consumed(): emulated samples [0, emulated) have left the queue
+  std::atomic<uint64_t> emulated{0};
+
+  // producer: `count` samples went into the queue, the first `emulated_count`
+  // of them emulated audio starting at sample index `first`
+  void produced(uint64_t first, size_t emulated_count, size_t count) {
+    if (count == 0)
+      return;
+    Mark mark{pushed, count, first, std::min(emulated_count, count)};
+    pushed += count;
+    marks.push(&mark, 1); // only fails if the consumer stopped
+  }
+
+  // consumer: `count` samples were taken out of the queue
+  void consumed(size_t count) {
+    taken += count;
+    uint64_t end = emulated.load(std::memory_order_relaxed);
+    while (current.count > 0 || marks.pop(&current, 1) == 1) {
+      uint64_t in_block = std::min<uint64_t>(taken - current.start,
+                                             current.count);
+      if (std::min<uint64_t>(in_block, current.emulated) > 0)
+        end = current.first + std::min<uint64_t>(in_block, current.emulated);
+      if (in_block < current.count)
+        break;
+      current.count = 0;
+    }
+    emulated.store(end, std::memory_order_relaxed);
+  }
+
+private:
+  struct Mark {
+    uint64_t start = 0; // queue position of the block's first sample
+    uint64_t count = 0;
+    uint64_t first = 0; // sample index of its first emulated sample
+    uint64_t emulated = 0;
+  };
+  xn::SpscRingBuffer<Mark> marks{256};
+  uint64_t pushed = 0; // producer
+  uint64_t taken = 0;  // consumer
+  Mark current;        // consumer, block taken from marks, count 0 for none
+};
+
+/**
+ * End-to-end input latency probe
+ *
+ * Follows each controller state change through the emulator and records the
+ * time from the input event to:
+ * - STAGE_READ:  the first $4016/$4017 latch that sees the new state
+ * - STAGE_VIDEO: the first presented frame rendered after that read
+ * - STAGE_AUDIO: the first block queued to OpenAL holding a sample generated
+ *                after that read
+ *
+ * Hooks are called from the input, emulation and audio threads, so all state
+ * is behind a mutex. Nothing is recorded unless `enabled` is set.
+ * */
+struct LatencyProbe {
+  using clock = std::chrono::steady_clock;
+  enum Stage { STAGE_READ, STAGE_VIDEO, STAGE_AUDIO, STAGE_COUNT };
+  static const size_t HISTORY = 1024;    // latencies kept per stage
+  static const size_t MAX_PENDING = 256; // events still being tracked
+
+  static constexpr const char *stageNames[STAGE_COUNT] = {"read", "video",
+                                                          "audio"};
+
+  struct Event {
+    clock::time_point input;
+    uint8_t port = 0;
+    uint8_t mask = 0;  // buttons that changed
+    uint8_t state = 0; // controller state after the change
+    bool read = false;
+    uint32_t frame = 0;  // first frame rendered after the read
+    uint64_t sample = 0; // first sample generated after the read
+    std::array<bool, STAGE_COUNT> done{};
+  };
+
+  struct Percentiles {
+    size_t count = 0;
+    float p50 = 0, p90 = 0, p99 = 0, max = 0; // milliseconds
+  };
+
+  bool enabled = false;
+  std::mutex guard;
+  std::deque<Event> pending;
+  std::array<std::vector<float>, STAGE_COUNT> history;
+  std::array<size_t, STAGE_COUNT> historyCount{};
+  uint64_t dropped = 0; // events superseded before the game saw them
+
+  // controller byte for `port` went from `prev` to `state`
+  void onInput(uint8_t port, uint8_t prev, uint8_t state) {
+    if (!enabled || prev == state)
+      return;
+    std::lock_guard<std::mutex> lock(guard);
+    Event e;
+    e.input = clock::now();
+    e.port = port;
+    e.mask = prev ^ state;
+    e.state = state;
+    // an unread event is superseded when the same buttons change again
+    for (auto it = pending.begin(); it != pending.end();) {
+      if (!it->read && it->port == port && (it->mask & e.mask)) {
+        it = pending.erase(it);
+        dropped++;
+      } else
+        ++it;
+    }
+    if (pending.size() == MAX_PENDING) {
+      dropped += !pending.front().read;
+      pending.pop_front();
+    }
+    pending.push_back(e);
+  }
+
+  // the CPU latched `state` from `port`. `frame` is the first frame rendered
+  // after this point, `sample` the index of the next audio sample
+  void onLatch(uint8_t port, uint8_t state, uint32_t frame, uint64_t sample) {
+    if (!enabled)
+      return;
+    std::lock_guard<std::mutex> lock(guard);
+    auto now = clock::now();
+    for (auto &e : pending) {
+      if (e.read || e.port != port || (state & e.mask) != (e.state & e.mask))
+        continue;
+      e.read = true;
+      e.frame = frame;
+      e.sample = sample;
+      complete(e, STAGE_READ, now);
+    }
+    prune();
+  }
+
+  // a frame was presented on screen
+  void onPresent(uint32_t frame) {
+    if (!enabled)
+      return;
+    std::lock_guard<std::mutex> lock(guard);
+    auto now = clock::now();
+    for (auto &e : pending)
+      if (e.read && !e.done[STAGE_VIDEO] && (int32_t)(frame - e.frame) >= 0)
+        complete(e, STAGE_VIDEO, now);
+    prune();
+  }
+
+  // audio samples [0, samples) have been queued for playback
+  void onAudioQueued(uint64_t samples) {
+    if (!enabled)
+      return;
+    std::lock_guard<std::mutex> lock(guard);
+    auto now = clock::now();
+    for (auto &e : pending)
+      if (e.read && !e.done[STAGE_AUDIO] && samples > e.sample)
+        complete(e, STAGE_AUDIO, now);
+    prune();
+  }
+
+  Percentiles percentiles(Stage stage) {
+    std::lock_guard<std::mutex> lock(guard);
+    Percentiles p;
+    std::vector<float> sorted = history[stage];
+    p.count = historyCount[stage];
+    if (sorted.empty())
+      return p;
+    std::sort(sorted.begin(), sorted.end());
+    auto at = [&](float q) {
+      return sorted[std::min(sorted.size() - 1, (size_t)(q * sorted.size()))];
+    };
+    p.p50 = at(0.5f);
+    p.p90 = at(0.9f);
+    p.p99 = at(0.99f);
+    p.max = sorted.back();
+    return p;
+  }
+
+  void clear() {
+    std::lock_guard<std::mutex> lock(guard);
+    pending.clear();
+    for (auto &h : history)
+      h.clear();
+    historyCount.fill(0);
+    dropped = 0;
+  }
+
+private:
+  void complete(Event &e, Stage stage, clock::time_point now) {
+    e.done[stage] = true;
+    float ms = std::chrono::duration<float, std::milli>(now - e.input).count();
+    auto &h = history[stage];
+    if (h.size() < HISTORY)
+      h.push_back(ms);
+    else
+      h[historyCount[stage] % HISTORY] = ms;
+    historyCount[stage]++;
+  }
+
+  // drop events that made it through every stage
+  void prune() {
+    while (!pending.empty() && pending.front().done[STAGE_READ] &&
+           pending.front().done[STAGE_VIDEO] &&
+           pending.front().done[STAGE_AUDIO])
+      pending.pop_front();
+  }
+} latencyProbe;
@@ -0,0 +1,147 @@
+#include "nes/lockstep.hpp"
+#include <cstdio>
+#include <ctime>
+#include <string>
+#include <vector>
+
+// Runs a rom on a LockstepGroup and reports how well its lanes would stay
+// in lockstep on a SIMD machine, checking every frame against instances run
+// by NesBus alone.
+//
+//   xnes_lockstep <rom> [options]
+//     --lanes n        instances, at most 16, default 16
+//     --frames n       default 600
+//     --schedule s     behind (default) or largest, see LockstepGroup
+//     --same-input     every lane gets the same buttons, else each lane
+//                      holds its own random buttons for 1 to 32 frames
+//     --seed n         for the random buttons, default 1
+//
+// Exits with 1 if any lane's frame or RAM differs from its reference.
+
+void usage() {
+  printf("usage: xnes_lockstep <rom> [--lanes n] [--frames n] "
+         "[--schedule behind|largest]\n"
+         "                     [--same-input] [--seed n]\n");
+}
+
+// per lane buttons, like an agent with a random policy and frame skip
+struct RandomInput {
+  uint32_t state, hold = 0;
+  uint8_t buttons = 0;
+
+  explicit RandomInput(uint32_t seed) : state(seed * 2654435761u | 1) {}
+
+  uint32_t next() {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+  }
+
+  uint8_t frame() {
+    if (hold == 0) {
+      buttons = next() >> 24;
+      hold = 1 + next() % 32;
+    }
+    hold--;
+    return buttons;
+  }
+};
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    usage();
+    return 2;
+  }
+  uint32_t lanes = LockstepGroup::MAX_LANES, frames = 600, seed = 1;
+  bool same_input = false;
+  LockstepGroup::Schedule schedule = LockstepGroup::Schedule::Behind;
+  for (int i = 2; i < argc; i++) {
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (arg == "--lanes" && has_value) {
+      lanes = std::clamp<uint32_t>(std::strtoul(argv[++i], nullptr, 10), 1,
+                                   LockstepGroup::MAX_LANES);
+    } else if (arg == "--frames" && has_value) {
+      frames = std::strtoul(argv[++i], nullptr, 10);
+    } else if (arg == "--schedule" && has_value) {
+      std::string name = argv[++i];
+      if (name == "largest")
+        schedule = LockstepGroup::Schedule::Largest;
+      else if (name != "behind") {
+        usage();
+        return 2;
+      }
+    } else if (arg == "--same-input") {
+      same_input = true;
+    } else if (arg == "--seed" && has_value) {
+      seed = std::strtoul(argv[++i], nullptr, 10);
+    } else {
+      usage();
+      return 2;
+    }
+  }
+
+  LockstepGroup group(argv[1], lanes);
+  std::vector<std::unique_ptr<NesCore>> references;
+  NesCore::Options options;
+  options.sampleRate = 0;
+  options.lean = true;
+  for (uint32_t i = 0; i < lanes && group.ok(); i++) {
+    references.push_back(std::make_unique<NesCore>(options));
+    references.back()->loadRom(argv[1]);
+  }
+  if (!group.ok()) {
+    printf("could not load %s\n", argv[1]);
+    return 1;
+  }
+  group.schedule = schedule;
+
+  std::vector<RandomInput> inputs;
+  for (uint32_t i = 0; i < lanes; i++)
+    inputs.emplace_back(seed + (same_input ? 0 : i));
+
+  std::clock_t lockstep_time = 0, reference_time = 0;
+  for (uint32_t f = 0; f < frames; f++) {
+    for (uint32_t i = 0; i < lanes; i++) {
+      uint8_t buttons = inputs[i].frame();
+      group.setInput(i, 0, buttons);
+      references[i]->setInput(0, buttons);
+    }
+
+    std::clock_t start = std::clock();
+    group.stepFrame();
+    lockstep_time += std::clock() - start;
+    start = std::clock();
+    for (auto &reference : references)
+      reference->bus().drawFrame();
+    reference_time += std::clock() - start;
+
+    for (uint32_t i = 0; i < lanes; i++) {
+      NesCore &lane = group.lane(i);
+      if (lane.frameHash() != references[i]->frameHash() ||
+          lane.ramHash() != references[i]->ramHash()) {
+        printf("lane %u differs from NesBus at frame %u\n", i, f);
+        return 1;
+      }
+    }
+  }
+
+  const LockstepGroup::Stats &stats = group.stats();
+  printf("%u lanes, %u frames, all match NesBus\n", lanes, frames);
+  printf("utilization %.1f%%, %.1f instructions issued per frame, %.1f%% to "
+         "every running lane\n",
+         100 * stats.utilization(lanes),
+         stats.frames > 0 ? (double)stats.issues / stats.frames : 0,
+         stats.issues > 0 ? 100.0 * stats.fullIssues / stats.issues : 0);
+  printf("issues by active lanes:");
+  for (uint32_t n = 1; n <= lanes; n++)
+    printf(" %u:%.1f%%", n,
+           stats.issues > 0 ? 100.0 * stats.groupSizes[n] / stats.issues : 0);
+  printf("\n");
+  double total = (double)lanes * frames;
+  printf("lockstep %.1f fps, NesBus %.1f fps\n",
+         lockstep_time > 0 ? total * CLOCKS_PER_SEC / lockstep_time : 0,
+         reference_time > 0 ? total * CLOCKS_PER_SEC / reference_time : 0);
+  return 0;
+}
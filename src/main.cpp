@@ -5,8 +5,10 @@ using namespace xn;
 // process window events, draw next emulation frame
 void draw_frame();
 
-// sound mixer callback, only used if multithreading is supported
-float sound_update();
+// audio producer callback, runs on the emulation thread if multithreading is
+// supported
+uint32_t sound_update(float *samples, uint32_t count, float rate_ratio,
+                      uint64_t &first);
 
 // user input handlers
 void keyboardCallback(const SDL_Event &e);
@@ -14,6 +16,13 @@ void gamepadCallback(const SDL_Event &e);
 void touchCallback(const SDL_Event &e);
 void windowEventCallback(const SDL_WindowEvent &e);
 
+// run whole netplay frames to fill the audio buffer
+uint32_t netplay_update(float *samples, uint32_t count, uint64_t &first);
+
+// while rewind is held, go back one snapshot and render it instead of
+// emulating forward
+bool rewind_step();
+
 // configure rom folder, default rom, fullscreen, mute, other stuff
 json settings;
 
@@ -25,6 +34,16 @@ json settings;
 //   (iNES 000, 001, 002, & 004)
 NesBus nes;
 
+// recent history for rewinding, filled as frames are emulated
+RewindBuffer rewindBuffer;
+
+// shows frames emulated ahead of the real state to hide games' input lag
+RunAhead runAhead;
+
+// two player rollback netplay, set up from the netplay_* settings
+std::unique_ptr<NetTransport> netTransport;
+std::unique_ptr<RollbackSession> netplay;
+
 SpriteSheet NesTouchButton::ControllerSprites;
 std::vector<NesTouchButton> buttons;
 std::array<xn::gl::Texture2D, 2> patternImages;
@@ -43,11 +62,42 @@ int main(int argc, char **argv) {
   settings = load_json_file(settings_path);
 
   print("Loading rom: ", settings["rom"], '\n');
-  romManager.setDirectory(settings["rom_folder"]);
+  std::string rom_index = "rom_index.json";
+  if (!settings["rom_index"].is_null())
+    rom_index = settings["rom_index"];
+  romManager.setDirectory(settings["rom_folder"], rom_index);
+  std::string netplay_peer;
+  if (!settings["netplay_peer"].is_null())
+    netplay_peer = settings["netplay_peer"];
+  // both players start from a blank cartridge
+  nes.batterySaves = netplay_peer.empty();
   romManager.setActiveRom(nes, settings["rom"]);
   DUMP(nes.rom->header.getMapperNumber());
 
   nes.init();
+  nes.apu.scope = &soundController.scope;
+  size_t rewind_mb = 32;
+  if (!settings["rewind_buffer_mb"].is_null())
+    rewind_mb = settings["rewind_buffer_mb"];
+  if (!settings["rewind_interval"].is_null())
+    rewindBuffer.interval = std::max(1u, (uint32_t)settings["rewind_interval"]);
+  rewindBuffer.setBudget(rewind_mb << 20);
+  if (!settings["save_store"].is_null()) {
+    if (saveStore.open(settings["save_store"]))
+      stateIo.store = &saveStore;
+    else
+      print("could not open save store ", settings["save_store"], '\n');
+  }
+  if (!settings["run_ahead"].is_null())
+    runAhead.frames = (uint32_t)settings["run_ahead"];
+  if (!settings["run_ahead_threaded"].is_null())
+    runAhead.threaded = (bool)settings["run_ahead_threaded"];
+  latencyProbe.enabled =
+      !settings["latency_probe"].is_null() && (bool)settings["latency_probe"];
+  nes.controllerLatchCallback = [](uint8_t port, uint8_t state) {
+    latencyProbe.onLatch(port, state, nes.ppu.framecount + 1,
+                         nes.audioSampleCount);
+  };
 
   print("Creating window...\n");
   window = sdl::WindowGL(settings);
@@ -63,9 +113,31 @@ int main(int argc, char **argv) {
   print("Creating audio context...\n");
   nes.reset();
   nes.setSampleFrequency(settings["audio_sample_rate"], emulation_speed);
+#ifndef __EMSCRIPTEN__
+  if (!netplay_peer.empty()) {
+    auto udp = std::make_unique<UdpTransport>();
+    size_t colon = netplay_peer.rfind(':');
+    uint16_t port = settings.value("netplay_port", 7100);
+    if (colon != std::string::npos &&
+        udp->open(port, netplay_peer.substr(0, colon),
+                  (uint16_t)std::stoi(netplay_peer.substr(colon + 1)))) {
+      netTransport = std::move(udp);
+      netplay = std::make_unique<RollbackSession>(
+          *netTransport, settings.value("netplay_player", 0));
+      print("Netplay on port ", port, " with ", netplay_peer, '\n');
+    } else {
+      print("could not start netplay with ", netplay_peer, '\n');
+    }
+  }
+#endif
+  // the callbacks run on the threads init() starts, so they and everything
+  // they read are set up first
+  Sound.setProducerCallback(sound_update);
+  Sound.queuedCallback = [](uint64_t samples) {
+    latencyProbe.onAudioQueued(samples);
+  };
   Sound.init(USE_AUDIO_THREAD, settings["audio_sample_rate"], 1, 8,
              512 * (1 + !USE_AUDIO_THREAD));
-  Sound.setMixerCallback(sound_update);
   Sound.muted = true;
   print("Creating textures...\n");
   auto &framebuffer = nes.ppu.getFramebuffer().buffer;
@@ -93,33 +165,68 @@ int main(int argc, char **argv) {
     draw_frame();
   }
 
+  if (latencyProbe.enabled) {
+    for (int s = 0; s < LatencyProbe::STAGE_COUNT; s++) {
+      auto p = latencyProbe.percentiles((LatencyProbe::Stage)s);
+      printf("input -> %-5s latency (ms, n=%zu): p50 %.1f  p90 %.1f  "
+             "p99 %.1f  max %.1f\n",
+             LatencyProbe::stageNames[s], p.count, p.p50, p.p90, p.p99, p.max);
+    }
+  }
+
   print("Closing window\n");
   window.destroy();
   Sound.destroy();
+  stateIo.stop();
   return 0;
 #endif
 }
 
-float sound_update() {
-  nes.guard.lock();
-  while (!nes.clock()) {
-  };
-#ifndef __EMSCRIPTEN__
-  std::array<float, 3> samples = {(float)nes.apu.pulseChannel_1.output,
-                                  (float)nes.apu.pulseChannel_2.output,
-                                  (float)nes.apu.noiseChannel.output};
-  unsigned i = 0;
-  for (PulseGraph &c : soundController.channels) {
-    c.addSample(samples[i++]);
+uint32_t sound_update(float *samples, uint32_t count, float rate_ratio,
+                      uint64_t &first) {
+  std::lock_guard<std::mutex> lock(nes.guard);
+  nes.setSampleFrequency(Sound.sampleRate * rate_ratio, emulation_speed);
+  if (netplay != nullptr) {
+    // loading states or rewinding would desync the players
+    return netplay_update(samples, count, first);
   }
-#endif
-  float sample = static_cast<float>(nes.audioSample);
-  nes.guard.unlock();
-  return sample;
+  stateIo.apply(nes);
+  if (rewind_step()) {
+    std::fill(samples, samples + count, 0.0f);
+    return 0;
+  }
+  first = nes.audioSampleCount;
+  nes.clockSamples(samples, count);
+  rewindBuffer.capture(nes);
+  runAhead.update(nes);
+  return count;
+}
+
+uint32_t netplay_update(float *samples, uint32_t count, uint64_t &first) {
+  static std::vector<float> pending;
+  while (pending.size() < count && netplay->advance(nes, &pending))
+    ;
+  // pending holds the newest samples
+  first = nes.audioSampleCount - pending.size();
+  // silence while waiting on the peer
+  size_t n = std::min<size_t>(count, pending.size());
+  std::copy_n(pending.begin(), n, samples);
+  std::fill(samples + n, samples + count, 0.0f);
+  pending.erase(pending.begin(), pending.begin() + n);
+  return n;
+}
+
+bool rewind_step() {
+  if (!rewindBuffer.held)
+    return false;
+  if (rewindBuffer.step(nes)) {
+    nes.ppu.frameComplete = false;
+    nes.drawFrame();
+  }
+  return true;
 }
 
 void draw_frame() {
-  nes.setSampleFrequency(Sound.sampleRate, emulation_speed);
   // #if USE_AUDIO_THREAD
   //  if (!nes.ppu.frameComplete)
   //    return;
@@ -131,27 +238,40 @@ void draw_frame() {
 
   if (window.mobile && window.gamepads.size() == 0 && !show_info) {
     NesTouchButton::update_controller_state(buttons, window.touches);
+    uint8_t prev = nes.controller[0];
     nes.controller[0] = NesTouchButton::get_controller_byte(buttons);
+    latencyProbe.onInput(0, prev, nes.controller[0]);
   }
 
 #if !USE_AUDIO_THREAD
   static std::vector<ALuint> vProcessed;
   static std::queue<float> qToProcess;
-  if (nes.apu.enabled) {
-    while (!nes.ppu.frameComplete) {
-      if (nes.clock())
-        qToProcess.push(static_cast<float>(nes.audioSample));
+  nes.setSampleFrequency(Sound.sampleRate, emulation_speed);
+  stateIo.apply(nes);
+  if (!rewind_step()) {
+    if (nes.apu.enabled) {
+      uint64_t first = nes.audioSampleCount;
+      size_t queued = qToProcess.size();
+      while (!nes.ppu.frameComplete) {
+        if (nes.clock())
+          qToProcess.push(nes.audioSample);
+      }
+      nes.ppu.frameComplete = false;
+      queued = qToProcess.size() - queued;
+      Sound.sampleClock.produced(first, queued, queued);
+      Sound.step(vProcessed, qToProcess);
+    } else {
+      nes.drawFrame();
+      nes.ppu.frameComplete = false;
     }
-    nes.ppu.frameComplete = false;
-    Sound.step(vProcessed, qToProcess);
-  } else {
-    nes.drawFrame();
-    nes.ppu.frameComplete = false;
+    rewindBuffer.capture(nes);
+    runAhead.update(nes);
   }
 #endif
 
   const uint32_t padding = 32;
   WindowLayout layout(window, frameImage);
+  uint32_t presented_frame = 0;
 
   // draw NES frame
   {
@@ -166,7 +286,14 @@ void draw_frame() {
                       ImGuiWindowFlags_NoScrollbar);
     ImGui::Text("Average %.3f ms/frame (%.1f FPS)",
                 1000.0f / ImGui::GetIO().Framerate, ImGui::GetIO().Framerate);
-    upload_texture(frameImage, nes.ppu.getFramebuffer().buffer.data());
+    if (runAhead.enabled() && !rewindBuffer.held && netplay == nullptr) {
+      upload_texture(frameImage, runAhead.frame().buffer.data());
+      presented_frame = runAhead.presentedFrame;
+    } else {
+      // the inactive framebuffer holds the last completed frame
+      presented_frame = nes.ppu.framecount - 1;
+      upload_texture(frameImage, nes.ppu.getFramebuffer().buffer.data());
+    }
     imgui_draw_texture(frameImage, layout.frameScale);
     ImGui::EndChild();
   }
@@ -189,6 +316,10 @@ void draw_frame() {
       if (ImGui::Button("Close"))
         window.shouldClose = true;
       updateEmulatorOptions(nes, window, romManager);
+      updateRewindInfo(rewindBuffer);
+      updateRunAheadInfo(runAhead);
+      if (netplay != nullptr)
+        updateNetplayInfo(*netplay);
       ImGui::NewLine();
 
       if (ImGui::TreeNode("More Stuff")) {
@@ -202,6 +333,9 @@ void draw_frame() {
         ImGui::NewLine();
 
         updateApuInfo(nes, soundController);
+        ImGui::NewLine();
+
+        updateLatencyInfo(latencyProbe, nes);
         ImGui::TreePop();
       }
 
@@ -215,10 +349,13 @@ void draw_frame() {
 
   ImGui::EndChild();
   ImGui::End();
+  soundController.endFrame();
   glClearColor(0.5, 0, 0, 1);
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
   window.imguiDrawFrame();
   window.flip();
+  latencyProbe.onPresent(presented_frame);
+  nes.rom->requestSaveRamFlush();
 }
 
 void windowEventCallback(const SDL_WindowEvent &e) {
@@ -254,8 +391,10 @@ void touchCallback(const SDL_Event &e) {
 
 // clang-format off
 void map_key(Uint32 eventType, uint8_t controllerFlag) {
+  uint8_t prev = nes.controller[0];
   if (eventType == SDL_KEYDOWN)    nes.controller[0] |= controllerFlag;
   else if (eventType == SDL_KEYUP) nes.controller[0] &= (~controllerFlag);
+  latencyProbe.onInput(0, prev, nes.controller[0]);
 }
 
 void keyboardCallback(const SDL_Event &e) {
@@ -269,6 +408,7 @@ void keyboardCallback(const SDL_Event &e) {
   case SDLK_DOWN:   map_key(e.key.type, 0x04); break;
   case SDLK_LEFT:   map_key(e.key.type, 0x02); break;
   case SDLK_RIGHT:  map_key(e.key.type, 0x01); break;
+  case SDLK_BACKSPACE: rewindBuffer.held = e.key.type == SDL_KEYDOWN; break;
   default: break;
   }
 }
@@ -2,6 +2,9 @@
 #ifndef _USE_MATH_DEFINES
 #define _USE_MATH_DEFINES
 #endif
+#include "../util/xn_ring_buffer.hpp"
+#include "mixer.hpp"
+#include "state.hpp"
 #include <array>
 #include <cmath>
 #include <cstdint>
@@ -26,6 +29,30 @@ static const std::vector<uint8_t> triangleSequence = {
 
 const static AudioFloat PI2 = M_PI * M_PI;
 struct APU {
+  // per channel output history for oscilloscope displays. Samples are
+  // batched and published in blocks, readers take snapshots from any thread
+  struct ScopeTaps {
+    static const size_t SAMPLES = 512;
+    static const size_t BLOCK_SIZE = 64;
+    static const size_t CHANNELS = 3;
+
+    std::atomic<bool> active{false};
+    std::array<xn::ScopeRingBuffer<float, SAMPLES>, CHANNELS> channels;
+    std::array<std::array<float, BLOCK_SIZE>, CHANNELS> block;
+    size_t blockCount = 0;
+
+    void add(float pulse_1, float pulse_2, float noise) {
+      block[0][blockCount] = pulse_1;
+      block[1][blockCount] = pulse_2;
+      block[2][blockCount] = noise;
+      if (++blockCount == BLOCK_SIZE) {
+        for (size_t c = 0; c < CHANNELS; c++)
+          channels[c].push(block[c].data(), BLOCK_SIZE);
+        blockCount = 0;
+      }
+    }
+  };
+
   // https://en.wikipedia.org/wiki/Bhaskara_I%27s_sine_approximation_formula
   static float bhaskara_sin(float t) {
     t = fmod(t, 2 * M_PI);
@@ -196,7 +223,7 @@ struct APU {
   struct PulseChannel {
     bool enable = false;
     bool halt = false;
-    float volume = 0.1;
+    uint8_t level = 0; // 4-bit DAC input
     AudioFloat sample = 0;
     AudioFloat output = 0;
     Sequencer sequencer;
@@ -267,26 +294,33 @@ struct APU {
 
       if (!enable)
         output = 0;
+
+      level = (enable && counter.counter > 0 && sequencer.timer >= 8 &&
+               !sweeper.muted && sequencer.output)
+                  ? (uint8_t)envelope.output
+                  : 0;
     }
   };
 
   struct NoiseChannel {
     bool enable = false;
     bool halt = false;
-    float volume = 0.2;
+    uint8_t level = 0; // 4-bit DAC input
     PulseEnvelope envelope;
     PulseCounter counter;
     Sequencer sequencer;
-    AudioFloat sample;
-    AudioFloat output;
+    AudioFloat sample = 0;
+    AudioFloat output = 0;
   } noiseChannel;
 
   const AudioFloat CLOCK_TIMESTEP = (0.3333333333 / (1789773));
   AudioFloat systemTime = 0;
-  uint32_t frameClockCount;
-  uint32_t clockCount;
+  uint32_t frameClockCount = 0;
+  uint32_t clockCount = 0;
   bool useRaw = false;
   bool enabled = true;
+  ScopeTaps *scope = nullptr; // optional, owned by the frontend
+  ApuMixer mixer;
 
   PulseChannel pulseChannel_1;
   PulseChannel pulseChannel_2;
@@ -396,6 +430,12 @@ struct APU {
 
         if (!noiseChannel.enable)
           noiseChannel.output = 0;
+
+        noiseChannel.level =
+            (noiseChannel.enable && noiseChannel.counter.counter > 0 &&
+             noiseChannel.sequencer.timer >= 8 && noiseChannel.sequencer.output)
+                ? (uint8_t)noiseChannel.envelope.output
+                : 0;
       }
 
       pulseChannel_1.sweeper.track(pulseChannel_1.sequencer.reload);
@@ -405,15 +445,77 @@ struct APU {
     }
   }
 
-  AudioFloat getSample() {
-    // if (useRaw) {
-    // return (pulseChannel_1.sample - 0.5);
-    // }
-    // return ((pulseChannel_1.sample) + (pulseChannel_2.sample)) * 0.5;
-    // return (pulseChannel_2.sample);
+  // channel and frame counter state, not the mixer or scope settings
+  void serializeState(StateArchive &ar) {
+    auto sequencer = [&](Sequencer &s) {
+      ar(s.sequence);
+      ar(s.nextSequence);
+      ar(s.timer);
+      ar(s.reload);
+      ar(s.output);
+    };
+    auto envelope = [&](PulseEnvelope &e) {
+      ar(e.start);
+      ar(e.disable);
+      ar(e.dividerCount);
+      ar(e.volume);
+      ar(e.output);
+      ar(e.decayCount);
+    };
+    for (PulseChannel *c : {&pulseChannel_1, &pulseChannel_2}) {
+      ar(c->enable);
+      ar(c->halt);
+      ar(c->level);
+      ar(c->sample);
+      ar(c->output);
+      sequencer(c->sequencer);
+      ar(c->pulse.frequency);
+      ar(c->pulse.dutycycle);
+      ar(c->pulse.amplitude);
+      ar(c->pulse.prev_sample);
+      envelope(c->envelope);
+      ar(c->counter.counter);
+      ar(c->sweeper.enabled);
+      ar(c->sweeper.down);
+      ar(c->sweeper.reload);
+      ar(c->sweeper.muted);
+      ar(c->sweeper.shift);
+      ar(c->sweeper.timer);
+      ar(c->sweeper.period);
+      ar(c->sweeper.change);
+    }
+    ar(noiseChannel.enable);
+    ar(noiseChannel.halt);
+    ar(noiseChannel.level);
+    envelope(noiseChannel.envelope);
+    ar(noiseChannel.counter.counter);
+    sequencer(noiseChannel.sequencer);
+    ar(noiseChannel.sample);
+    ar(noiseChannel.output);
+
+    ar(systemTime);
+    ar(frameClockCount);
+    ar(clockCount);
+  }
+
+  // record channel outputs for the current sample, if anyone is watching
+  void captureScope() {
+    if (scope != nullptr && scope->active.load(std::memory_order_relaxed))
+      scope->add((float)pulseChannel_1.output, (float)pulseChannel_2.output,
+                 (float)noiseChannel.output);
+  }
+
+  // append the current channel state to a block for ApuMixer::mix()
+  void captureSample(ApuMixer::Block &block) {
+    block.add((float)pulseChannel_1.output, (float)pulseChannel_2.output,
+              (float)noiseChannel.output, pulseChannel_1.level,
+              pulseChannel_2.level, noiseChannel.level);
+  }
 
-    return (pulseChannel_1.output) * pulseChannel_1.volume +
-           (pulseChannel_2.output) * pulseChannel_2.volume +
-           (noiseChannel.output) * noiseChannel.volume;
+  float getSample() {
+    return mixer.mixSample(
+        (float)pulseChannel_1.output, (float)pulseChannel_2.output,
+        (float)noiseChannel.output, pulseChannel_1.level,
+        pulseChannel_2.level, noiseChannel.level);
   }
-};
\ No newline at end of file
+};
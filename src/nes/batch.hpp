@@ -0,0 +1,200 @@
+#pragma once
+#include "bus.hpp"
+#include "core.hpp"
+#include "movie.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/**
+ * Runs many emulator instances at once on a work-stealing thread pool
+ *
+ * Each job is a rom, a frame count and an optional input movie, emulated by
+ * its own NesCore. Jobs run in slices of `sliceFrames` frames: a worker takes
+ * the job at the front of its queue, runs one slice and puts it at the back,
+ * so all instances advance together. A worker with an empty queue steals
+ * from the back of another's, so a few long jobs don't leave cores idle.
+ *
+ * A job's NesCore is created on its first slice and freed when it is done,
+ * and is lean (NesCore::Options::lean) so thousands of jobs fit in memory.
+ * Instances share nothing but the read-only rom images (NesRom::Image), so
+ * results don't depend on the thread count or the schedule.
+ * */
+struct BatchRunner {
+  struct Job {
+    std::string rom;
+    uint32_t frames = 0;
+    std::shared_ptr<const InputMovie> movie; // optional
+
+    // results
+    bool ok = false;
+    uint32_t framesRun = 0;
+    uint32_t frameHash = 0, ramHash = 0; // after the last frame
+    double seconds = 0;                  // thread time spent on it
+  };
+
+  struct Options {
+    unsigned threads = 0;       // 0 for one per hardware thread
+    uint32_t sliceFrames = 60;  // frames per turn
+    bool pinThreads = false;    // worker i only runs on CPU i (Linux)
+    bool video = true;          // false skips drawing pixels
+  };
+
+  struct Stats {
+    uint64_t frames = 0;
+    double seconds = 0; // wall clock
+    unsigned threads = 0;
+    uint64_t steals = 0;
+    double fps() const { return seconds > 0 ? frames / seconds : 0; }
+  };
+
+  // run every job to completion, filling in their results
+  static Stats run(std::vector<Job> &jobs, const Options &options) {
+    Stats stats;
+    stats.threads = options.threads > 0
+                        ? options.threads
+                        : std::max(1u, std::thread::hardware_concurrency());
+    stats.threads = std::max(1u, std::min<unsigned>(stats.threads,
+                                                    (unsigned)jobs.size()));
+
+    std::vector<Task> tasks(jobs.size());
+    std::vector<Queue> queues(stats.threads);
+    for (size_t i = 0; i < jobs.size(); i++) {
+      tasks[i].job = &jobs[i];
+      queues[i % queues.size()].tasks.push_back(&tasks[i]);
+    }
+    Pool pool{queues, options, {(uint32_t)jobs.size()}, {0}, {0}};
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < stats.threads; i++)
+      workers.emplace_back(work, std::ref(pool), i);
+    for (auto &w : workers)
+      w.join();
+    stats.seconds = std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+    stats.frames = pool.frames;
+    stats.steals = pool.steals;
+    return stats;
+  }
+
+private:
+  struct Task {
+    Job *job = nullptr;
+    std::unique_ptr<NesCore> core;
+  };
+
+  struct Queue {
+    std::mutex guard;
+    std::deque<Task *> tasks;
+  };
+
+  struct Pool {
+    std::vector<Queue> &queues;
+    const Options &options;
+    std::atomic<uint32_t> remaining; // jobs not finished
+    std::atomic<uint64_t> frames;
+    std::atomic<uint64_t> steals;
+  };
+
+  static void work(Pool &pool, unsigned index) {
+#ifdef __linux__
+    if (pool.options.pinThreads) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(index % std::max(1u, std::thread::hardware_concurrency()),
+              &set);
+      pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+#endif
+    Queue &own = pool.queues[index];
+    while (pool.remaining > 0) {
+      Task *task = take(own, true);
+      for (size_t k = 1; task == nullptr && k < pool.queues.size(); k++) {
+        task = take(pool.queues[(index + k) % pool.queues.size()], false);
+        if (task != nullptr)
+          pool.steals++;
+      }
+      if (task == nullptr) {
+        // the rest is being run by other workers
+        std::this_thread::yield();
+        continue;
+      }
+
+      if (runSlice(*task, pool)) {
+        pool.remaining--;
+      } else {
+        std::lock_guard<std::mutex> lock(own.guard);
+        own.tasks.push_back(task);
+      }
+    }
+  }
+
+  static Task *take(Queue &queue, bool front) {
+    std::lock_guard<std::mutex> lock(queue.guard);
+    if (queue.tasks.empty())
+      return nullptr;
+    Task *task = front ? queue.tasks.front() : queue.tasks.back();
+    if (front)
+      queue.tasks.pop_front();
+    else
+      queue.tasks.pop_back();
+    return task;
+  }
+
+  // run one slice, true when the job is done
+  static bool runSlice(Task &task, Pool &pool) {
+    Job &job = *task.job;
+    auto start = std::chrono::steady_clock::now();
+    if (task.core == nullptr) {
+      NesCore::Options options;
+      options.sampleRate = 0;
+      options.video = pool.options.video;
+      options.lean = true; // only the last frame is read, as RGB
+      task.core = std::make_unique<NesCore>(options);
+      if (!task.core->loadRom(job.rom)) {
+        task.core.reset();
+        return true;
+      }
+    }
+
+    NesBus &nes = task.core->bus();
+    uint32_t begin = job.framesRun;
+    uint32_t end =
+        std::min(job.frames, begin + std::max(1u, pool.options.sliceFrames));
+    for (; job.framesRun < end; job.framesRun++) {
+      if (job.movie != nullptr) {
+        InputMovie::Frame input = job.movie->at(job.framesRun);
+        if (input.reset)
+          nes.reset();
+        nes.controller[0] = input.ports[0];
+        nes.controller[1] = input.ports[1];
+      }
+      nes.drawFrame();
+    }
+    pool.frames += end - begin;
+    job.seconds += std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+
+    if (job.framesRun < job.frames)
+      return false;
+    job.frameHash = task.core->frameHash();
+    job.ramHash = task.core->ramHash();
+    job.ok = true;
+    task.core.reset();
+    return true;
+  }
+};
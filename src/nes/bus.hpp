@@ -1,10 +1,15 @@
 #pragma once
+#include "../util/xn_mapped_file.hpp"
 #include "apu.hpp"
 #include "cpu.hpp"
 #include "ppu.hpp"
 #include "rom.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
 #include <mutex>
-#include <sys/stat.h>
 
 struct NesBus {
   static const size_t MEMORY_SIZE = 0x07ff;
@@ -16,46 +21,137 @@ struct NesBus {
     uint8_t data = 0;
     bool dummy = false;
     bool transfer = false;
-  } DMA;
+  };
+
+  // Everything clock() touches on every cycle comes first, then RAM and the
+  // chips (each with its own per cycle state at the front), then what is
+  // only used per frame or by the frontend
+
+  // mapper specialized paths, picked by selectMapper()
+  bool (NesBus::*clockFn)() = &NesBus::clockT<Mapper>;
+  uint8_t (NesBus::*readCpuFn)(uint16_t, bool) = &NesBus::readCpuT<Mapper>;
+  void (NesBus::*writeCpuFn)(uint16_t, uint8_t) = &NesBus::writeCpuT<Mapper>;
+  Mapper *mapper = nullptr; // rom->mapper, one hop less for the IRQ check
 
   uint32_t systemClockCount = 0;
+  DmaInfo DMA;
+  uint8_t controller[2], controller_state[2];
+  bool captureBlock = false;
+  // set while emulating frames that will be rolled back (run-ahead): no audio
+  // is mixed and no scope, sample count or latch callback sees them
+  bool speculative = false;
+  AudioFloat audioTime = 0;
+  AudioFloat audioTimePerNesClock = 0;
+  AudioFloat audioTimePerSystemSample = 0;
+  float audioSample = 0;
+  uint64_t audioSampleCount = 0; // samples generated since power on
+
   std::array<uint8_t, 2048> memory;
 
   Cpu6502 cpu;
   APU apu;
   Ppu2C02 ppu;
-  // NesRom rom;
   std::shared_ptr<NesRom> rom;
 
-  uint8_t controller[2], controller_state[2];
+  // optional, called when the CPU latches a controller's buttons
+  std::function<void(uint8_t port, uint8_t state)> controllerLatchCallback;
 
-  AudioFloat audioSample = 0;
-  AudioFloat audioTime = 0;
-  AudioFloat audioTimePerNesClock = 0;
-  AudioFloat audioTimePerSystemSample = 0;
+  ApuMixer::Block audioBlock; // filled instead of audioSample by clockSamples
+
+  // emulated seconds per wall clock second measured by clockSamples(), with
+  // and without video, 0 until measured
+  std::array<std::atomic<float>, 2> realtimeFactor{};
 
   std::mutex guard;
 
+  // battery backed carts keep their RAM in a .sav file next to the rom. Turn
+  // off before loadRom() when several instances run the same game
+  bool batterySaves = true;
+
   void init() {
     // memory.resize(2 * BLOCK_SIZE);
-    rom->reset();
+    if (rom != nullptr)
+      rom->reset();
     cpu.connectBus(this);
-    cpu.createInstructionSet();
+    // the instruction set doesn't depend on the cartridge, build it once
+    if (cpu.instructionMap[0].callback == nullptr)
+      cpu.createInstructionSet();
   }
 
   int loadRom(const std::string &filepath) {
-    int res = NesRom::read_rom(filepath, rom);
+    int res = NesRom::read_rom(filepath, rom, batterySaves);
+    if (res < 0)
+      return res;
     ppu.connectRom(rom);
+    selectMapper();
     return res;
   }
 
+  // run the cartridge another instance already has loaded, without a battery
+  // file. Used for extra instances that only ever load that one's states
+  void loadRom(const std::shared_ptr<const NesRom::Image> &image) {
+    rom = std::make_shared<NesRom>(image);
+    ppu.connectRom(rom);
+    selectMapper();
+  }
+
+  // route the hot loop through code specialized for the cartridge's mapper,
+  // or through virtual calls on the Mapper base class if `generic` is set
+  void selectMapper(bool generic = false) {
+    unsigned mapper = generic ? ~0u : rom->header.getMapperNumber();
+    switch (mapper) {
+    case 0:
+      useMapper<Mapper000>();
+      break;
+    case 1:
+      useMapper<Mapper001>();
+      break;
+    case 2:
+      useMapper<Mapper002>();
+      break;
+    case 4:
+      useMapper<Mapper004>();
+      break;
+    default:
+      useMapper<Mapper>();
+      break;
+    }
+  }
+
+  template <typename M> void useMapper() {
+    mapper = rom->mapper.get();
+    clockFn = &NesBus::clockT<M>;
+    readCpuFn = &NesBus::readCpuT<M>;
+    writeCpuFn = &NesBus::writeCpuT<M>;
+    ppu.useMapper<M>();
+  }
+
+  // audio only mode skips all PPU fetching and rendering, the framebuffer
+  // keeps its last image
+  void setAudioOnly(bool audio_only) { ppu.audioOnly = audio_only; }
+
+  // how much faster audio only mode runs than full emulation, 0 if either
+  // hasn't been measured yet
+  float audioOnlySpeedup() const {
+    float full = realtimeFactor[0], audio_only = realtimeFactor[1];
+    return full > 0 ? audio_only / full : 0;
+  }
+
   void setSampleFrequency(uint32_t sample_rate, float speed = 1.0) {
     audioTimePerSystemSample = 1.0 / (sample_rate);
     audioTimePerNesClock = 1.0 / (5369318.0 * speed); // PPU clock frequency
   }
 
   void writeCpu(uint16_t addr, uint8_t data) {
-    if (rom->cpuWrite(addr, data)) {
+    (this->*writeCpuFn)(addr, data);
+  }
+
+  uint8_t readCpu(uint16_t addr, bool readOnly = false) {
+    return (this->*readCpuFn)(addr, readOnly);
+  }
+
+  template <typename M> void writeCpuT(uint16_t addr, uint8_t data) {
+    if (rom->cpuWriteT<M>(addr, data)) {
       // cartridge can veto any bus transaction
     } else if (addr <= 0x1FFF) {
       // write to ram
@@ -73,12 +169,14 @@ struct NesBus {
       DMA.transfer = true;
     } else if (addr >= 0x4016 && addr <= 0x4017) {
       controller_state[addr & 0x0001] = controller[addr & 0x0001];
+      if (controllerLatchCallback != nullptr && !speculative)
+        controllerLatchCallback(addr & 0x0001, controller_state[addr & 0x0001]);
     }
   }
 
-  uint8_t readCpu(uint16_t addr, bool readOnly = false) {
+  template <typename M> uint8_t readCpuT(uint16_t addr, bool readOnly) {
     uint8_t data = 0;
-    if (rom->cpuRead(addr, data))
+    if (rom->cpuReadT<M>(addr, data))
       return data;
     // if (addr >= memory.size())
     //   return 0;
@@ -107,8 +205,9 @@ struct NesBus {
     DMA.dummy = true;
   }
 
-  bool clock() {
+  bool clock() { return (this->*clockFn)(); }
 
+  template <typename M> bool clockT() {
     ppu.clock();
     apu.clock();
 
@@ -142,7 +241,14 @@ struct NesBus {
     audioTime += audioTimePerNesClock;
     if (audioTime >= audioTimePerSystemSample) {
       audioTime -= audioTimePerSystemSample;
-      audioSample = apu.getSample();
+      if (!speculative) {
+        if (captureBlock)
+          apu.captureSample(audioBlock);
+        else
+          audioSample = apu.getSample();
+        apu.captureScope();
+        audioSampleCount++;
+      }
       audio_sample_ready = true;
     }
 
@@ -151,8 +257,9 @@ struct NesBus {
       cpu.nonMaskableInterrupt();
     }
 
-    if (rom->mapper->irqState()) {
-      rom->mapper->irqClear();
+    M *cart = static_cast<M *>(mapper);
+    if (cart->irqState()) {
+      cart->irqClear();
       cpu.interruptRequest();
     }
 
@@ -161,6 +268,56 @@ struct NesBus {
     return audio_sample_ready;
   }
 
+  // run until count audio samples are ready, mixing them a block at a time
+  void clockSamples(float *out, uint32_t count) {
+    if (count == 0)
+      return;
+    auto start = std::chrono::steady_clock::now();
+    uint32_t start_clock = systemClockCount;
+    captureBlock = true;
+    while (count > 0) {
+      uint32_t n = std::min<uint32_t>(count, ApuMixer::BLOCK_SIZE);
+      audioBlock.count = 0;
+      while (audioBlock.count < n)
+        clock();
+      apu.mixer.mix(audioBlock, out);
+      out += n;
+      count -= n;
+    }
+    captureBlock = false;
+    audioSample = out[-1];
+
+    std::chrono::duration<float> elapsed =
+        std::chrono::steady_clock::now() - start;
+    if (elapsed.count() > 0) {
+      float emulated = (systemClockCount - start_clock) / 5369318.0f;
+      auto &factor = realtimeFactor[ppu.audioOnly];
+      float prev = factor.load(std::memory_order_relaxed);
+      float now = emulated / elapsed.count();
+      factor.store(prev > 0 ? prev + (now - prev) * 0.05f : now,
+                   std::memory_order_relaxed);
+    }
+  }
+
+  // run to the end of the current frame, appending its mixed audio to out
+  void clockFrame(std::vector<float> *out = nullptr) {
+    captureBlock = out != nullptr;
+    audioBlock.count = 0;
+    while (!ppu.frameComplete) {
+      clock();
+      if (out != nullptr && audioBlock.count > 0 &&
+          (audioBlock.count == ApuMixer::BLOCK_SIZE || ppu.frameComplete)) {
+        size_t n = out->size();
+        out->resize(n + audioBlock.count);
+        apu.mixer.mix(audioBlock, out->data() + n);
+        audioBlock.count = 0;
+        audioSample = out->back();
+      }
+    }
+    captureBlock = false;
+    ppu.frameComplete = false;
+  }
+
   void drawFrame() {
     do {
       clock(); // cycle until end of frame
@@ -169,153 +326,154 @@ struct NesBus {
       clock(); // finish current instruction
     } while (cpu.cycles != 0);
     ppu.frameComplete = false;
+    rom->requestSaveRamFlush();
   }
 
   /**
-   *  NES save file format
+   *  NES save state format
    *
-   *  Bytes   type                content
+   *  Bytes   content
    * -----------------------------------
-   *  16    NesRom::Header      rom header
-   *  0:512 uint8_t             rom trainer
-   *  n     uint8_t             rom prg
-   *  m     uint8_t             rom chr
-   *
-   *  7     Cpu6502::Registers  Cpu register values
-   *  1     uint8_t             Cpu inputAlu
-   *  1     uint8_t             Cpu opcode
-   *  2     uint16_t            Cpu temp var
-   *  2     uint16_t            Cpu absolute address
-   *  2     uint16_t            Cpu relative address
-   *  2     uint16_t            Cpu cycles
+   *  4       "XNST"
+   *  2       STATE_VERSION
+   *  2       reserved, 0
+   *  40      SHA-1 of the rom file in hex, the rom itself isn't stored
    *
-   *  8     Ppu2C02::Registers  Ppu register values
-   *  12    Ppu2C02::BackgroundData
-   *  256   Ppu2CO2::OAM        Ppu Object attribute memory
-   *  51    Ppu2C02::SpriteInfo
-   *  2048  uint8_t             Ppu name table
-   *  8192  uint8_t             Ppu pattern table
-   *  32    uint8_t             Ppu palette table
-   *  1     uint8_t             Ppu address latch
-   *  1     uint8_t             Ppu data buffer
-   *  2     uint16_t            Ppu scanline
-   *  2     uint16_t            Ppu cycle
-   *  1     bool                Ppu nmi
+   *  followed by one section per component, each a 4 byte tag and a 4 byte
+   *  length (see StateArchive):
+   *  "CPU "  Cpu6502::serializeState
+   *  "PPU "  Ppu2C02::serializeState
+   *  "APU "  APU::serializeState
+   *  "BUS "  RAM, DMA, controllers, clock counters
+   *  "CART"  mapper registers and PRG-RAM, CHR-RAM
    *
-   *  5     Bus::DmaInfo        Bus DMA
-   *  2048  uint8_t             Bus RAMs
+   *  The layout only depends on the rom, so every state of a game has the
+   *  same size.
    */
-
-  void saveState(const std::string &filename) {
-    guard.lock();
-    std::fstream savefile(filename, std::ios_base::binary | std::ios::out);
-
-    savefile.write((char *)&rom->header, sizeof(rom->header));
-    if (rom->header.hasTrainer())
-      savefile.write((char *)&rom->trainer, 512);
-
-    size_t prgSize = rom->prg.size(), chrSize = rom->chr.size();
-    savefile.write((char *)&prgSize, sizeof(prgSize));
-    savefile.write((char *)rom->prg.data(), rom->prg.size());
-    savefile.write((char *)&chrSize, sizeof(chrSize));
-    savefile.write((char *)rom->chr.data(), rom->chr.size());
-    if (rom->header.getMapperNumber() == 1) {
-      auto mapper_buf = rom->mapper->serialize();
-      savefile.write((char *)mapper_buf.data(), mapper_buf.size());
-    }
-
-    savefile.write((char *)&cpu.registers, sizeof(cpu.registers));
-    savefile.write((char *)&cpu.inputAlu, sizeof(cpu.inputAlu));
-    savefile.write((char *)&cpu.opcode, sizeof(cpu.opcode));
-    savefile.write((char *)&cpu.temp, sizeof(cpu.temp));
-    savefile.write((char *)&cpu.absoluteAddress, sizeof(cpu.absoluteAddress));
-    savefile.write((char *)&cpu.relativeAddress, sizeof(cpu.relativeAddress));
-    savefile.write((char *)&cpu.cycles, sizeof(cpu.cycles));
-
-    savefile.write((char *)&ppu.registers, sizeof(ppu.registers));
-    savefile.write((char *)&ppu.bg, sizeof(ppu.bg));
-    savefile.write((char *)&ppu.OAM, sizeof(ppu.OAM));
-    savefile.write((char *)&ppu.sprites, sizeof(ppu.sprites));
-    for (const std::array<uint8_t, 1024> &block : ppu.nameTable)
-      savefile.write((char *)block.data(), block.size());
-    for (const std::array<uint8_t, 4096> &block : ppu.patternTable)
-      savefile.write((char *)block.data(), block.size());
-    savefile.write((char *)ppu.paletteTable.data(), ppu.paletteTable.size());
-    savefile.write((char *)&ppu.addressLatch, sizeof(ppu.addressLatch));
-    savefile.write((char *)&ppu.dataBuffer, sizeof(ppu.dataBuffer));
-    savefile.write((char *)&ppu.scanline, sizeof(ppu.scanline));
-    savefile.write((char *)&ppu.cycle, sizeof(ppu.cycle));
-    savefile.write((char *)&ppu.nmi, sizeof(ppu.nmi));
-
-    savefile.write((char *)&DMA, sizeof(DMA));
-    savefile.write((char *)memory.data(), memory.size());
-
-    savefile.close();
-    guard.unlock();
+  static const uint16_t STATE_VERSION = 1;
+
+  void serializeState(StateArchive &ar) {
+    serializeStateHeader(ar, rom->image->hash);
+
+    size_t section = ar.beginSection(StateArchive::tag("CPU "));
+    cpu.serializeState(ar);
+    ar.endSection(section);
+
+    section = ar.beginSection(StateArchive::tag("PPU "));
+    ppu.serializeState(ar);
+    ar.endSection(section);
+
+    section = ar.beginSection(StateArchive::tag("APU "));
+    apu.serializeState(ar);
+    ar.endSection(section);
+
+    section = ar.beginSection(StateArchive::tag("BUS "));
+    ar.bytes(memory.data(), memory.size());
+    ar(systemClockCount);
+    ar(DMA.page);
+    ar(DMA.addr);
+    ar(DMA.data);
+    ar(DMA.dummy);
+    ar(DMA.transfer);
+    ar(controller);
+    ar(controller_state);
+    ar(audioTime);
+    ar.endSection(section);
+
+    section = ar.beginSection(StateArchive::tag("CART"));
+    rom->mapper->serializeState(ar);
+    ar.bytes(rom->chrRam.data(), rom->chrRam.size());
+    ar.endSection(section);
   }
 
-  void loadState(const std::string &filename, bool resize = true) {
-    struct stat buffer;
-    if (stat(filename.c_str(), &buffer) != 0)
-      return;
-    guard.lock();
-    std::fstream savefile(filename, std::ios_base::binary | std::ios::in);
-
-    savefile.read((char *)&rom->header, sizeof(rom->header));
+  // bytes needed by saveState()
+  size_t stateSize() {
+    StateArchive ar;
+    serializeState(ar);
+    return ar.size();
+  }
 
-    if (rom->header.hasTrainer())
-      savefile.read((char *)&rom->trainer, 512);
+  // Save into a caller owned buffer, returns the bytes written or 0 if it is
+  // too small. Doesn't lock, call from the emulation thread or hold `guard`
+  size_t saveState(uint8_t *buffer, size_t capacity) {
+    StateArchive ar(buffer, capacity);
+    serializeState(ar);
+    return ar.ok() ? ar.size() : 0;
+  }
 
-    size_t prgSize, chrSize;
+  // Returns false, without changing anything, if the state is from another
+  // rom or format version or has the wrong size. A section that fails to
+  // read later still leaves the sections before it loaded. Doesn't lock,
+  // like saveState()
+  bool loadState(const uint8_t *buffer, size_t size) {
+    if (!isStateFor(buffer, size, rom->image->hash) || size != stateSize())
+      return false;
+    StateArchive ar(buffer, size);
+    serializeState(ar);
+    return ar.ok();
+  }
 
-    if (resize) {
-      savefile.read((char *)&prgSize, sizeof(prgSize));
-      rom->prg.resize(prgSize);
-    }
-    savefile.read((char *)rom->prg.data(), rom->prg.size());
+  // A new machine in the same state, running the same shared rom image and
+  // never touching the battery file. Doesn't lock, like saveState(). Search
+  // trees should keep branches as PagedStates, a bus is about 1 MB
+  std::unique_ptr<NesBus> clone() {
+    auto copy = std::make_unique<NesBus>();
+    copy->batterySaves = false;
+    copy->loadRom(rom->image);
+    copy->init();
+    copy->audioTimePerNesClock = audioTimePerNesClock;
+    copy->audioTimePerSystemSample = audioTimePerSystemSample;
+    copy->ppu.audioOnly = ppu.audioOnly;
+    std::vector<uint8_t> state(stateSize());
+    saveState(state.data(), state.size());
+    copy->loadState(state.data(), state.size());
+    return copy;
+  }
 
-    if (resize) {
-      savefile.read((char *)&chrSize, sizeof(chrSize));
-      rom->chr.resize(chrSize);
-    }
-    savefile.read((char *)rom->chr.data(), rom->chr.size());
+  // blocking file versions, the frontend goes through StateIo instead
+  bool saveState(const std::string &filename) {
+    guard.lock();
+    std::vector<uint8_t> buffer(stateSize());
+    saveState(buffer.data(), buffer.size());
+    guard.unlock();
+    return xn::writeFileAtomic(filename, buffer.data(), buffer.size());
+  }
 
-    if (rom->header.getMapperNumber() == 1) {
-      std::vector<uint8_t> mapper_buf;
-      mapper_buf.resize(rom->mapper->size());
-      savefile.read((char *)mapper_buf.data(), mapper_buf.size());
-      rom->mapper->deserialize(mapper_buf);
+  bool loadState(const std::string &filename) {
+    xn::MappedFile file;
+    if (!file.open(filename))
+      return false;
+    std::lock_guard<std::mutex> lock(guard);
+    if (!loadState(file.data(), file.size())) {
+      std::cerr << filename << " is from a different rom or version\n";
+      return false;
     }
+    return true;
+  }
 
-    savefile.read((char *)&cpu.registers, sizeof(cpu.registers));
-    savefile.read((char *)&cpu.inputAlu, sizeof(cpu.inputAlu));
-    savefile.read((char *)&cpu.opcode, sizeof(cpu.opcode));
-    savefile.read((char *)&cpu.temp, sizeof(cpu.temp));
-    savefile.read((char *)&cpu.absoluteAddress, sizeof(cpu.absoluteAddress));
-    savefile.read((char *)&cpu.relativeAddress, sizeof(cpu.relativeAddress));
-    savefile.read((char *)&cpu.cycles, sizeof(cpu.cycles));
-
-    savefile.read((char *)&ppu.registers, sizeof(ppu.registers));
-    savefile.read((char *)&ppu.bg, sizeof(ppu.bg));
-    savefile.read((char *)&ppu.OAM, sizeof(ppu.OAM));
-    savefile.read((char *)&ppu.sprites, sizeof(ppu.sprites));
-    for (std::array<uint8_t, 1024> &block : ppu.nameTable)
-      savefile.read((char *)block.data(), block.size());
-    for (std::array<uint8_t, 4096> &block : ppu.patternTable)
-      savefile.read((char *)block.data(), block.size());
-    savefile.read((char *)ppu.paletteTable.data(), ppu.paletteTable.size());
-    savefile.read((char *)&ppu.addressLatch, sizeof(ppu.addressLatch));
-    savefile.read((char *)&ppu.dataBuffer, sizeof(ppu.dataBuffer));
-    savefile.read((char *)&ppu.scanline, sizeof(ppu.scanline));
-    savefile.read((char *)&ppu.cycle, sizeof(ppu.cycle));
-    savefile.read((char *)&ppu.nmi, sizeof(ppu.nmi));
-
-    savefile.read((char *)&DMA, sizeof(DMA));
-    savefile.read((char *)memory.data(), memory.size());
-
-    savefile.close();
-    ppu.connectRom(rom);
+  // whether `data` starts with a state header for this version and the rom
+  // with SHA-1 `rom_hash`, checks nothing past the header
+  static bool isStateFor(const uint8_t *data, size_t size,
+                         const std::string &rom_hash) {
+    StateArchive ar(data, size);
+    serializeStateHeader(ar, rom_hash);
+    return ar.ok();
+  }
 
-    guard.unlock();
+private:
+  static void serializeStateHeader(StateArchive &ar,
+                                   const std::string &rom_hash) {
+    uint32_t magic = StateArchive::tag("XNST");
+    uint16_t version = STATE_VERSION, reserved = 0;
+    char hash[40] = {};
+    rom_hash.copy(hash, sizeof(hash));
+    ar(magic);
+    ar(version);
+    ar(reserved);
+    ar(hash);
+    if (ar.loading() &&
+        (magic != StateArchive::tag("XNST") || version != STATE_VERSION ||
+         rom_hash.compare(0, sizeof(hash), hash, sizeof(hash)) != 0))
+      ar.fail();
   }
 };
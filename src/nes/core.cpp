@@ -0,0 +1,72 @@
+#include "core.hpp"
+#include "../util/xn_hash.hpp"
+#include "bus.hpp"
+
+NesCore::NesCore() : NesCore(Options()) {}
+
+NesCore::NesCore(const Options &options)
+    : options(options), nes(std::make_unique<NesBus>()) {
+  nes->batterySaves = options.batterySaves;
+  nes->ppu.audioOnly = !options.video;
+  nes->ppu.lean = options.lean;
+  nes->ppu.use_vsync = !options.lean;
+}
+
+NesCore::~NesCore() {}
+
+bool NesCore::loadRom(const std::string &filename) {
+  romLoaded = false;
+  if (nes->loadRom(filename) < 0)
+    return false;
+  nes->init();
+  nes->setSampleFrequency(options.sampleRate > 0 ? options.sampleRate : 44100);
+  nes->reset();
+  samples.clear();
+  romLoaded = true;
+  return true;
+}
+
+bool NesCore::loaded() const { return romLoaded; }
+
+void NesCore::reset() {
+  if (romLoaded)
+    nes->reset();
+}
+
+void NesCore::setInput(int port, uint8_t buttons) {
+  nes->controller[port & 1] = buttons;
+}
+
+void NesCore::stepFrame() {
+  samples.clear();
+  if (romLoaded)
+    nes->clockFrame(options.sampleRate > 0 ? &samples : nullptr);
+}
+
+const NesPixel *NesCore::frame() const {
+  return nes->ppu.getFramebuffer().buffer.data();
+}
+
+uint32_t NesCore::frameCount() const { return nes->ppu.framecount; }
+
+uint32_t NesCore::frameHash() const {
+  return xn::crc32(frame(), WIDTH * HEIGHT * sizeof(NesPixel));
+}
+
+uint32_t NesCore::ramHash() const {
+  uint32_t crc = xn::crc32(nes->memory.data(), nes->memory.size());
+  if (romLoaded)
+    if (PrgRam *ram = nes->rom->mapper->prgRam())
+      crc = xn::crc32(ram->data(), PrgRam::SIZE, crc);
+  return crc;
+}
+
+size_t NesCore::stateSize() { return romLoaded ? nes->stateSize() : 0; }
+
+size_t NesCore::saveState(uint8_t *buffer, size_t capacity) {
+  return romLoaded ? nes->saveState(buffer, capacity) : 0;
+}
+
+bool NesCore::loadState(const uint8_t *buffer, size_t size) {
+  return romLoaded && nes->loadState(buffer, size);
+}
@@ -0,0 +1,80 @@
+#pragma once
+#include "renderer.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct NesBus;
+
+/**
+ * Emulator core for embedding: no window, audio device, UI or globals
+ *
+ *   NesCore core;
+ *   core.loadRom("game.nes");
+ *   while (...) {
+ *     core.setInput(0, buttons);
+ *     core.stepFrame();
+ *     show(core.frame());       // WIDTH * HEIGHT RGB pixels
+ *     play(core.audio());       // this frame's mono samples
+ *   }
+ *
+ * Every instance is independent, any number can run on different threads.
+ * Built as the xnes_core library together with the emulation sources;
+ * bus() gives tools the whole machine.
+ * */
+struct NesCore {
+  static const uint32_t WIDTH = NesRenderer::NES_WIDTH;
+  static const uint32_t HEIGHT = NesRenderer::NES_HEIGHT;
+
+  struct Options {
+    uint32_t sampleRate = 44100; // 0 for no audio
+    bool video = true;           // false skips drawing pixels
+    bool batterySaves = false;   // keep battery RAM in a .sav next to the rom
+    // draw palette indices into one buffer, frame() makes the RGB pixels
+    // when called. About 100 KB per instance instead of 1.2 MB
+    bool lean = false;
+  };
+
+  NesCore();
+  explicit NesCore(const Options &options);
+  NesCore(const NesCore &) = delete;
+  ~NesCore();
+
+  // load and power on, false if the file isn't a rom this core can run
+  bool loadRom(const std::string &filename);
+  bool loaded() const;
+  void reset();
+
+  // buttons of controller port 0 or 1, bit 7 to 0: A B Select Start Up Down
+  // Left Right
+  void setInput(int port, uint8_t buttons);
+
+  // emulate one frame
+  void stepFrame();
+
+  // last completed frame
+  const NesPixel *frame() const;
+  // audio of the last stepFrame(), sampleRate mono samples in [-1, 1]
+  const std::vector<float> &audio() const { return samples; }
+
+  uint32_t frameCount() const;
+
+  // CRC-32 of frame(), and of CPU RAM plus PRG-RAM, for comparing runs
+  uint32_t frameHash() const;
+  uint32_t ramHash() const;
+
+  // save states, see NesBus::saveState()
+  size_t stateSize();
+  size_t saveState(uint8_t *buffer, size_t capacity);
+  bool loadState(const uint8_t *buffer, size_t size);
+
+  NesBus &bus() { return *nes; }
+
+private:
+  Options options;
+  std::unique_ptr<NesBus> nes;
+  std::vector<float> samples;
+  bool romLoaded = false;
+};
@@ -31,7 +31,8 @@ void Cpu6502::getFutureInstructions(std::vector<Instruction> &instr_out,
 }
 
 void Cpu6502::reset() {
-  disasmLog.open("nestest_local.log", std::ios::out);
+  if (!disasmLogPath.empty())
+    disasmLog = std::make_unique<std::fstream>(disasmLogPath, std::ios::out);
   disassemblyIndex = -1;
   for (auto &i : disassemblyQueue) {
     i.toUnknown();
@@ -46,6 +47,22 @@ void Cpu6502::reset() {
   cycles = 8;
 }
 
+void Cpu6502::serializeState(StateArchive &ar) {
+  ar(registers.A);
+  ar(registers.P);
+  ar(registers.X);
+  ar(registers.Y);
+  ar(registers.S);
+  ar(registers.PC);
+  ar(inputAlu);
+  ar(opcode);
+  ar(temp);
+  ar(absoluteAddress);
+  ar(relativeAddress);
+  ar(cycles);
+  ar(cycleCount);
+}
+
 void Cpu6502::interrupt(uint16_t pcAddress) {
   // push program counter to the stack (16 bit push)
   write(0x0100 + registers.S--, (registers.PC >> 8) & 0x00ff);
@@ -137,15 +154,21 @@ bool Cpu6502::getStatus(Registers::NES_STATUS status) const {
 
 void Cpu6502::createInstructionSet() {
   using Opcode = Instruction::Index;
+  const Callbacks instr_callbacks = instrCallbacks();
+  const Callbacks addr_mode_callbacks = addrModeCallbacks();
 
   // populate instruction map
   for (uint8_t c = 0; c < Instruction::TABLE_SIZE.c; c++)
     for (uint8_t b = 0; b < Instruction::TABLE_SIZE.b; b++)
       for (uint8_t a = 0; a < Instruction::TABLE_SIZE.a; a++) {
         uint8_t op = Opcode::pack({a, b, c});
-        Instruction newInstruction{
-            default_opcodes[c][a],    default_address_modes[b],   2, 2, op,
-            instrCallbacks.at("???"), addrModeCallbacks.at("???")};
+        Instruction newInstruction;
+        newInstruction.callback = instr_callbacks.at("???");
+        newInstruction.addrmodeCallback = addr_mode_callbacks.at("???");
+        newInstruction.opcode = default_opcodes[c][a];
+        newInstruction.addrmode = default_address_modes[b];
+        newInstruction.size = 2;
+        newInstruction.opByte = op;
         instructionMap[op] = newInstruction;
       }
 
@@ -159,7 +182,7 @@ void Cpu6502::createInstructionSet() {
     Instruction::setAddressModes(instructionMap);
 
     // sizes
-    for (auto &[key, val] : instructionMap) {
+    for (Instruction &val : instructionMap) {
       for (const std::string &v : single_byte_instructions)
         if (val.opcode == v) {
           val.size = 1;
@@ -175,13 +198,13 @@ void Cpu6502::createInstructionSet() {
     }
 
     // instruction implementations
-    for (auto &[key, val] : instructionMap) {
-      for (auto &[op, fn] : instrCallbacks) {
+    for (Instruction &val : instructionMap) {
+      for (auto &[op, fn] : instr_callbacks) {
         if (val.opcode == op)
           val.callback = fn;
       }
 
-      for (const auto &[k, v] : addrModeCallbacks)
+      for (const auto &[k, v] : addr_mode_callbacks)
         if (val.addrmode == k) {
           val.addrmodeCallback = v;
           break;
@@ -190,7 +213,7 @@ void Cpu6502::createInstructionSet() {
 
     Instruction::setCycleCounts(instructionMap);
 
-    for (auto &[key, val] : instructionMap) {
+    for (Instruction &val : instructionMap) {
       if (val.addrmode == "impl")
         val.implied = true;
     }
@@ -198,9 +221,9 @@ void Cpu6502::createInstructionSet() {
     // unknown instructions
     for (const auto &i : dead_cells) {
       instructionMap[Opcode::pack(i)].toUnknown();
-      instructionMap[Opcode::pack(i)].callback = instrCallbacks.at("NOP");
+      instructionMap[Opcode::pack(i)].callback = instr_callbacks.at("NOP");
       instructionMap[Opcode::pack(i)].addrmodeCallback =
-          addrModeCallbacks.at("#");
+          addr_mode_callbacks.at("#");
     }
   }
 }
@@ -224,7 +247,7 @@ void Cpu6502::CMP_Generic(uint8_t &reg) {
 void Cpu6502::setRotateRegisters() {
   setStatus(Registers::NES_ZERO, (temp & 0x00FF) == 0);
   setStatus(Registers::NES_NEGATIVE, temp & 0x0080);
-  if (instructionMap[opcode].addrmode == "impl")
+  if (instructionMap[opcode].implied)
     registers.A = temp & 0x00FF;
   else
     write(absoluteAddress, temp & 0x00FF);
@@ -1,9 +1,11 @@
 #pragma once
 #include "instruction_set.hpp"
+#include "state.hpp"
 #include <bitset>
 #include <fstream>
 #include <functional>
 #include <iostream>
+#include <memory>
 #include <unordered_map>
 #include <utility>
 
@@ -33,8 +35,7 @@ struct Cpu6502 {
     }
   } registers;
 
-  NesBus *bus = NULL;
-  std::unordered_map<uint8_t, Instruction> instructionMap;
+  // the rest of the per cycle state, in the same cache line as registers
   uint8_t inputAlu;
   uint8_t opcode;
   uint16_t temp = 0;
@@ -42,12 +43,19 @@ struct Cpu6502 {
   uint16_t relativeAddress;
   uint16_t cycles;
   uint32_t cycleCount = 0;
+  NesBus *bus = NULL;
+
+  Instruction::Table instructionMap;
 
   const static uint16_t MAX_DISASSEMBLY_Q_SIZE = 4;
   int16_t disassemblyIndex = -1;
   std::vector<Instruction> disassemblyQueue;
 
-  std::fstream disasmLog;
+  // nestest style trace, only opened by reset() when a path is set. Off by
+  // default so instances don't all write one file in the working directory,
+  // or carry a stream and its buffer
+  std::string disasmLogPath;
+  std::unique_ptr<std::fstream> disasmLog;
 
   void connectBus(NesBus *bus);
   uint8_t read(uint16_t addr);
@@ -60,6 +68,8 @@ struct Cpu6502 {
 
   void reset();
 
+  void serializeState(StateArchive &ar);
+
   void interrupt(uint16_t pcAddress);
 
   void interruptRequest();
@@ -88,10 +98,15 @@ struct Cpu6502 {
 // create anonymous member function that returns an int
 #define ASM_IMPL(a) [this]() -> uint8_t a
 
+  // implementations by name, only needed to fill in instructionMap so they
+  // are made on demand instead of being kept in every instance
+  using Callbacks =
+      std::unordered_map<std::string, std::function<uint8_t(void)>>;
+
   // 6502 assembly instruction implementations
   // https://www.masswerk.at/6502/6502_instruction_set.html
-  const std::unordered_map<std::string, std::function<uint8_t(void)>>
-      instrCallbacks = {
+  Callbacks instrCallbacks() {
+    return {
           // add with carry
           {"ADC", ASM_IMPL({
              fetch();
@@ -503,11 +518,12 @@ struct Cpu6502 {
              std::cerr << "Invalid instruction: " << instr << "\n";
              return 0;
            })},
-  };
+    };
+  }
 
   // 6502 address mode implementations
-  const std::unordered_map<std::string, std::function<uint8_t(void)>>
-      addrModeCallbacks = {
+  Callbacks addrModeCallbacks() {
+    return {
           {"abs", ASM_IMPL({
              uint16_t lo = read(registers.PC++);
              uint16_t hi = read(registers.PC++);
@@ -610,5 +626,6 @@ struct Cpu6502 {
              std::cerr << "Invalid address mode\n";
              return 0;
            })},
-  };
+    };
+  }
 };
@@ -4,25 +4,28 @@
 #include <functional>
 #include <iostream>
 #include <string>
-#include <unordered_map>
 #include <utility>
 #include <vector>
 
 struct Cpu6502;
 
 struct Instruction {
-  std::string opcode;
-  std::string addrmode;
-  uint8_t size;
-  uint8_t cycles = 2;
-  uint8_t opByte; // binary opcode bit vector {aaabbbcc}
-                  // https://www.masswerk.at/6502/6502_instruction_set.html
-  // uint8_t (Cpu6502::*callback)(void) = NULL;
+  // what Cpu6502::clock() reads for every instruction comes first
   std::function<uint8_t(void)> callback;
   std::function<uint8_t(void)> addrmodeCallback;
-  // uint8_t (Cpu6502::*addrmodeCallback)(void) = NULL;
+  uint8_t cycles = 2;
   bool implied = false;
 
+  // disassembly
+  std::string opcode;
+  std::string addrmode;
+  uint8_t size = 1;
+  uint8_t opByte = 0; // binary opcode bit vector {aaabbbcc}
+                      // https://www.masswerk.at/6502/6502_instruction_set.html
+
+  // indexed by opcode byte
+  using Table = std::array<Instruction, 256>;
+
   struct Index {
     uint8_t a;
     uint8_t b;
@@ -70,13 +73,14 @@ struct Instruction {
 
   // set instruction as unknown/illegal, but preserve opByte
   void toUnknown() {
-    Instruction dead_cell{"???", "???", 1, 1};
+    Instruction dead_cell;
+    dead_cell.opcode = dead_cell.addrmode = "???";
+    dead_cell.size = dead_cell.cycles = 1;
     dead_cell.opByte = opByte;
     *this = dead_cell;
   }
 
-  static void
-  setAddressModes(std::unordered_map<uint8_t, Instruction> &instructionMap) {
+  static void setAddressModes(Table &instructionMap) {
     instructionMap[Index::pack({1, 0, 0})].addrmode = "abs";
     instructionMap[Index::pack({5, 0, 2})].addrmode = "#";
     instructionMap[Index::pack({0, 0, 0})].addrmode = "impl";
@@ -108,8 +112,7 @@ struct Instruction {
     }
   }
 
-  static void
-  setCycleCounts(std::unordered_map<uint8_t, Instruction> &instructionMap) {
+  static void setCycleCounts(Table &instructionMap) {
 
     // cycle counts
     auto getExtraCycles = [](const std::string &addrmode) -> uint8_t {
@@ -128,7 +131,7 @@ struct Instruction {
       return 0;
     };
 
-    for (auto &[key, val] : instructionMap) {
+    for (Instruction &val : instructionMap) {
       const std::string &oc = val.opcode;
       if (val.opcode == "INC" || val.opcode == "DEC") {
         if (val.addrmode == "#")
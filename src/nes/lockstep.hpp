@@ -0,0 +1,204 @@
+#pragma once
+#include "bus.hpp"
+#include "core.hpp"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#if defined(__SSE2__) && !defined(USE_SCALAR_LOCKSTEP)
+#include <emmintrin.h>
+#define XN_LOCKSTEP_SSE2 1
+#endif
+
+/**
+ * Experimental: schedules up to 16 instances of one game as if they were
+ * the lanes of a SIMD machine, to measure how far they would stay in
+ * lockstep. Nothing is executed with SIMD
+ *
+ * Every lane stops before each opcode fetch. The group keeps the lanes'
+ * next instruction (program counter and opcode) in a structure of arrays
+ * and issues one instruction at a time, to the mask of lanes about to run
+ * it. Lanes elsewhere wait until an instruction of theirs is issued.
+ * stats() counts issues and active lanes, so utilization is the share of
+ * lane slots a vector CPU would have put to work.
+ *
+ * Each issued lane runs the instruction on its own NesBus, one after the
+ * other, PPU, APU and DMA cycles included, so a frame comes out exactly as
+ * NesBus::drawFrame() on each instance would make it.
+ * */
+struct LockstepGroup {
+  static const uint32_t MAX_LANES = 16;
+
+  enum class Schedule {
+    Behind,  // the instruction of the lane with the fewest clocks this frame
+    Largest, // the instruction the most lanes are waiting on
+  };
+
+  struct Stats {
+    uint64_t frames = 0;
+    uint64_t issues = 0;    // instructions issued
+    uint64_t laneSteps = 0; // lane instructions run, issues times active lanes
+    uint64_t fullIssues = 0; // issues with every running lane active
+    std::array<uint64_t, MAX_LANES + 1> groupSizes = {}; // issues per size
+
+    // active lane slots over all issued ones
+    double utilization(uint32_t lanes) const {
+      return issues > 0 ? (double)laneSteps / (issues * lanes) : 0;
+    }
+  };
+
+  Schedule schedule = Schedule::Behind;
+
+  LockstepGroup(const std::string &rom, uint32_t lanes) {
+    NesCore::Options options;
+    options.sampleRate = 0;
+    options.lean = true;
+    lanes = std::min(lanes, MAX_LANES);
+    for (uint32_t i = 0; i < lanes; i++) {
+      cores.push_back(std::make_unique<NesCore>(options));
+      if (!cores.back()->loadRom(rom)) {
+        cores.clear();
+        return;
+      }
+    }
+  }
+
+  LockstepGroup(const LockstepGroup &) = delete;
+
+  bool ok() const { return !cores.empty(); }
+  uint32_t size() const { return cores.size(); }
+  NesCore &lane(uint32_t i) { return *cores[i]; }
+  const Stats &stats() const { return counters; }
+
+  void setInput(uint32_t lane, int port, uint8_t buttons) {
+    cores[lane]->setInput(port, buttons);
+  }
+
+  // one frame on every lane
+  void stepFrame() {
+    uint32_t running = 0;
+    for (uint32_t i = 0; i < size(); i++) {
+      NesBus &nes = cores[i]->bus();
+      frameEnding[i] = false;
+      frameStart[i] = nes.systemClockCount;
+      if (atFetch(nes)) {
+        mark(i); // left there by the last frame, with its clocks
+        running |= 1u << i;
+      } else if (!toNextFetch(i)) {
+        running |= 1u << i;
+      }
+    }
+
+    while (running != 0) {
+      uint32_t active = pick(running);
+      uint32_t n = popcount(active);
+      counters.issues++;
+      counters.laneSteps += n;
+      counters.groupSizes[n]++;
+      if (active == running)
+        counters.fullIssues++;
+      for (uint32_t i = 0; i < size(); i++)
+        if ((active >> i & 1) && toNextFetch(i))
+          running &= ~(1u << i);
+    }
+    counters.frames++;
+  }
+
+private:
+  std::vector<std::unique_ptr<NesCore>> cores;
+  Stats counters;
+
+  // per lane, structure of arrays: next instruction as opcode << 16 | PC,
+  // system clocks into the frame
+  alignas(16) std::array<uint32_t, MAX_LANES> next = {};
+  std::array<uint32_t, MAX_LANES> clocks = {};
+  std::array<bool, MAX_LANES> frameEnding = {};
+  std::array<uint32_t, MAX_LANES> frameStart = {};
+
+  static uint32_t popcount(uint32_t mask) {
+    uint32_t n = 0;
+    for (; mask != 0; mask &= mask - 1)
+      n++;
+    return n;
+  }
+
+  // the next clock() starts an instruction
+  static bool atFetch(NesBus &nes) {
+    return nes.systemClockCount % 3 == 0 && !nes.DMA.transfer &&
+           nes.cpu.cycles == 0;
+  }
+
+  // clock lane i to its next opcode fetch, true if its frame ended first.
+  // Ends frames where NesBus::drawFrame() does: at the end of the
+  // instruction running when the PPU completes the frame
+  bool toNextFetch(uint32_t i) {
+    NesBus &nes = cores[i]->bus();
+    do {
+      nes.clock();
+      if (!frameEnding[i]) {
+        frameEnding[i] = nes.ppu.frameComplete;
+      } else if (nes.cpu.cycles == 0) {
+        nes.ppu.frameComplete = false;
+        nes.rom->requestSaveRamFlush();
+        return true;
+      }
+    } while (!atFetch(nes));
+    mark(i);
+    return false;
+  }
+
+  // record lane i's next instruction and its clocks into the frame
+  void mark(uint32_t i) {
+    NesBus &nes = cores[i]->bus();
+    uint16_t pc = nes.cpu.registers.PC;
+    // no peeking at registers with read side effects
+    uint8_t opcode = pc < 0x2000 || pc >= 0x6000 ? nes.readCpu(pc, true) : 0;
+    next[i] = (uint32_t)opcode << 16 | pc;
+    clocks[i] = nes.systemClockCount - frameStart[i];
+  }
+
+  // lanes whose next instruction is `key`
+  uint32_t matching(uint32_t key) const {
+    uint32_t mask = 0, i = 0;
+#ifdef XN_LOCKSTEP_SSE2
+    const __m128i k = _mm_set1_epi32(key);
+    for (; i < MAX_LANES; i += 4) {
+      __m128i eq = _mm_cmpeq_epi32(
+          _mm_load_si128((const __m128i *)&next[i]), k);
+      mask |= (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(eq)) << i;
+    }
+#endif
+    for (; i < MAX_LANES; i++)
+      mask |= (uint32_t)(next[i] == key) << i;
+    return mask;
+  }
+
+  // lanes to issue the next instruction to, out of the running ones
+  uint32_t pick(uint32_t running) const {
+    uint32_t best = 0;
+    if (schedule == Schedule::Behind) {
+      uint32_t leader = 0, fewest = UINT32_MAX;
+      for (uint32_t i = 0; i < size(); i++)
+        if ((running >> i & 1) && clocks[i] < fewest) {
+          fewest = clocks[i];
+          leader = i;
+        }
+      best = matching(next[leader]) & running;
+    } else {
+      uint32_t left = running;
+      while (left != 0) {
+        uint32_t i = 0;
+        while (!(left >> i & 1))
+          i++;
+        uint32_t group = matching(next[i]) & running;
+        if (popcount(group) > popcount(best))
+          best = group;
+        left &= ~group;
+      }
+    }
+    return best;
+  }
+};
@@ -1,33 +1,10 @@
 #include "mappers.hpp"
 
-std::vector<uint8_t> Mapper::serialize() {
-  std::vector<uint8_t> buffer;
-  buffer.resize(2);
-  buffer[0] = prgBankCount;
-  buffer[1] = chrBankCount;
-  return buffer;
-}
-
-void Mapper::deserialize(std::vector<uint8_t> &buffer) {
-  prgBankCount = buffer[0];
-  chrBankCount = buffer[1];
-}
-
-size_t Mapper::size() { return 2; }
-
 /**
  * iNES mapper 000
  *
  **/
 
-bool Mapper000::cpuMapRead(uint16_t addr, uint32_t &mapped_addr, uint8_t data) {
-  if (addr >= 0x8000 && addr <= 0xFFFF) {
-    mapped_addr = addr & (prgBankCount > 1 ? 0x7FFF : 0x3FFF);
-    return true;
-  }
-  return false;
-}
-
 bool Mapper000::cpuMapWrite(uint16_t addr, uint32_t &mapped_addr,
                             uint8_t data) {
   if (addr >= 0x8000 && addr <= 0xFFFF) {
@@ -37,34 +14,13 @@ bool Mapper000::cpuMapWrite(uint16_t addr, uint32_t &mapped_addr,
   return false;
 }
 
-bool Mapper000::ppuMapRead(uint16_t addr, uint32_t &mapped_addr) {
-  if (addr <= 0x1FFF) {
-    mapped_addr = addr;
-    return true;
-  }
-  return false;
-}
-
-bool Mapper000::ppuMapWrite(uint16_t addr, uint32_t &mapped_addr) {
-  if (addr <= 0x1FFF) {
-    if (chrBankCount == 0) {
-      // treat as RAM
-      mapped_addr = addr;
-      return true;
-    }
-  }
-  return false;
-}
-
 /**
  * iNES mapper 001
  *
  **/
 
-Mapper001::Mapper001(uint8_t prgBankCount, uint8_t chrBankCount)
-    : Mapper(prgBankCount, chrBankCount) {
-  staticRam.resize(STATIC_RAM_SIZE);
-}
+Mapper001::Mapper001(uint16_t prgBankCount, uint16_t chrBankCount)
+    : Mapper(prgBankCount, chrBankCount) {}
 
 void Mapper001::reset() {
   registers.control = 0x1C;
@@ -76,40 +32,12 @@ void Mapper001::reset() {
   prgBankSelect.hi = prgBankCount - 1;
 }
 
-bool Mapper001::cpuMapRead(uint16_t addr, uint32_t &mapped_addr, uint8_t data) {
-  if (addr >= 0x6000 && addr <= 0x7FFF) {
-    // read static ram from rom
-    mapped_addr = 0xFFFFFFFF;
-    data = staticRam[addr & 0x1FFF];
-    return true;
-  }
-  if (addr >= 0x8000) {
-    if (registers.control & 0b01000) {
-      // 16k mode
-      if (addr >= 0x8000 && addr <= 0xBFFF) {
-        mapped_addr = prgBankSelect.lo * 0x4000 + (addr & 0x3FFF);
-        return true;
-      }
-
-      if (addr >= 0xC000 && addr <= 0xFFFF) {
-        mapped_addr = prgBankSelect.hi * 0x4000 + (addr & 0x3FFF);
-        return true;
-      }
-    } else {
-      // 32k mode
-      mapped_addr = prgBankSelect.full * 0x8000 + (addr & 0x7FFF);
-      return true;
-    }
-  }
-  return false;
-}
-
 bool Mapper001::cpuMapWrite(uint16_t addr, uint32_t &mapped_addr,
                             uint8_t data) {
   if (addr >= 0x6000 && addr <= 0x7FFF) {
     // write to static ram on rom
     mapped_addr = 0xFFFFFFFF;
-    staticRam[addr & 0x1FFF] = data;
+    staticRam.write(addr, data);
     return true;
   }
   if (addr >= 0x8000) {
@@ -181,83 +109,17 @@ bool Mapper001::cpuMapWrite(uint16_t addr, uint32_t &mapped_addr,
   return false;
 }
 
-bool Mapper001::ppuMapRead(uint16_t addr, uint32_t &mapped_addr) {
-  if (addr <= 0x1FFF) {
-    if (chrBankCount == 0) {
-      mapped_addr = addr;
-      return true;
-    } else {
-      if (registers.control & 0b10000) {
-        // 4k chr bank mode
-        if (addr >= 0x0000 && addr <= 0x0FFF) {
-          mapped_addr = chrBankSelect.lo * 0x1000 + (addr & 0x0FFF);
-          return true;
-        }
-        if (addr >= 0x1000 && addr <= 0x1FFF) {
-          mapped_addr = chrBankSelect.hi * 0x1000 + (addr & 0x0FFF);
-          return true;
-        }
-      } else {
-        // 8k chr bank mode
-        mapped_addr = chrBankSelect.full * 0x2000 + (addr & 0x1FFF);
-        return true;
-      }
-    }
+void Mapper001::serializeState(StateArchive &ar) {
+  ar(registers.load);
+  ar(registers.loadCount);
+  ar(registers.control);
+  for (BankSelect *b : {&chrBankSelect, &prgBankSelect}) {
+    ar(b->lo);
+    ar(b->hi);
+    ar(b->full);
   }
-  return false;
-}
-
-bool Mapper001::ppuMapWrite(uint16_t addr, uint32_t &mapped_addr) {
-  if (addr <= 0x1FFF) {
-    if (chrBankCount == 0) {
-      // treat as RAM
-      mapped_addr = addr;
-    }
-    return true;
-  }
-  return false;
-}
-
-size_t Mapper001::size() {
-  return sizeof(chrBankCount) + sizeof(prgBankCount) + 2 * sizeof(BankSelect) +
-         sizeof(registers) + sizeof(mirrorMode) + staticRam.size();
-}
-
-std::vector<uint8_t> Mapper001::serialize() {
-  std::vector<uint8_t> buffer;
-  buffer.resize(size());
-  // size_t pod_size = sizeof(Mapper001) - sizeof(staticRam);
-  uint32_t idx = 0;
-  auto append_buf = [&](uint8_t *data, int len) {
-    std::memcpy(buffer.data() + idx, data, len);
-    idx += len;
-  };
-  append_buf(&chrBankCount, sizeof(chrBankCount));
-  append_buf(&prgBankCount, sizeof(prgBankCount));
-  append_buf((uint8_t *)&chrBankSelect, sizeof(chrBankSelect));
-  append_buf((uint8_t *)&prgBankSelect, sizeof(prgBankSelect));
-  append_buf((uint8_t *)&registers, sizeof(registers));
-  append_buf((uint8_t *)&mirrorMode, sizeof(mirrorMode));
-  append_buf(staticRam.data(), staticRam.size());
-  return buffer;
-}
-
-void Mapper001::deserialize(std::vector<uint8_t> &buffer) {
-  staticRam.clear();
-  staticRam.resize(STATIC_RAM_SIZE);
-
-  uint32_t idx = 0;
-  auto read_buf = [&](uint8_t *out, int len) {
-    std::memcpy(out, buffer.data() + idx, len);
-    idx += len;
-  };
-  read_buf(&chrBankCount, sizeof(chrBankCount));
-  read_buf(&prgBankCount, sizeof(prgBankCount));
-  read_buf((uint8_t *)&chrBankSelect, sizeof(chrBankSelect));
-  read_buf((uint8_t *)&prgBankSelect, sizeof(prgBankSelect));
-  read_buf((uint8_t *)&registers, sizeof(registers));
-  read_buf((uint8_t *)&mirrorMode, sizeof(mirrorMode));
-  read_buf(staticRam.data(), staticRam.size());
+  ar(mirrorMode);
+  staticRam.serializeState(ar);
 }
 
 /**
@@ -270,16 +132,9 @@ void Mapper002::reset() {
   prgBankSelectHi = prgBankCount - 1;
 }
 
-bool Mapper002::cpuMapRead(uint16_t addr, uint32_t &mapped_addr, uint8_t data) {
-  if (addr >= 0x8000 && addr <= 0xBFFF) {
-    mapped_addr = prgBankSelectLo * 0x4000 + (addr & 0x3FFF);
-    return true;
-  }
-  if (addr >= 0xC000 && addr <= 0xFFFF) {
-    mapped_addr = prgBankSelectHi * 0x4000 + (addr & 0x3FFF);
-    return true;
-  }
-  return false;
+void Mapper002::serializeState(StateArchive &ar) {
+  ar(prgBankSelectLo);
+  ar(prgBankSelectHi);
 }
 
 bool Mapper002::cpuMapWrite(uint16_t addr, uint32_t &mapped_addr,
@@ -290,56 +145,20 @@ bool Mapper002::cpuMapWrite(uint16_t addr, uint32_t &mapped_addr,
   return false;
 }
 
-bool Mapper002::ppuMapRead(uint16_t addr, uint32_t &mapped_addr) {
-  if (addr <= 0x1FFF) {
-    mapped_addr = addr;
-    return true;
-  }
-  return false;
-}
-
-bool Mapper002::ppuMapWrite(uint16_t addr, uint32_t &mapped_addr) {
-  if (addr <= 0x1FFF) {
-    if (chrBankCount == 0) {
-      // treat as RAM
-      mapped_addr = addr;
-      return true;
-    }
-  }
-  return false;
-}
-
 /**
  * iNES mapper 004
  *
  **/
 
-Mapper004::Mapper004(uint8_t prgBankCount, uint8_t chrBankCount)
-    : Mapper(prgBankCount, chrBankCount) {
-  memory.staticRam.resize(32 * 1024);
-}
-
-bool Mapper004::cpuMapRead(uint16_t addr, uint32_t &mapped_addr, uint8_t data) {
-  if (addr >= 0x6000 && addr <= 0x7FFF) {
-    // read static ram from rom
-    mapped_addr = 0xFFFFFFFF;
-    data = memory.staticRam[addr & 0x1FFF];
-    return true;
-  }
-  if (addr >= 0x8000 && addr <= 0xFFFF) {
-    uint16_t index = (addr - 0x8000) / (1 << 13);
-    mapped_addr = memory.prgBank[index] + (addr & 0x1FFF);
-    return true;
-  }
-  return false;
-}
+Mapper004::Mapper004(uint16_t prgBankCount, uint16_t chrBankCount)
+    : Mapper(prgBankCount, chrBankCount) {}
 
 bool Mapper004::cpuMapWrite(uint16_t addr, uint32_t &mapped_addr,
                             uint8_t data) {
   if (addr >= 0x6000 && addr <= 0x7FFF) {
     // read static ram from rom
     mapped_addr = 0xFFFFFFFF;
-    memory.staticRam[addr & 0x1FFF] = data;
+    memory.staticRam.write(addr, data);
     return true;
   }
   if (addr >= 0x8000 && addr <= 0x9FFF) {
@@ -423,18 +242,6 @@ bool Mapper004::cpuMapWrite(uint16_t addr, uint32_t &mapped_addr,
   return false;
 }
 
-bool Mapper004::ppuMapRead(uint16_t addr, uint32_t &mapped_addr) {
-  if (addr <= 0x1FFF) {
-    mapped_addr = memory.chrBank[addr / 0x0400] + (addr & 0x03FF);
-    return true;
-  }
-  return false;
-}
-
-bool Mapper004::ppuMapWrite(uint16_t addr, uint32_t &mapped_addr) {
-  return false;
-}
-
 void Mapper004::reset() {
   targetRegister = 0;
   prgBankMode = false;
@@ -450,6 +257,24 @@ void Mapper004::reset() {
   memory.prgBank[3] = (prgBankCount * 2 - 1) * 0x2000;
 }
 
+void Mapper004::serializeState(StateArchive &ar) {
+  for (auto *banks : {&memory.registers, &memory.chrBank})
+    for (uint32_t &b : *banks)
+      ar(b);
+  for (uint32_t &b : memory.prgBank)
+    ar(b);
+  memory.staticRam.serializeState(ar);
+  ar(irq.counter);
+  ar(irq.reload);
+  ar(irq.active);
+  ar(irq.enable);
+  ar(irq.update);
+  ar(targetRegister);
+  ar(prgBankMode);
+  ar(chrInversion);
+  ar(mirrorMode);
+}
+
 void Mapper004::scanline() {
   if (irq.counter == 0) {
     irq.counter = irq.reload;
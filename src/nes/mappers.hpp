@@ -1,4 +1,6 @@
 #pragma once
+#include "prg_ram.hpp"
+#include "state.hpp"
 #include <array>
 #include <cstdint>
 #include <cstring>
@@ -7,8 +9,8 @@
 // Nes cartridge memory mapper base class, used in all roms
 // Maps physical memory to CPU and PPU address space
 struct Mapper {
-  uint8_t prgBankCount = 0;
-  uint8_t chrBankCount = 0;
+  uint16_t prgBankCount = 0; // 12 bits with NES 2.0 headers
+  uint16_t chrBankCount = 0;
   enum MirrorMode {
     MIRROR_VERTICAL,
     MIRROR_HORIZONTAL,
@@ -19,7 +21,7 @@ struct Mapper {
 
   Mapper() {}
 
-  Mapper(uint8_t prg_banks, uint8_t chr_banks)
+  Mapper(uint16_t prg_banks, uint16_t chr_banks)
       : prgBankCount(prg_banks), chrBankCount(chr_banks) {
     reset();
   }
@@ -28,7 +30,7 @@ struct Mapper {
   virtual MirrorMode getMirror() { return MIRROR_HARDWARE; }
   // Transform CPU bus address into PRG ROM offset
   virtual bool cpuMapRead(uint16_t addr, uint32_t &mapped_addr,
-                          uint8_t data) = 0;
+                          uint8_t &data) = 0;
   virtual bool cpuMapWrite(uint16_t addr, uint32_t &mapped_addr,
                            uint8_t data) = 0;
 
@@ -43,11 +45,11 @@ struct Mapper {
   // Scanline Counting
   virtual void scanline() {}
 
-  virtual std::vector<uint8_t> serialize();
+  // $6000-$7FFF work RAM, if the board has any
+  virtual PrgRam *prgRam() { return nullptr; }
 
-  virtual void deserialize(std::vector<uint8_t> &buffer);
-
-  virtual size_t size();
+  // bank registers, IRQ and RAM. Bank counts come from the rom header
+  virtual void serializeState(StateArchive &) {}
 };
 
 /**
@@ -69,27 +71,47 @@ struct Mapper {
  *                     (NROM-128).
  *
  * */
-struct Mapper000 : public Mapper {
+struct Mapper000 final : public Mapper {
   Mapper000() {}
 
-  Mapper000(uint8_t prgBankCount, uint8_t chrBankCount)
+  Mapper000(uint16_t prgBankCount, uint16_t chrBankCount)
       : Mapper(prgBankCount, chrBankCount) {}
 
-  bool cpuMapRead(uint16_t addr, uint32_t &mapped_addr, uint8_t data) override;
+  bool cpuMapRead(uint16_t addr, uint32_t &mapped_addr,
+                  uint8_t &data) override {
+    if (addr >= 0x8000 && addr <= 0xFFFF) {
+      mapped_addr = addr & (prgBankCount > 1 ? 0x7FFF : 0x3FFF);
+      return true;
+    }
+    return false;
+  }
 
   bool cpuMapWrite(uint16_t addr, uint32_t &mapped_addr, uint8_t data) override;
 
-  bool ppuMapRead(uint16_t addr, uint32_t &mapped_addr) override;
+  bool ppuMapRead(uint16_t addr, uint32_t &mapped_addr) override {
+    if (addr <= 0x1FFF) {
+      mapped_addr = addr;
+      return true;
+    }
+    return false;
+  }
 
-  bool ppuMapWrite(uint16_t addr, uint32_t &mapped_addr) override;
+  bool ppuMapWrite(uint16_t addr, uint32_t &mapped_addr) override {
+    if (addr <= 0x1FFF) {
+      if (chrBankCount == 0) {
+        // treat as RAM
+        mapped_addr = addr;
+        return true;
+      }
+    }
+    return false;
+  }
 };
 
 /**
  * iNES mapper 001
  * */
-struct Mapper001 : public Mapper {
-  static const uint32_t STATIC_RAM_SIZE = 32 * 1024;
-
+struct Mapper001 final : public Mapper {
   struct BankSelect {
     uint8_t lo = 0;
     uint8_t hi = 0;
@@ -105,65 +127,151 @@ struct Mapper001 : public Mapper {
   BankSelect chrBankSelect;
   BankSelect prgBankSelect;
   Mapper::MirrorMode mirrorMode = MIRROR_HORIZONTAL;
-  std::vector<uint8_t> staticRam;
+  PrgRam staticRam;
 
   Mapper001() {}
 
-  Mapper001(uint8_t prgBankCount, uint8_t chrBankCount);
+  Mapper001(uint16_t prgBankCount, uint16_t chrBankCount);
 
   ~Mapper001() {}
 
   void reset() override;
 
-  bool cpuMapRead(uint16_t addr, uint32_t &mapped_addr, uint8_t data) override;
+  bool cpuMapRead(uint16_t addr, uint32_t &mapped_addr,
+                  uint8_t &data) override {
+    if (addr >= 0x6000 && addr <= 0x7FFF) {
+      // read static ram from rom
+      mapped_addr = 0xFFFFFFFF;
+      data = staticRam.read(addr);
+      return true;
+    }
+    if (addr >= 0x8000) {
+      if (registers.control & 0b01000) {
+        // 16k mode
+        if (addr >= 0x8000 && addr <= 0xBFFF) {
+          mapped_addr = prgBankSelect.lo * 0x4000 + (addr & 0x3FFF);
+          return true;
+        }
+
+        if (addr >= 0xC000 && addr <= 0xFFFF) {
+          mapped_addr = prgBankSelect.hi * 0x4000 + (addr & 0x3FFF);
+          return true;
+        }
+      } else {
+        // 32k mode
+        mapped_addr = prgBankSelect.full * 0x8000 + (addr & 0x7FFF);
+        return true;
+      }
+    }
+    return false;
+  }
 
   bool cpuMapWrite(uint16_t addr, uint32_t &mapped_addr, uint8_t data) override;
 
-  bool ppuMapRead(uint16_t addr, uint32_t &mapped_addr) override;
+  bool ppuMapRead(uint16_t addr, uint32_t &mapped_addr) override {
+    if (addr <= 0x1FFF) {
+      if (chrBankCount == 0) {
+        mapped_addr = addr;
+        return true;
+      } else {
+        if (registers.control & 0b10000) {
+          // 4k chr bank mode
+          if (addr >= 0x0000 && addr <= 0x0FFF) {
+            mapped_addr = chrBankSelect.lo * 0x1000 + (addr & 0x0FFF);
+            return true;
+          }
+          if (addr >= 0x1000 && addr <= 0x1FFF) {
+            mapped_addr = chrBankSelect.hi * 0x1000 + (addr & 0x0FFF);
+            return true;
+          }
+        } else {
+          // 8k chr bank mode
+          mapped_addr = chrBankSelect.full * 0x2000 + (addr & 0x1FFF);
+          return true;
+        }
+      }
+    }
+    return false;
+  }
 
-  bool ppuMapWrite(uint16_t addr, uint32_t &mapped_addr) override;
+  bool ppuMapWrite(uint16_t addr, uint32_t &mapped_addr) override {
+    if (addr <= 0x1FFF) {
+      if (chrBankCount == 0) {
+        // treat as RAM
+        mapped_addr = addr;
+      }
+      return true;
+    }
+    return false;
+  }
 
   MirrorMode getMirror() override { return mirrorMode; }
 
-  virtual size_t size() override;
-
-  std::vector<uint8_t> serialize() override;
+  PrgRam *prgRam() override { return &staticRam; }
 
-  void deserialize(std::vector<uint8_t> &buffer) override;
+  void serializeState(StateArchive &ar) override;
 };
 
 /**
  * iNES mapper 002
  * */
-struct Mapper002 : public Mapper {
+struct Mapper002 final : public Mapper {
   uint8_t prgBankSelectLo = 0;
   uint8_t prgBankSelectHi = 0;
 
   Mapper002() {}
 
-  Mapper002(uint8_t prgBankCount, uint8_t chrBankCount)
+  Mapper002(uint16_t prgBankCount, uint16_t chrBankCount)
       : Mapper(prgBankCount, chrBankCount) {}
 
   void reset() override;
 
-  bool cpuMapRead(uint16_t addr, uint32_t &mapped_addr, uint8_t data) override;
+  void serializeState(StateArchive &ar) override;
+
+  bool cpuMapRead(uint16_t addr, uint32_t &mapped_addr,
+                  uint8_t &data) override {
+    if (addr >= 0x8000 && addr <= 0xBFFF) {
+      mapped_addr = prgBankSelectLo * 0x4000 + (addr & 0x3FFF);
+      return true;
+    }
+    if (addr >= 0xC000 && addr <= 0xFFFF) {
+      mapped_addr = prgBankSelectHi * 0x4000 + (addr & 0x3FFF);
+      return true;
+    }
+    return false;
+  }
 
   bool cpuMapWrite(uint16_t addr, uint32_t &mapped_addr, uint8_t data) override;
 
-  bool ppuMapRead(uint16_t addr, uint32_t &mapped_addr) override;
+  bool ppuMapRead(uint16_t addr, uint32_t &mapped_addr) override {
+    if (addr <= 0x1FFF) {
+      mapped_addr = addr;
+      return true;
+    }
+    return false;
+  }
 
-  bool ppuMapWrite(uint16_t addr, uint32_t &mapped_addr) override;
+  bool ppuMapWrite(uint16_t addr, uint32_t &mapped_addr) override {
+    if (addr <= 0x1FFF) {
+      if (chrBankCount == 0) {
+        // treat as RAM
+        mapped_addr = addr;
+        return true;
+      }
+    }
+    return false;
+  }
 };
 
 /**
  * iNes Mapper 004
  * */
-struct Mapper004 : public Mapper {
+struct Mapper004 final : public Mapper {
   struct RomMemory {
     std::array<uint32_t, 8> registers;
     std::array<uint32_t, 8> chrBank;
     std::array<uint32_t, 4> prgBank;
-    std::vector<uint8_t> staticRam;
+    PrgRam staticRam;
   } memory;
 
   struct IrqInfo {
@@ -181,14 +289,36 @@ struct Mapper004 : public Mapper {
 
   Mapper004() {}
 
-  Mapper004(uint8_t prgBankCount, uint8_t chrBankCount);
-
-  bool cpuMapRead(uint16_t addr, uint32_t &mapped_addr, uint8_t data) override;
+  Mapper004(uint16_t prgBankCount, uint16_t chrBankCount);
+
+  bool cpuMapRead(uint16_t addr, uint32_t &mapped_addr,
+                  uint8_t &data) override {
+    if (addr >= 0x6000 && addr <= 0x7FFF) {
+      // read static ram from rom
+      mapped_addr = 0xFFFFFFFF;
+      data = memory.staticRam.read(addr);
+      return true;
+    }
+    if (addr >= 0x8000 && addr <= 0xFFFF) {
+      uint16_t index = (addr - 0x8000) / (1 << 13);
+      mapped_addr = memory.prgBank[index] + (addr & 0x1FFF);
+      return true;
+    }
+    return false;
+  }
 
   bool cpuMapWrite(uint16_t addr, uint32_t &mapped_addr, uint8_t data) override;
 
-  bool ppuMapWrite(uint16_t addr, uint32_t &mapped_addr) override;
-  bool ppuMapRead(uint16_t addr, uint32_t &mapped_addr) override;
+  bool ppuMapWrite(uint16_t addr, uint32_t &mapped_addr) override {
+    return false;
+  }
+  bool ppuMapRead(uint16_t addr, uint32_t &mapped_addr) override {
+    if (addr <= 0x1FFF) {
+      mapped_addr = memory.chrBank[addr / 0x0400] + (addr & 0x03FF);
+      return true;
+    }
+    return false;
+  }
 
   void reset() override;
 
@@ -198,4 +328,8 @@ struct Mapper004 : public Mapper {
   void scanline() override;
 
   MirrorMode getMirror() override { return mirrorMode; }
+
+  PrgRam *prgRam() override { return &memory.staticRam; }
+
+  void serializeState(StateArchive &ar) override;
 };
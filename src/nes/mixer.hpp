@@ -0,0 +1,210 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+
+#if defined(__SSE2__) && !defined(USE_SCALAR_MIXER)
+#include <emmintrin.h>
+#define XN_MIXER_SSE2 1
+#endif
+
+/**
+ * NES APU output mixer
+ *
+ * Works on blocks of per channel samples, stored as structure of arrays so
+ * each channel can be streamed through SIMD registers.
+ *
+ * - MIX_LINEAR: band limited channel outputs from the synthesizer, scaled by
+ *   per channel gain and summed in single precision
+ * - MIX_NONLINEAR: 4-bit channel DAC levels through the pulse_table and
+ *   tnd_table approximations of the 2A03's output stage
+ *   (https://wiki.nesdev.com/w/index.php/APU_Mixer). Computed entirely in
+ *   fixed point, so the int16 output is bit-identical across compilers and
+ *   SIMD/scalar builds
+ * */
+struct ApuMixer {
+  enum Channel { PULSE_1, PULSE_2, NOISE, CHANNEL_COUNT };
+  enum Mode { MIX_LINEAR, MIX_NONLINEAR };
+
+  static const size_t BLOCK_SIZE = 256;
+
+  struct ChannelGain {
+    float gain = 1.0f;
+    bool mute = false;
+  };
+
+  struct Block {
+    uint32_t count = 0;
+    template <typename T>
+    using Channels = std::array<std::array<T, BLOCK_SIZE>, CHANNEL_COUNT>;
+
+    alignas(16) Channels<float> output;  // band limited synth output
+    alignas(16) Channels<uint8_t> level; // 4-bit DAC levels
+
+    void add(float pulse_1, float pulse_2, float noise, uint8_t pulse_1_level,
+             uint8_t pulse_2_level, uint8_t noise_level) {
+      output[PULSE_1][count] = pulse_1;
+      output[PULSE_2][count] = pulse_2;
+      output[NOISE][count] = noise;
+      level[PULSE_1][count] = pulse_1_level;
+      level[PULSE_2][count] = pulse_2_level;
+      level[NOISE][count] = noise_level;
+      count++;
+    }
+  };
+
+  // linear mode loudness of each channel at unity gain
+  static const inline std::array<float, CHANNEL_COUNT> linearWeight = {
+      0.1f, 0.1f, 0.2f};
+
+  // fixed point formats: tables in Q15, gains and table indices in Q8
+  static const int TABLE_SHIFT = 15, GAIN_SHIFT = 8;
+
+  Mode mode = MIX_LINEAR;
+  std::array<ChannelGain, CHANNEL_COUNT> channels;
+
+  // pulse_table[n] = 95.52 / (8128 / n + 100), n = pulse 1 + pulse 2 level
+  static const std::array<int32_t, 32> &pulseTable() {
+    static const std::array<int32_t, 32> table = buildTable<32>(95.52, 8128.0);
+    return table;
+  }
+
+  // tnd_table[n] = 163.67 / (24329 / n + 100), n = 3 * tri + 2 * noise + dmc
+  static const std::array<int32_t, 204> &tndTable() {
+    static const std::array<int32_t, 204> table =
+        buildTable<204>(163.67, 24329.0);
+    return table;
+  }
+
+  // mix a whole block, float output in [-1, 1]
+  void mix(const Block &block, float *out) const {
+    if (mode == MIX_NONLINEAR) {
+      std::array<int16_t, BLOCK_SIZE> fixed;
+      mixFixed(block, fixed.data());
+      for (uint32_t i = 0; i < block.count; i++)
+        out[i] = fixed[i] * (1.0f / 32768.0f);
+    } else {
+      mixLinear(block, out);
+    }
+  }
+
+  // mix a single sample, same result as the block functions
+  float mixSample(float pulse_1, float pulse_2, float noise,
+                  uint8_t pulse_1_level, uint8_t pulse_2_level,
+                  uint8_t noise_level) const {
+    if (mode == MIX_NONLINEAR) {
+      std::array<int32_t, CHANNEL_COUNT> g = fixedGains();
+      return fixedSample(pulse_1_level * g[0] + pulse_2_level * g[1],
+                         2 * noise_level * g[2]) *
+             (1.0f / 32768.0f);
+    }
+    std::array<float, CHANNEL_COUNT> w = linearGains();
+    return (pulse_1 * w[0] + pulse_2 * w[1]) + noise * w[2];
+  }
+
+  void mixLinear(const Block &block, float *out) const {
+    std::array<float, CHANNEL_COUNT> w = linearGains();
+    const float *p1 = block.output[PULSE_1].data();
+    const float *p2 = block.output[PULSE_2].data();
+    const float *ns = block.output[NOISE].data();
+    uint32_t i = 0;
+#ifdef XN_MIXER_SSE2
+    __m128 w1 = _mm_set1_ps(w[0]), w2 = _mm_set1_ps(w[1]),
+           w3 = _mm_set1_ps(w[2]);
+    for (; i + 4 <= block.count; i += 4) {
+      __m128 s = _mm_add_ps(_mm_mul_ps(_mm_load_ps(p1 + i), w1),
+                            _mm_mul_ps(_mm_load_ps(p2 + i), w2));
+      s = _mm_add_ps(s, _mm_mul_ps(_mm_load_ps(ns + i), w3));
+      _mm_storeu_ps(out + i, s);
+    }
+#endif
+    for (; i < block.count; i++)
+      out[i] = (p1[i] * w[0] + p2[i] * w[1]) + ns[i] * w[2];
+  }
+
+  void mixFixed(const Block &block, int16_t *out) const {
+    std::array<int32_t, CHANNEL_COUNT> g = fixedGains();
+    const uint8_t *p1 = block.level[PULSE_1].data();
+    const uint8_t *p2 = block.level[PULSE_2].data();
+    const uint8_t *ns = block.level[NOISE].data();
+    alignas(16) std::array<int32_t, BLOCK_SIZE> pulse_idx, tnd_idx;
+    uint32_t i = 0;
+#ifdef XN_MIXER_SSE2
+    // pulse index = p1 * g1 + p2 * g2, 8 lanes at a time with pmaddwd
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i pulse_gains =
+        _mm_set1_epi32((uint32_t)(g[1] << 16) | (uint16_t)g[0]);
+    const __m128i noise_gain = _mm_set1_epi16((int16_t)(2 * g[2]));
+    for (; i + 8 <= block.count; i += 8) {
+      __m128i a = _mm_unpacklo_epi8(
+          _mm_loadl_epi64((const __m128i *)(p1 + i)), zero);
+      __m128i b = _mm_unpacklo_epi8(
+          _mm_loadl_epi64((const __m128i *)(p2 + i)), zero);
+      __m128i n = _mm_unpacklo_epi8(
+          _mm_loadl_epi64((const __m128i *)(ns + i)), zero);
+      __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi16(a, b), pulse_gains);
+      __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi16(a, b), pulse_gains);
+      _mm_store_si128((__m128i *)(pulse_idx.data() + i), lo);
+      _mm_store_si128((__m128i *)(pulse_idx.data() + i + 4), hi);
+      // products fit in 16 bits: 15 * 2 * 256 = 7680
+      __m128i t = _mm_mullo_epi16(n, noise_gain);
+      _mm_store_si128((__m128i *)(tnd_idx.data() + i),
+                      _mm_unpacklo_epi16(t, zero));
+      _mm_store_si128((__m128i *)(tnd_idx.data() + i + 4),
+                      _mm_unpackhi_epi16(t, zero));
+    }
+#endif
+    for (; i < block.count; i++) {
+      pulse_idx[i] = p1[i] * g[0] + p2[i] * g[1];
+      tnd_idx[i] = 2 * ns[i] * g[2];
+    }
+
+    for (i = 0; i < block.count; i++)
+      out[i] = fixedSample(pulse_idx[i], tnd_idx[i]);
+  }
+
+private:
+  template <size_t N>
+  static std::array<int32_t, N> buildTable(double numerator,
+                                           double divisor) {
+    std::array<int32_t, N> table;
+    table[0] = 0;
+    for (size_t n = 1; n < N; n++)
+      table[n] = (int32_t)std::lround(numerator / (divisor / n + 100.0) *
+                                      (1 << TABLE_SHIFT));
+    return table;
+  }
+
+  // Q8 table indices to a clamped Q15 output sample
+  static int16_t fixedSample(int32_t pulse_index, int32_t tnd_index) {
+    int32_t s = lookup(pulseTable().data(), pulse_index) +
+                lookup(tndTable().data(), tnd_index);
+    return (int16_t)std::min<int32_t>(s, INT16_MAX);
+  }
+
+  // table entry at a Q8 fractional index, linearly interpolated
+  static int32_t lookup(const int32_t *table, int32_t index) {
+    int32_t i = index >> GAIN_SHIFT, frac = index & ((1 << GAIN_SHIFT) - 1);
+    if (frac == 0)
+      return table[i];
+    return table[i] + (((table[i + 1] - table[i]) * frac) >> GAIN_SHIFT);
+  }
+
+  std::array<float, CHANNEL_COUNT> linearGains() const {
+    std::array<float, CHANNEL_COUNT> w;
+    for (size_t c = 0; c < CHANNEL_COUNT; c++)
+      w[c] = channels[c].mute ? 0.0f : channels[c].gain * linearWeight[c];
+    return w;
+  }
+
+  std::array<int32_t, CHANNEL_COUNT> fixedGains() const {
+    std::array<int32_t, CHANNEL_COUNT> g;
+    for (size_t c = 0; c < CHANNEL_COUNT; c++) {
+      float gain = std::max(0.0f, std::min(channels[c].gain, 1.0f));
+      g[c] = channels[c].mute ? 0
+                              : (int32_t)std::lround(gain * (1 << GAIN_SHIFT));
+    }
+    return g;
+  }
+};
@@ -0,0 +1,68 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+
+/**
+ * Controller input per frame, read from FCEUX style .fm2 movies
+ *
+ * Header lines are skipped; each line starting with '|' is one frame:
+ *
+ *   |commands|RLDUTSBA|RLDUTSBA|
+ *
+ * commands is a number, bit 0 a soft reset before the frame. A button is
+ * pressed unless its character is ' ' or '.', so "|0|...T...A|........|"
+ * holds Start and A on port 0. A missing port field is released.
+ * */
+struct InputMovie {
+  struct Frame {
+    std::array<uint8_t, 2> ports{};
+    bool reset = false;
+  };
+
+  std::vector<Frame> frames;
+
+  bool load(const std::string &filename) {
+    std::ifstream file(filename);
+    if (!file.is_open())
+      return false;
+    frames.clear();
+    std::string line;
+    while (std::getline(file, line))
+      if (!line.empty() && line[0] == '|')
+        frames.push_back(parseFrame(line));
+    return true;
+  }
+
+  // input of frame f, released past the end
+  Frame at(size_t f) const { return f < frames.size() ? frames[f] : Frame{}; }
+
+  size_t size() const { return frames.size(); }
+
+  // buttons as controller bits, "RLDUTSBA" from bit 0 to 7
+  static uint8_t parseButtons(const std::string &field) {
+    uint8_t buttons = 0;
+    for (size_t i = 0; i < 8 && i < field.size(); i++)
+      if (field[i] != ' ' && field[i] != '.')
+        buttons |= 1 << i;
+    return buttons;
+  }
+
+private:
+  static Frame parseFrame(const std::string &line) {
+    Frame frame;
+    std::vector<std::string> fields;
+    size_t start = 1;
+    for (size_t bar; (bar = line.find('|', start)) != std::string::npos;
+         start = bar + 1)
+      fields.push_back(line.substr(start, bar - start));
+    if (fields.size() > 0)
+      frame.reset = std::atoi(fields[0].c_str()) & 1;
+    for (size_t port = 0; port < 2 && port + 1 < fields.size(); port++)
+      frame.ports[port] = parseButtons(fields[port + 1]);
+    return frame;
+  }
+};
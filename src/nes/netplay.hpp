@@ -0,0 +1,476 @@
+#pragma once
+#include "../util/xn_hash.hpp"
+#include "bus.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifndef __EMSCRIPTEN__
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+#endif
+
+/**
+ *  Netplay packet, one per host frame in each direction
+ *
+ *  Bytes   content (little endian)
+ * -----------------------------------
+ *  4       "XNP1"
+ *  4       frame of the first input
+ *  4       ack: the sender has every input before this frame
+ *  4       the sender's current frame
+ *  4       hash frame, NO_FRAME if none
+ *  4       hash of the sender's final state at the start of that frame
+ *  1       frame advantage of the sender, signed
+ *  1       input count
+ *  n       inputs, one controller byte per frame
+ *
+ * Every packet repeats all inputs the peer hasn't acknowledged, so a lost
+ * packet costs nothing but a later rollback.
+ * */
+struct NetPacket {
+  static const uint32_t NO_FRAME = UINT32_MAX;
+  static const size_t MAX_INPUTS = 32;
+  static const size_t HEADER_SIZE = 26;
+  static const size_t MAX_SIZE = HEADER_SIZE + MAX_INPUTS;
+
+  uint32_t frame = 0;
+  uint32_t ack = 0;
+  uint32_t current = 0;
+  uint32_t hashFrame = NO_FRAME;
+  uint32_t hash = 0;
+  int8_t advantage = 0;
+  uint8_t count = 0;
+  std::array<uint8_t, MAX_INPUTS> inputs{};
+
+  size_t encode(uint8_t *out) const {
+    std::memcpy(out, "XNP1", 4);
+    put32(out + 4, frame);
+    put32(out + 8, ack);
+    put32(out + 12, current);
+    put32(out + 16, hashFrame);
+    put32(out + 20, hash);
+    out[24] = (uint8_t)advantage;
+    out[25] = count;
+    std::memcpy(out + HEADER_SIZE, inputs.data(), count);
+    return HEADER_SIZE + count;
+  }
+
+  bool decode(const uint8_t *data, size_t size) {
+    if (size < HEADER_SIZE || std::memcmp(data, "XNP1", 4) != 0)
+      return false;
+    count = data[25];
+    if (count > MAX_INPUTS || size != HEADER_SIZE + count)
+      return false;
+    frame = get32(data + 4);
+    ack = get32(data + 8);
+    current = get32(data + 12);
+    hashFrame = get32(data + 16);
+    hash = get32(data + 20);
+    advantage = (int8_t)data[24];
+    std::memcpy(inputs.data(), data + HEADER_SIZE, count);
+    return true;
+  }
+
+private:
+  static void put32(uint8_t *p, uint32_t v) {
+    for (int i = 0; i < 4; i++)
+      p[i] = (uint8_t)(v >> (8 * i));
+  }
+  static uint32_t get32(const uint8_t *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+  }
+};
+
+// unreliable, unordered datagrams to the other player. Never blocks
+struct NetTransport {
+  virtual ~NetTransport() {}
+  virtual void send(const uint8_t *data, size_t size) = 0;
+  // copy the next datagram into data, returns its size or 0 if none is waiting
+  virtual size_t receive(uint8_t *data, size_t capacity) = 0;
+};
+
+/**
+ * Both ends of an in-process connection, for testing two sessions in one
+ * program (on one thread or two). Datagrams can be delayed and dropped:
+ *
+ *   - `delay`: a datagram is held back until that many newer ones were sent
+ *     in the same direction. With one packet per frame that's frames of lag
+ *   - `dropEvery`: every nth datagram is lost, 0 for none
+ * */
+struct LoopbackTransport : NetTransport {
+  uint32_t delay = 0;
+  uint32_t dropEvery = 0;
+
+  // connect a and b
+  static void connect(LoopbackTransport &a, LoopbackTransport &b) {
+    auto ab = std::make_shared<Channel>(), ba = std::make_shared<Channel>();
+    a.out = b.in = ab;
+    b.out = a.in = ba;
+  }
+
+  void send(const uint8_t *data, size_t size) override {
+    std::lock_guard<std::mutex> lock(out->guard);
+    if (dropEvery > 0 && ++sent % dropEvery == 0)
+      return;
+    out->queue.emplace_back(data, data + size);
+    while (out->queue.size() > delay) {
+      out->ready.push_back(std::move(out->queue.front()));
+      out->queue.pop_front();
+    }
+  }
+
+  size_t receive(uint8_t *data, size_t capacity) override {
+    std::lock_guard<std::mutex> lock(in->guard);
+    while (!in->ready.empty()) {
+      std::vector<uint8_t> datagram = std::move(in->ready.front());
+      in->ready.pop_front();
+      if (datagram.size() <= capacity) {
+        std::memcpy(data, datagram.data(), datagram.size());
+        return datagram.size();
+      }
+    }
+    return 0;
+  }
+
+private:
+  struct Channel {
+    std::mutex guard;
+    std::deque<std::vector<uint8_t>> queue; // delayed
+    std::deque<std::vector<uint8_t>> ready;
+  };
+  std::shared_ptr<Channel> in, out;
+  uint32_t sent = 0;
+};
+
+#ifndef __EMSCRIPTEN__
+// non-blocking UDP socket that only talks to one peer
+struct UdpTransport : NetTransport {
+  UdpTransport() {}
+  UdpTransport(const UdpTransport &) = delete;
+  ~UdpTransport() { close(); }
+
+  // listen on local_port, send to peer_host:peer_port (IPv4)
+  bool open(uint16_t local_port, const std::string &peer_host,
+            uint16_t peer_port) {
+    close();
+#ifdef _WIN32
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+      return false;
+    started = true;
+#endif
+    addrinfo hints{}, *result = nullptr;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo(peer_host.c_str(), std::to_string(peer_port).c_str(),
+                    &hints, &result) != 0)
+      return false;
+    std::memcpy(&peer, result->ai_addr, sizeof(peer));
+    freeaddrinfo(result);
+
+    sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock == INVALID)
+      return false;
+    sockaddr_in local{};
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    local.sin_port = htons(local_port);
+#ifdef _WIN32
+    u_long non_blocking = 1;
+    bool ok = ioctlsocket(sock, FIONBIO, &non_blocking) == 0;
+#else
+    bool ok = fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) == 0;
+#endif
+    ok = ok && bind(sock, (sockaddr *)&local, sizeof(local)) == 0;
+    if (!ok)
+      close();
+    return ok;
+  }
+
+  bool isOpen() const { return sock != INVALID; }
+
+  void close() {
+    if (sock != INVALID) {
+#ifdef _WIN32
+      closesocket(sock);
+#else
+      ::close(sock);
+#endif
+      sock = INVALID;
+    }
+#ifdef _WIN32
+    if (started)
+      WSACleanup();
+    started = false;
+#endif
+  }
+
+  void send(const uint8_t *data, size_t size) override {
+    if (isOpen())
+      sendto(sock, (const char *)data, (int)size, 0, (sockaddr *)&peer,
+             sizeof(peer));
+  }
+
+  size_t receive(uint8_t *data, size_t capacity) override {
+    while (isOpen()) {
+      sockaddr_in from{};
+      socklen_t from_size = sizeof(from);
+      auto n = recvfrom(sock, (char *)data, (int)capacity, 0,
+                        (sockaddr *)&from, &from_size);
+      if (n <= 0)
+        return 0;
+      if (from.sin_addr.s_addr == peer.sin_addr.s_addr &&
+          from.sin_port == peer.sin_port)
+        return (size_t)n;
+    }
+    return 0;
+  }
+
+private:
+#ifdef _WIN32
+  using Socket = SOCKET;
+  static constexpr Socket INVALID = INVALID_SOCKET;
+  bool started = false;
+#else
+  using Socket = int;
+  static constexpr Socket INVALID = -1;
+#endif
+  Socket sock = INVALID;
+  sockaddr_in peer{};
+};
+#endif
+
+/**
+ * Two player rollback netplay
+ *
+ * Each side runs its own emulator. Frames never wait for the other player's
+ * input: it is predicted (the last input received) and the frame runs right
+ * away. When the real input of a past frame arrives and differs from the
+ * prediction, the session loads the state saved before that frame and
+ * emulates again up to the present, all within one call to advance(). The
+ * re-simulated frames are speculative and skip rendering
+ * (NesBus::speculative, Ppu2C02::audioOnly), so even the deepest rollback
+ * costs a few frames of CPU time.
+ *
+ * - at most MAX_ROLLBACK frames run ahead of the newest remote input, after
+ *   that advance() waits (returns false) until more arrives
+ * - the side that is ahead waits a frame now and then, so neither ends up
+ *   always predicting
+ * - both sides send a hash of the RAM and PRG-RAM at the start of their newest
+ *   frame that no longer depends on predictions; a mismatch sets desyncFrame
+ *
+ * Both emulators have to start from the same state, e.g. a reset of the same
+ * rom without battery saves.
+ *
+ * Controller port 0 is the local pad: advance() reads it, feeds each port the
+ * right player's input, then puts the local input back, keeping any change
+ * the input handlers made meanwhile. Call advance() once per frame from the
+ * emulation thread, with the bus lock held.
+ * */
+struct RollbackSession {
+  static const uint32_t MAX_ROLLBACK = 8;
+  static const uint32_t HISTORY = 64; // frames of inputs and hashes kept
+  static const uint32_t NO_FRAME = NetPacket::NO_FRAME;
+  static const uint32_t WAIT_INTERVAL = 8; // frames between waits
+
+  // statistics, readable from any thread
+  std::atomic<uint32_t> rollbacks{0};   // mispredictions corrected
+  std::atomic<uint32_t> resimulated{0}; // frames emulated again
+  std::atomic<uint32_t> stalls{0};      // host frames without a new frame
+  std::atomic<uint32_t> lastRollback{0};   // frames re-simulated last time
+  std::atomic<uint32_t> currentFrame{0};   // next frame to emulate
+  std::atomic<uint32_t> confirmedFrame{0}; // inputs before it are all known
+  std::atomic<uint32_t> desyncFrame{NO_FRAME}; // first frame hashes differed
+
+  RollbackSession(NetTransport &transport, int local_player)
+      : transport(transport), localPlayer(local_player & 1) {
+    remoteHashFrames.fill(NO_FRAME);
+  }
+  RollbackSession(const RollbackSession &) = delete;
+
+  int player() const { return localPlayer; }
+  bool desynced() const { return desyncFrame != NO_FRAME; }
+
+  // emulate the next frame, appending its audio to `audio`. False if it had
+  // to wait for the peer instead
+  bool advance(NesBus &nes, std::vector<float> *audio = nullptr) {
+    uint8_t local = nes.controller[0];
+    port0 = local;
+    receive();
+
+    if (rollbackFrame < current) {
+      uint32_t from = rollbackFrame;
+      const std::vector<uint8_t> &state = states[from % states.size()];
+      nes.loadState(state.data(), state.size());
+      for (uint32_t f = from; f < current; f++)
+        runFrame(nes, f, nullptr, true);
+      rollbacks++;
+      resimulated += current - from;
+      lastRollback = current - from;
+    }
+    rollbackFrame = NO_FRAME;
+    finishHashes();
+
+    bool run = current < remoteKnown + MAX_ROLLBACK && !shouldWait();
+    if (run) {
+      localInputs[current % HISTORY] = local;
+      runFrame(nes, current, audio, false);
+      current++;
+    } else {
+      stalls++;
+    }
+    currentFrame = current;
+    confirmedFrame = remoteKnown;
+    send();
+
+    nes.controller[0] = local ^ (nes.controller[0] ^ port0);
+    return run;
+  }
+
+private:
+  NetTransport &transport;
+  int localPlayer;
+
+  uint32_t current = 0;              // next frame to emulate
+  uint32_t remoteKnown = 0;          // remote inputs before it were received
+  uint32_t remoteAck = 0;            // the peer has our inputs before it
+  uint32_t remoteCurrent = 0;        // the peer's newest reported frame
+  int remoteAdvantage = 0;           // how far ahead it thinks it is
+  uint32_t rollbackFrame = NO_FRAME; // earliest mispredicted frame
+  uint32_t hashedFrame = 0;          // hashes before it are final
+  uint32_t lastWait = 0;
+  uint8_t port0 = 0; // last value written to port 0
+
+  std::array<uint8_t, HISTORY> localInputs{}, remoteInputs{}, usedRemote{};
+  std::array<uint32_t, HISTORY> hashes{};
+  std::array<uint32_t, HISTORY> remoteHashFrames{}, remoteHashes{};
+  std::array<std::vector<uint8_t>, MAX_ROLLBACK + 1> states;
+
+  // what game logic keeps: CPU RAM and PRG-RAM. Not the whole save state,
+  // its audio clock depends on each side's sample rate
+  static uint32_t gameHash(NesBus &nes) {
+    uint32_t crc = xn::crc32(nes.memory.data(), nes.memory.size());
+    if (PrgRam *ram = nes.rom->mapper->prgRam())
+      crc = xn::crc32(ram->data(), PrgRam::SIZE, crc);
+    return crc;
+  }
+
+  void runFrame(NesBus &nes, uint32_t f, std::vector<float> *audio,
+                bool resimulating) {
+    std::vector<uint8_t> &state = states[f % states.size()];
+    state.resize(nes.stateSize());
+    nes.saveState(state.data(), state.size());
+    hashes[f % HISTORY] = gameHash(nes);
+
+    uint8_t remote = 0;
+    if (f < remoteKnown)
+      remote = remoteInputs[f % HISTORY];
+    else if (remoteKnown > 0)
+      remote = remoteInputs[(remoteKnown - 1) % HISTORY]; // prediction
+    usedRemote[f % HISTORY] = remote;
+    nes.controller[localPlayer] = localInputs[f % HISTORY];
+    nes.controller[1 - localPlayer] = remote;
+    port0 = nes.controller[0];
+
+    bool audio_only = nes.ppu.audioOnly;
+    nes.speculative = resimulating;
+    nes.ppu.audioOnly = audio_only || resimulating;
+    nes.clockFrame(audio);
+    nes.ppu.audioOnly = audio_only;
+    nes.speculative = false;
+  }
+
+  // time sync: each side sees the other's frames with the same lag, so
+  // different advantages mean one of them really runs ahead
+  bool shouldWait() {
+    if (current == 0 || remoteCurrent == 0)
+      return false;
+    int advantage = (int)(current - remoteCurrent);
+    if (advantage - remoteAdvantage < 2 || current - lastWait < WAIT_INTERVAL)
+      return false;
+    lastWait = current;
+    return true;
+  }
+
+  void receive() {
+    uint8_t data[NetPacket::MAX_SIZE];
+    NetPacket p;
+    while (size_t n = transport.receive(data, sizeof(data))) {
+      if (!p.decode(data, n))
+        continue;
+      remoteAck = std::max(remoteAck, std::min(p.ack, current));
+      remoteCurrent = std::max(remoteCurrent, p.current);
+      remoteAdvantage = p.advantage;
+      // take inputs that continue what we have, the next packet repeats any
+      // that are missing
+      uint32_t end = std::min(p.frame + p.count, current + HISTORY / 2);
+      if (p.frame <= remoteKnown) {
+        for (uint32_t f = remoteKnown; f < end; f++) {
+          uint8_t input = p.inputs[f - p.frame];
+          remoteInputs[f % HISTORY] = input;
+          if (f < current && input != usedRemote[f % HISTORY])
+            rollbackFrame = std::min(rollbackFrame, f);
+        }
+        remoteKnown = std::max(remoteKnown, end);
+      }
+      if (p.hashFrame != NO_FRAME) {
+        remoteHashFrames[p.hashFrame % HISTORY] = p.hashFrame;
+        remoteHashes[p.hashFrame % HISTORY] = p.hash;
+        if (p.hashFrame < hashedFrame)
+          compareHash(p.hashFrame);
+      }
+    }
+  }
+
+  // the state at the start of a frame is final once every input before it is
+  // known and it has been saved again after any rollback
+  void finishHashes() {
+    uint32_t end = std::min(remoteKnown + 1, current);
+    for (; hashedFrame < end; hashedFrame++)
+      if (remoteHashFrames[hashedFrame % HISTORY] == hashedFrame)
+        compareHash(hashedFrame);
+  }
+
+  void compareHash(uint32_t f) {
+    if (current - f >= HISTORY || remoteHashFrames[f % HISTORY] != f)
+      return;
+    if (hashes[f % HISTORY] != remoteHashes[f % HISTORY] && f < desyncFrame)
+      desyncFrame = f;
+  }
+
+  void send() {
+    NetPacket p;
+    uint32_t oldest = current > NetPacket::MAX_INPUTS
+                          ? current - NetPacket::MAX_INPUTS
+                          : 0;
+    p.frame = std::max(remoteAck, oldest);
+    p.count = (uint8_t)(current - p.frame);
+    for (uint32_t i = 0; i < p.count; i++)
+      p.inputs[i] = localInputs[(p.frame + i) % HISTORY];
+    p.ack = remoteKnown;
+    p.current = current;
+    p.advantage = (int8_t)std::clamp((int)(current - remoteCurrent), -127, 127);
+    if (hashedFrame > 0) {
+      p.hashFrame = hashedFrame - 1;
+      p.hash = hashes[p.hashFrame % HISTORY];
+    }
+    uint8_t data[NetPacket::MAX_SIZE];
+    transport.send(data, p.encode(data));
+  }
+};
@@ -0,0 +1,227 @@
+#pragma once
+#include "renderer.hpp"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__SSE2__) && !defined(USE_SCALAR_OBSERVATION)
+#include <emmintrin.h>
+#define XN_OBSERVATION_SSE2 1
+#if defined(__GNUC__)
+#include <tmmintrin.h>
+#define XN_OBSERVATION_SSSE3 1
+#endif
+#endif
+
+/**
+ * Turns PPU frames of palette indices into the small grayscale observations
+ * reinforcement learning agents are trained on
+ *
+ * Per frame:
+ * - palette index -> luma lookup (BT.601), pshufb on CPUs with SSSE3
+ * - max of this frame and the last one, so sprites drawn on alternate
+ *   frames don't flicker out of the observation
+ * - area downsample to width x height: every output pixel is the mean of
+ *   the source area it covers. Rows are summed with SSE2, 16 pixels at a
+ *   time, then columns from the much smaller row sums
+ * - the result is shifted into a [stack, height, width] buffer owned by the
+ *   caller, newest frame last
+ *
+ * Weights are Q8 fixed point, so SIMD and scalar builds give the same bytes.
+ * Define USE_SCALAR_OBSERVATION to build without SIMD.
+ * */
+struct ObservationFilter {
+  static const uint32_t SOURCE_WIDTH = NesRenderer::NES_WIDTH;
+  static const uint32_t SOURCE_HEIGHT = NesRenderer::NES_HEIGHT;
+  static const uint32_t SOURCE_SIZE = SOURCE_WIDTH * SOURCE_HEIGHT;
+
+  struct Options {
+    uint32_t width = 84, height = 84; // at most 256 x 240
+    uint32_t stack = 4;               // frames per observation
+    bool maxPool = true;
+
+    bool valid() const {
+      return width > 0 && width <= SOURCE_WIDTH && height > 0 &&
+             height <= SOURCE_HEIGHT && stack > 0;
+    }
+  };
+
+  ObservationFilter(const Options &options)
+      : options(options), current(SOURCE_SIZE), previous(SOURCE_SIZE) {
+    buildTaps(SOURCE_WIDTH, options.width, columns);
+    buildTaps(SOURCE_HEIGHT, options.height, rows);
+  }
+
+  size_t frameSize() const { return options.width * options.height; }
+  // bytes of one stacked observation
+  size_t size() const { return frameSize() * options.stack; }
+
+  // first frame of an episode, fills the whole stack with it
+  void reset(const uint8_t *indices, uint8_t *out) {
+    toLuma(indices, current.data(), SOURCE_SIZE);
+    previous = current;
+    downsample(out);
+    for (uint32_t s = 1; s < options.stack; s++)
+      std::memcpy(out + s * frameSize(), out, frameSize());
+  }
+
+  // next frame, drops the oldest one from the stack
+  void push(const uint8_t *indices, uint8_t *out) {
+    std::swap(current, previous);
+    toLuma(indices, current.data(), SOURCE_SIZE);
+    std::memmove(out, out + frameSize(), size() - frameSize());
+    downsample(out + size() - frameSize());
+  }
+
+  // luma of each of the 64 colors, 0.299 R + 0.587 G + 0.114 B
+  static const std::array<uint8_t, 64> &lumaTable() {
+    static const std::array<uint8_t, 64> table = [] {
+      std::array<uint8_t, 64> t;
+      for (size_t i = 0; i < t.size(); i++) {
+        const NesPixel &c = NesRenderer::palettes[i];
+        t[i] = (299 * c.r + 587 * c.g + 114 * c.b + 500) / 1000;
+      }
+      return t;
+    }();
+    return table;
+  }
+
+  // palette indices (0-63) to luma
+  static void toLuma(const uint8_t *indices, uint8_t *luma, size_t n) {
+    size_t i = 0;
+#ifdef XN_OBSERVATION_SSSE3
+    if (hasSsse3())
+      i = toLumaSsse3(indices, luma, n);
+#endif
+    const auto &table = lumaTable();
+    for (; i < n; i++)
+      luma[i] = table[indices[i] & 0x3F];
+  }
+
+private:
+  // source pixels that make up each output pixel, weights sum to 256
+  struct Taps {
+    std::vector<uint16_t> first, count, weight; // weight: maxCount per output
+    uint32_t maxCount = 0;
+  };
+
+  Options options;
+  std::vector<uint8_t> current, previous; // full size luma
+  Taps columns, rows;
+  alignas(16) std::array<uint16_t, SOURCE_WIDTH> rowSum;
+
+  static void buildTaps(uint32_t source, uint32_t size, Taps &taps) {
+    // in units of 1/size source pixels, source pixel i is
+    // [i * size, (i + 1) * size) and output pixel j is [j * source, ...)
+    taps.maxCount = (source + size - 1) / size + 1;
+    taps.first.assign(size, 0);
+    taps.count.assign(size, 0);
+    taps.weight.assign(size * taps.maxCount, 0);
+    for (uint32_t j = 0; j < size; j++) {
+      uint32_t begin = j * source, end = (j + 1) * source;
+      uint32_t first = begin / size, last = (end - 1) / size;
+      uint16_t *w = &taps.weight[j * taps.maxCount];
+      uint32_t total = 0, largest = 0;
+      for (uint32_t i = first; i <= last; i++) {
+        uint32_t overlap =
+            std::min((i + 1) * size, end) - std::max(i * size, begin);
+        w[i - first] = (overlap * 256 + source / 2) / source;
+        total += w[i - first];
+        if (w[i - first] > w[largest])
+          largest = i - first;
+      }
+      w[largest] += 256 - total; // rounding error onto the biggest share
+      taps.first[j] = first;
+      taps.count[j] = last - first + 1;
+    }
+  }
+
+  void downsample(uint8_t *out) {
+    const uint8_t *cur = current.data();
+    const uint8_t *prev = options.maxPool ? previous.data() : current.data();
+    for (uint32_t y = 0; y < options.height; y++) {
+      sumRows(cur, prev, y);
+      uint8_t *dst = out + y * options.width;
+      for (uint32_t x = 0; x < options.width; x++) {
+        const uint16_t *s = &rowSum[columns.first[x]];
+        const uint16_t *w = &columns.weight[x * columns.maxCount];
+        uint32_t acc = 1 << 15;
+        for (uint32_t t = 0; t < columns.count[x]; t++)
+          acc += (uint32_t)s[t] * w[t];
+        dst[x] = acc >> 16;
+      }
+    }
+  }
+
+  // weighted sum of the (max pooled) source rows of output row y, in Q8.
+  // 255 * 256 fits in 16 bits
+  void sumRows(const uint8_t *cur, const uint8_t *prev, uint32_t y) {
+    uint32_t first = rows.first[y], count = rows.count[y];
+    const uint16_t *w = &rows.weight[y * rows.maxCount];
+    uint32_t x = 0;
+#ifdef XN_OBSERVATION_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    for (; x + 16 <= SOURCE_WIDTH; x += 16) {
+      __m128i lo = zero, hi = zero;
+      for (uint32_t t = 0; t < count; t++) {
+        size_t at = (first + t) * SOURCE_WIDTH + x;
+        __m128i p = _mm_max_epu8(_mm_loadu_si128((const __m128i *)(cur + at)),
+                                 _mm_loadu_si128((const __m128i *)(prev + at)));
+        __m128i weight = _mm_set1_epi16(w[t]);
+        lo = _mm_add_epi16(lo,
+                           _mm_mullo_epi16(_mm_unpacklo_epi8(p, zero), weight));
+        hi = _mm_add_epi16(hi,
+                           _mm_mullo_epi16(_mm_unpackhi_epi8(p, zero), weight));
+      }
+      _mm_store_si128((__m128i *)&rowSum[x], lo);
+      _mm_store_si128((__m128i *)&rowSum[x + 8], hi);
+    }
+#endif
+    for (; x < SOURCE_WIDTH; x++) {
+      uint32_t acc = 0;
+      for (uint32_t t = 0; t < count; t++) {
+        size_t at = (first + t) * SOURCE_WIDTH + x;
+        acc += std::max(cur[at], prev[at]) * w[t];
+      }
+      rowSum[x] = acc;
+    }
+  }
+
+#ifdef XN_OBSERVATION_SSSE3
+#define XN_OBSERVATION_TARGET __attribute__((target("ssse3")))
+
+  static bool hasSsse3() {
+    static const bool supported = __builtin_cpu_supports("ssse3");
+    return supported;
+  }
+
+  // 16 pixels at a time: one pshufb per 16 entry quarter of the table, the
+  // quarter picked by the top two bits of the index. Returns pixels done
+  XN_OBSERVATION_TARGET static size_t
+  toLumaSsse3(const uint8_t *indices, uint8_t *luma, size_t n) {
+    const auto &table = lumaTable();
+    __m128i quarters[4];
+    for (int q = 0; q < 4; q++)
+      quarters[q] = _mm_loadu_si128((const __m128i *)&table[q * 16]);
+    const __m128i low_bits = _mm_set1_epi8(0x0F);
+    const __m128i high_bits = _mm_set1_epi8(0x30);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(indices + i));
+      __m128i low = _mm_and_si128(v, low_bits);
+      __m128i high = _mm_and_si128(v, high_bits);
+      __m128i out = _mm_setzero_si128();
+      for (int q = 0; q < 4; q++) {
+        __m128i in_quarter = _mm_cmpeq_epi8(high, _mm_set1_epi8(q << 4));
+        out = _mm_or_si128(out, _mm_and_si128(in_quarter,
+                                              _mm_shuffle_epi8(quarters[q],
+                                                               low)));
+      }
+      _mm_storeu_si128((__m128i *)(luma + i), out);
+    }
+    return i;
+  }
+#endif
+};
@@ -0,0 +1,80 @@
+#pragma once
+#include "bus.hpp"
+#include <array>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+/**
+ * Save state split into copy-on-write pages
+ *
+ * For search over many branches of one game (testing, game AI). A branch
+ * captured from its parent shares every page that didn't change: usually all
+ * of PRG-RAM, CHR-RAM and the nametables and most of CPU RAM. It only owns
+ * the few pages its frames wrote, a couple of KB instead of the full ~21 KB.
+ *
+ * Pages are immutable once captured and reference counted, so branches can be
+ * freed in any order and restored from any number of threads at once, each
+ * into its own NesBus (see NesBus::clone()).
+ * */
+struct PagedState {
+  static const size_t PAGE_SIZE = 128;
+  using Page = std::array<uint8_t, PAGE_SIZE>;
+
+  PagedState() {}
+
+  // capture `nes`, sharing the pages that are equal to `parent`'s. Doesn't
+  // lock, like NesBus::saveState()
+  PagedState(NesBus &nes, const PagedState *parent = nullptr) {
+    std::vector<uint8_t> &buffer = scratch();
+    length = nes.stateSize();
+    buffer.assign((length + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE, 0);
+    nes.saveState(buffer.data(), length);
+
+    if (parent != nullptr && parent->length != length)
+      parent = nullptr; // another rom
+    pages.resize(buffer.size() / PAGE_SIZE);
+    for (size_t i = 0; i < pages.size(); i++) {
+      const uint8_t *src = buffer.data() + i * PAGE_SIZE;
+      if (parent != nullptr &&
+          std::memcmp(parent->pages[i]->data(), src, PAGE_SIZE) == 0) {
+        pages[i] = parent->pages[i];
+      } else {
+        auto page = std::make_shared<Page>();
+        std::memcpy(page->data(), src, PAGE_SIZE);
+        pages[i] = std::move(page);
+      }
+    }
+  }
+
+  // load into `nes`, false if it runs a different rom
+  bool restore(NesBus &nes) const {
+    std::vector<uint8_t> &buffer = scratch();
+    buffer.resize(pages.size() * PAGE_SIZE);
+    for (size_t i = 0; i < pages.size(); i++)
+      std::memcpy(buffer.data() + i * PAGE_SIZE, pages[i]->data(), PAGE_SIZE);
+    return nes.loadState(buffer.data(), length);
+  }
+
+  bool empty() const { return pages.empty(); }
+  size_t size() const { return length; } // bytes of the full state
+
+  // pages this state shares with `other`
+  size_t sharedPages(const PagedState &other) const {
+    size_t shared = 0;
+    for (size_t i = 0; i < pages.size() && i < other.pages.size(); i++)
+      shared += pages[i] == other.pages[i];
+    return shared;
+  }
+
+  size_t pageCount() const { return pages.size(); }
+
+private:
+  std::vector<std::shared_ptr<const Page>> pages;
+  size_t length = 0;
+
+  static std::vector<uint8_t> &scratch() {
+    thread_local std::vector<uint8_t> buffer;
+    return buffer;
+  }
+};
@@ -1,14 +1,25 @@
 #include "ppu.hpp"
 
-NesRenderer::Sprite<NesRenderer::NES_WIDTH, NesRenderer::NES_HEIGHT> &
-Ppu2C02::getFramebuffer(bool active) {
-  if (use_vsync) {
-    if (odd)
-      return renderer.framebuffers[0 + active];
-    else
-      return renderer.framebuffers[1 - active];
+NesRenderer::Frame &Ppu2C02::getFramebuffer(bool active) {
+  if (lean) {
+    // made from the palette indices when asked for
+    NesRenderer::Frame &frame = NesRenderer::use(renderer.framebuffer);
+    const NesRenderer::IndexFrame &indices = getIndexFramebuffer(active);
+    for (size_t i = 0; i < indices.size(); i++)
+      frame.buffer[i] = NesRenderer::palettes[indices[i]];
+    return frame;
   }
-  return renderer.framebuffer;
+  if (use_vsync)
+    return NesRenderer::use(renderer.framebuffers)[odd ? 0 + active
+                                                       : 1 - active];
+  return NesRenderer::use(renderer.framebuffer);
+}
+
+NesRenderer::IndexFrame &Ppu2C02::getIndexFramebuffer(bool active) {
+  if (use_vsync)
+    return NesRenderer::use(
+        renderer.indexFramebuffers)[odd ? 0 + active : 1 - active];
+  return NesRenderer::use(renderer.indexFramebuffer);
 }
 
 NesPixel Ppu2C02::getColorFromPalette(uint8_t palette, uint8_t pixel) {
@@ -18,6 +29,8 @@ NesPixel Ppu2C02::getColorFromPalette(uint8_t palette, uint8_t pixel) {
 NesRenderer::Sprite<128, 128> &Ppu2C02::getPatternTable(uint8_t i,
                                                         uint8_t palette) {
   // draw chr ROM into the framebuffer with the given palette
+  NesRenderer::Sprite<128, 128> &sprite =
+      NesRenderer::use(renderer.spritePatternTable)[i];
 
   // for each 16x16 tile
   for (uint16_t y = 0; y < 16; y++) {
@@ -40,23 +53,21 @@ NesRenderer::Sprite<128, 128> &Ppu2C02::getPatternTable(uint8_t i,
           NesPixel p = getColorFromPalette(palette, pixel);
           auto t = 0;
           // DUMP(t);
-          renderer.spritePatternTable[i].setPixel(x * 8 + (7 - col),
-                                                  y * 8 + row, p);
+          sprite.setPixel(x * 8 + (7 - col), y * 8 + row, p);
         }
       }
     }
   }
 
-  return renderer.spritePatternTable[i];
+  return sprite;
 }
 
-NesRenderer::Sprite<NesRenderer::NES_WIDTH, NesRenderer::NES_HEIGHT> &
-Ppu2C02::getNameTable(uint8_t i) {
-  return renderer.spriteNameTable[i];
+NesRenderer::Frame &Ppu2C02::getNameTable(uint8_t i) {
+  return NesRenderer::use(renderer.spriteNameTable)[i];
 }
 
 uint8_t Ppu2C02::cpuRead(uint16_t addr, bool rdOnly) {
-  uint8_t data;
+  uint8_t data = 0; // write only registers, no open bus emulation
   if (rdOnly) {
     switch (addr) {
     case PPU_CTRL:
@@ -150,28 +161,31 @@ void Ppu2C02::cpuWrite(uint16_t addr, uint8_t data) {
   }
 }
 
-uint8_t &Ppu2C02::mirroredNameTableEntry(uint16_t addr) {
-  if (rom->getMirrorMode() == Mapper::MIRROR_VERTICAL) {
+template <typename M>
+uint8_t &Ppu2C02::mirroredNameTableEntryT(uint16_t addr) {
+  Mapper::MirrorMode mirror = rom->getMirrorModeT<M>();
+  if (mirror == Mapper::MIRROR_VERTICAL) {
     return nameTable[(addr / 0x0400) % 2][addr & 0x03FF];
-  } else if (rom->getMirrorMode() == Mapper::MIRROR_HORIZONTAL) {
+  } else if (mirror == Mapper::MIRROR_HORIZONTAL) {
     return nameTable[(addr / 0x0800) % 2][addr & 0x03FF];
   }
 
   return nameTable[0][addr & 0x03FF];
 }
 
-uint8_t Ppu2C02::ppuRead(uint16_t addr, bool rdOnly) {
+template <typename M>
+uint8_t Ppu2C02::ppuReadT(uint16_t addr, bool rdOnly) {
   uint8_t data = 0x00;
   addr &= 0x3FFF;
 
-  if (rom->ppuRead(addr, data)) {
+  if (rom->ppuReadT<M>(addr, data)) {
   } else if (addr <= 0x1FFF) {
     // map a phyical address
     data = patternTable[(addr & 0x1000) >> 12][addr & 0x0FFF];
 
   } else if (addr <= 0x3EFF) {
     addr &= 0x0FFF;
-    data = mirroredNameTableEntry(addr);
+    data = mirroredNameTableEntryT<M>(addr);
 
   } else if (addr <= 0x3FFF) {
     addr &= 0x001F;
@@ -188,14 +202,14 @@ uint8_t Ppu2C02::ppuRead(uint16_t addr, bool rdOnly) {
   return data;
 }
 
-void Ppu2C02::ppuWrite(uint16_t addr, uint8_t data) {
+template <typename M> void Ppu2C02::ppuWriteT(uint16_t addr, uint8_t data) {
   addr &= 0x3FFF;
-  if (rom->ppuWrite(addr, data)) {
+  if (rom->ppuWriteT<M>(addr, data)) {
   } else if (addr <= 0x1FFF) {
     patternTable[(addr & 0x1000) >> 12][addr & 0x0FFF] = data;
   } else if (addr <= 0x3EFF) {
     addr &= 0x0FFF;
-    mirroredNameTableEntry(addr) = data;
+    mirroredNameTableEntryT<M>(addr) = data;
   } else if (addr <= 0x3FFF) {
     addr &= 0x001F;
     if (addr == 0x0010)
@@ -215,6 +229,67 @@ void Ppu2C02::reset() {
   std::memset(&bg, 0, sizeof(bg));
   std::memset(&registers, 0, sizeof(registers));
   odd = false;
+
+  // the buffers clock() draws into, made here rather than on first use so
+  // the UI thread can read them while the emulation thread draws
+  if (use_vsync) {
+    NesRenderer::use(renderer.indexFramebuffers);
+    if (!lean)
+      NesRenderer::use(renderer.framebuffers);
+  } else {
+    NesRenderer::use(renderer.indexFramebuffer);
+    if (!lean)
+      NesRenderer::use(renderer.framebuffer);
+  }
+}
+
+void Ppu2C02::serializeState(StateArchive &ar) {
+  ar(registers.STATUS.val);
+  ar(registers.MASK.val);
+  ar(registers.CTRL.val);
+  ar(registers.v.val);
+  ar(registers.t.val);
+  ar(registers.fineX);
+
+  ar(bg.NextTileId);
+  ar(bg.NextTileAttrib);
+  ar(bg.NextTileLsb);
+  ar(bg.NextTileMsb);
+  ar(bg.ShiftPatternLo);
+  ar(bg.ShiftPatternHi);
+  ar(bg.ShiftAttribLo);
+  ar(bg.ShiftAttribHi);
+
+  ar(OAM.memory.data);
+  ar(OAM.address);
+  for (ObjectAttributeMemory::Entry &e : sprites.scanlineSprites) {
+    ar(e.y);
+    ar(e.id);
+    ar(e.attributes);
+    ar(e.x);
+  }
+  ar(sprites.count);
+  ar(sprites.shiftPatternLo);
+  ar(sprites.shiftPatternHi);
+  ar(sprites.zeroHitPossible);
+  ar(sprites.zeroDrawing);
+
+  for (std::array<uint8_t, 1024> &block : nameTable)
+    ar.bytes(block.data(), block.size());
+  for (std::array<uint8_t, 4096> &block : patternTable)
+    ar.bytes(block.data(), block.size());
+  ar.bytes(paletteTable.data(), paletteTable.size());
+  ar(addressLatch);
+  ar(dataBuffer);
+  ar(scanline);
+  ar(cycle);
+  ar(frameComplete);
+  ar(nmi);
+  ar(nmiIgnore);
+  ar(framecount);
+  ar(odd);
+  ar(zeroHitScanline);
+  ar(zeroHitCycle);
 }
 
 bool Ppu2C02::renderEnabled() {
@@ -308,7 +383,152 @@ void Ppu2C02::updateShifters() {
   }
 }
 
-void Ppu2C02::clock() {
+void Ppu2C02::evaluateSprites() {
+  // clear sprite memory
+  std::memset(sprites.scanlineSprites, 0xFF,
+              8 * sizeof(ObjectAttributeMemory::Entry));
+  sprites.count = 0;
+  std::memset(sprites.shiftPatternLo, 0, 8);
+  std::memset(sprites.shiftPatternHi, 0, 8);
+
+  // find visible sprites on next scanline
+  uint8_t entry_count = 0;
+  sprites.zeroHitPossible = false;
+  while (entry_count < 64 && sprites.count < 9) {
+    // find signed y distance from sprite to scanline
+    int16_t sd_y =
+        ((int16_t)scanline - (int16_t)OAM.memory.entries[entry_count].y);
+
+    if (sd_y >= 0 && sd_y < (registers.CTRL.spriteSize ? 16 : 8)) {
+      // sprite is visible, copy OAM to scanline sprite cache
+      if (sprites.count < 8) {
+        if (entry_count == 0) // zero sprite is visible
+          sprites.zeroHitPossible = true;
+
+        std::memcpy(&sprites.scanlineSprites[sprites.count++],
+                    &OAM.memory.entries[entry_count],
+                    sizeof(ObjectAttributeMemory::Entry));
+      }
+    }
+
+    entry_count++;
+  }
+  registers.STATUS.spriteOverflow = (sprites.count > 8);
+}
+
+void Ppu2C02::loadSpritePattern(uint8_t i, uint8_t &lo, uint8_t &hi) {
+  auto copy_sprite_address_lo = [&](uint16_t &s_pattern_addr_lo, uint8_t i,
+                                    bool flip) {
+    s_pattern_addr_lo =
+        // pattern table offset (0 or 4 KB)
+        (registers.CTRL.spriteAdress8x8 << 12) |
+        // tile id
+        (sprites.scanlineSprites[i].id << 4) |
+        // row within the tile
+        (flip ? (7 - (scanline - sprites.scanlineSprites[i].y))
+              : (scanline - sprites.scanlineSprites[i].y));
+  };
+  auto copy_sprite_address_lo_8x16 = [&](uint16_t &s_pattern_addr_lo,
+                                         uint8_t i, uint8_t tile_offset,
+                                         bool flip) {
+    s_pattern_addr_lo =
+        ((sprites.scanlineSprites[i].id & 0x01) << 12) |
+        (((sprites.scanlineSprites[i].id & 0xFE) + tile_offset) << 4) |
+        (flip ? (7 - (scanline - sprites.scanlineSprites[i].y) & 0x07)
+              : ((scanline - sprites.scanlineSprites[i].y) & 0x07));
+  };
+  uint8_t s_pattern_data_lo, s_pattern_data_hi;
+  uint16_t s_pattern_addr_lo, s_pattern_addr_hi;
+
+  // find memory addresses with pattern data
+  if (!registers.CTRL.spriteSize) {
+    // 8x8 sprite mode
+    copy_sprite_address_lo(s_pattern_addr_lo, i,
+                           sprites.scanlineSprites[i].attributes & 0x80);
+  } else {
+    // 8x16 sprite mode
+    copy_sprite_address_lo_8x16(s_pattern_addr_lo, i,
+                                (scanline - sprites.scanlineSprites[i].y) >= 8,
+                                sprites.scanlineSprites[i].attributes & 0x80);
+  }
+
+  // hi bit plane is always 8 byte ofset from lo plane
+  s_pattern_addr_hi = s_pattern_addr_lo + 8;
+  // read sprite pattern data
+  s_pattern_data_lo = ppuRead(s_pattern_addr_lo);
+  s_pattern_data_hi = ppuRead(s_pattern_addr_hi);
+
+  if (sprites.scanlineSprites[i].attributes & 0x40) {
+    auto flip_byte = [](uint8_t b) {
+      b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
+      b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
+      b = (b & 0xAA) >> 1 | (b & 0x55) << 1;
+      return b;
+    };
+
+    // flip horizontally
+    s_pattern_data_lo = flip_byte(s_pattern_data_lo);
+    s_pattern_data_hi = flip_byte(s_pattern_data_hi);
+  }
+
+  lo = s_pattern_data_lo;
+  hi = s_pattern_data_hi;
+}
+
+void Ppu2C02::predictSpriteZeroHit() {
+  // find the first pixel where sprite 0 overlaps an opaque background pixel on
+  // the next scanline, using the scroll position the fetches will start from
+  zeroHitScanline = -2;
+  if (!sprites.zeroHitPossible || !registers.MASK.showBg ||
+      !registers.MASK.showSprites)
+    return;
+
+  uint8_t sprite_lo, sprite_hi;
+  loadSpritePattern(0, sprite_lo, sprite_hi);
+  const uint8_t sprite_mask = sprite_lo | sprite_hi;
+  if (sprite_mask == 0)
+    return;
+
+  Registers::ScrollRegister v = registers.v;
+  int tile = 0;
+  uint8_t bg_mask = 0;
+  bool fetched = false;
+  for (int i = 0; i < 8; i++) {
+    int x = sprites.scanlineSprites[0].x + i;
+    // left 8 pixels are never checked, same as pixel composition
+    if (x < 8 || x >= NesRenderer::NES_WIDTH || !(sprite_mask & (0x80 >> i)))
+      continue;
+
+    int bg_x = registers.fineX + x;
+    if (!fetched || tile != (bg_x >> 3)) {
+      for (; tile < (bg_x >> 3); tile++) {
+        if (v.coarseX == 31) {
+          v.coarseX = 0;
+          v.nameTableX = ~v.nameTableX;
+        } else {
+          v.coarseX++;
+        }
+      }
+      uint16_t id = ppuRead(0x2000 | (v.val & 0x0FFF));
+      uint16_t addr = (registers.CTRL.bgAddress << 12) + (id << 4) + v.fineY;
+      bg_mask = ppuRead(addr) | ppuRead(addr + 8);
+      fetched = true;
+    }
+
+    if (bg_mask & (0x80 >> (bg_x & 0x07))) {
+      zeroHitScanline = scanline + 1;
+      zeroHitCycle = x + 1;
+      return;
+    }
+  }
+}
+
+template <typename M> void Ppu2C02::clockT() {
+  if (audioOnly) {
+    clockTiming();
+    return;
+  }
+
   if (scanline >= -1 && scanline < 240) {
     if (scanline == 0 && cycle == 0 && odd && renderEnabled())
       cycle = 1; // odd frame, skip cycle
@@ -328,13 +548,14 @@ void Ppu2C02::clock() {
       switch ((cycle - 1) % 8) {
       case 0:
         loadBackgroundShifters();
-        bg.NextTileId = ppuRead(0x2000 | (registers.v.val & 0x0FFF));
+        bg.NextTileId = ppuReadT<M>(0x2000 | (registers.v.val & 0x0FFF));
         break;
       case 2:
-        bg.NextTileAttrib = ppuRead(0x23C0 | (registers.v.nameTableY << 11) |
-                                    (registers.v.nameTableX << 10) |
-                                    ((registers.v.coarseY >> 2) << 3) |
-                                    (registers.v.coarseX >> 2));
+        bg.NextTileAttrib =
+            ppuReadT<M>(0x23C0 | (registers.v.nameTableY << 11) |
+                        (registers.v.nameTableX << 10) |
+                        ((registers.v.coarseY >> 2) << 3) |
+                        (registers.v.coarseX >> 2));
         // find the 2 bits of palette info
         if (registers.v.coarseY & 0x02)
           bg.NextTileAttrib >>= 4;
@@ -345,14 +566,14 @@ void Ppu2C02::clock() {
       case 4:
         // fetch background tile LSB bit plane from pattern memory
         bg.NextTileLsb =
-            ppuRead((registers.CTRL.bgAddress << 12) +
+            ppuReadT<M>((registers.CTRL.bgAddress << 12) +
                     ((uint16_t)bg.NextTileId << 4) + registers.v.fineY);
         break;
       case 6:
         // fetch background tile MSB bit plane from pattern memory
         // same as LSB but with 8 bit offset added
         bg.NextTileMsb =
-            ppuRead((registers.CTRL.bgAddress << 12) +
+            ppuReadT<M>((registers.CTRL.bgAddress << 12) +
                     ((uint16_t)bg.NextTileId << 4) + registers.v.fineY + 8);
         break;
       case 7:
@@ -371,106 +592,19 @@ void Ppu2C02::clock() {
     }
 
     if (cycle == 338 || cycle == 340) // read tile id at end of scanline
-      bg.NextTileId = ppuRead(0x2000 | (registers.v.val & 0x0FFF));
+      bg.NextTileId = ppuReadT<M>(0x2000 | (registers.v.val & 0x0FFF));
 
     if (scanline == -1 && cycle >= 280 && cycle < 305)
       txAddressY(); // end of vblank, reset y address for rendering
 
-    if (cycle == 257 && scanline >= 0) {
-      // clear sprite memory
-      std::memset(sprites.scanlineSprites, 0xFF,
-                  8 * sizeof(ObjectAttributeMemory::Entry));
-      sprites.count = 0;
-      std::memset(sprites.shiftPatternLo, 0, 8);
-      std::memset(sprites.shiftPatternHi, 0, 8);
-
-      // find visible sprites on next scanline
-      uint8_t entry_count = 0;
-      sprites.zeroHitPossible = false;
-      while (entry_count < 64 && sprites.count < 9) {
-        // find signed y distance from sprite to scanline
-        int16_t sd_y =
-            ((int16_t)scanline - (int16_t)OAM.memory.entries[entry_count].y);
-
-        if (sd_y >= 0 && sd_y < (registers.CTRL.spriteSize ? 16 : 8)) {
-          // sprite is visible, copy OAM to scanline sprite cache
-          if (sprites.count < 8) {
-            if (entry_count == 0) // zero sprite is visible
-              sprites.zeroHitPossible = true;
-
-            std::memcpy(&sprites.scanlineSprites[sprites.count++],
-                        &OAM.memory.entries[entry_count],
-                        sizeof(ObjectAttributeMemory::Entry));
-          }
-        }
-
-        entry_count++;
-      }
-      registers.STATUS.spriteOverflow = (sprites.count > 8);
-    }
+    if (cycle == 257 && scanline >= 0)
+      evaluateSprites();
 
     if (cycle == 340) {
       // end of scanline, prepare sprite shifters with visible sprites
-      auto copy_sprite_address_lo = [&](uint16_t &s_pattern_addr_lo, uint8_t i,
-                                        bool flip) {
-        s_pattern_addr_lo =
-            // pattern table offset (0 or 4 KB)
-            (registers.CTRL.spriteAdress8x8 << 12) |
-            // tile id
-            (sprites.scanlineSprites[i].id << 4) |
-            // row within the tile
-            (flip ? (7 - (scanline - sprites.scanlineSprites[i].y))
-                  : (scanline - sprites.scanlineSprites[i].y));
-      };
-      auto copy_sprite_address_lo_8x16 = [&](uint16_t &s_pattern_addr_lo,
-                                             uint8_t i, uint8_t tile_offset,
-                                             bool flip) {
-        s_pattern_addr_lo =
-            ((sprites.scanlineSprites[i].id & 0x01) << 12) |
-            (((sprites.scanlineSprites[i].id & 0xFE) + tile_offset) << 4) |
-            (flip ? (7 - (scanline - sprites.scanlineSprites[i].y) & 0x07)
-                  : ((scanline - sprites.scanlineSprites[i].y) & 0x07));
-      };
-      for (auto i = 0; i < sprites.count; i++) {
-        uint8_t s_pattern_data_lo, s_pattern_data_hi;
-        uint16_t s_pattern_addr_lo, s_pattern_addr_hi;
-
-        // find memory addresses with pattern data
-        if (!registers.CTRL.spriteSize) {
-          // 8x8 sprite mode
-          copy_sprite_address_lo(s_pattern_addr_lo, i,
-                                 sprites.scanlineSprites[i].attributes & 0x80);
-        } else {
-          // 8x16 sprite mode
-          copy_sprite_address_lo_8x16(
-              s_pattern_addr_lo, i,
-              (scanline - sprites.scanlineSprites[i].y) >= 8,
-              sprites.scanlineSprites[i].attributes & 0x80);
-        }
-
-        // hi bit plane is always 8 byte ofset from lo plane
-        s_pattern_addr_hi = s_pattern_addr_lo + 8;
-        // read sprite pattern data
-        s_pattern_data_lo = ppuRead(s_pattern_addr_lo);
-        s_pattern_data_hi = ppuRead(s_pattern_addr_hi);
-
-        if (sprites.scanlineSprites[i].attributes & 0x40) {
-          auto flip_byte = [](uint8_t b) {
-            b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
-            b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
-            b = (b & 0xAA) >> 1 | (b & 0x55) << 1;
-            return b;
-          };
-
-          // flip horizontally
-          s_pattern_data_lo = flip_byte(s_pattern_data_lo);
-          s_pattern_data_hi = flip_byte(s_pattern_data_hi);
-        }
-
-        // load pattern data to sprite shift registers
-        sprites.shiftPatternLo[i] = s_pattern_data_lo;
-        sprites.shiftPatternHi[i] = s_pattern_data_hi;
-      }
+      for (auto i = 0; i < sprites.count; i++)
+        loadSpritePattern(i, sprites.shiftPatternLo[i],
+                          sprites.shiftPatternHi[i]);
     }
   }
 
@@ -478,13 +612,7 @@ void Ppu2C02::clock() {
     // post render scanline
   }
 
-  if (scanline == 241 && cycle == 1) {
-    // end of frame
-    registers.STATUS.vblank = 1;
-    if (registers.CTRL.vblankNmi && !nmiIgnore)
-      nmi = true;
-    nmiIgnore = false;
-  }
+  startVerticalBlank();
 
   // pixel composition
 
@@ -574,10 +702,28 @@ void Ppu2C02::clock() {
 
   if (scanline < NesRenderer::NES_HEIGHT && scanline >= 0 &&
       cycle - 1 < NesRenderer::NES_WIDTH) {
-    getFramebuffer(true).setPixel((cycle - 1), scanline,
-                                  getColorFromPalette(palette, pix));
+    uint8_t color = ppuReadT<M>(0x3F00 + (palette << 2) + pix) & 0x3F;
+    getIndexFramebuffer(true)[(cycle - 1) + scanline * NesRenderer::NES_WIDTH] =
+        color;
+    if (!lean)
+      getFramebuffer(true).setPixel((cycle - 1), scanline,
+                                    NesRenderer::palettes[color]);
+  }
+
+  nextCycle();
+}
+
+void Ppu2C02::startVerticalBlank() {
+  if (scanline == 241 && cycle == 1) {
+    // end of frame
+    registers.STATUS.vblank = 1;
+    if (registers.CTRL.vblankNmi && !nmiIgnore)
+      nmi = true;
+    nmiIgnore = false;
   }
+}
 
+void Ppu2C02::nextCycle() {
   cycle++;
   if (renderEnabled() && cycle == 260 && scanline < 240)
     rom->mapper->scanline();
@@ -593,4 +739,65 @@ void Ppu2C02::clock() {
       odd = !odd;
     }
   }
-}
\ No newline at end of file
+}
+
+// audio only mode: no fetches, pixel composition or framebuffer writes. Keeps
+// what the CPU and mapper can observe: scroll registers, status flags,
+// VBL/NMI, mapper scanline counting and a predicted sprite 0 hit
+void Ppu2C02::clockTiming() {
+  if (scanline >= -1 && scanline < 240) {
+    if (scanline == 0 && cycle == 0 && odd && renderEnabled())
+      cycle = 1; // odd frame, skip cycle
+    if (scanline == -1 && cycle == 1) {
+      // new frame
+      registers.STATUS.vblank = 0;
+      registers.STATUS.spriteOverflow = 0;
+      registers.STATUS.spriteZeroHit = 0;
+    }
+
+    // keep v in step with the fetches that are skipped
+    if (((cycle >= 2 && cycle < 258) || (cycle >= 321 && cycle < 338)) &&
+        (cycle - 1) % 8 == 7)
+      scrollX();
+
+    if (cycle == 256)
+      scrollY();
+
+    if (cycle == 257)
+      txAddressX();
+
+    if (scanline == -1 && cycle >= 280 && cycle < 305)
+      txAddressY();
+
+    if (cycle == 257 && scanline >= 0) {
+      evaluateSprites();
+      predictSpriteZeroHit();
+    }
+
+    if (scanline == zeroHitScanline && cycle == zeroHitCycle &&
+        registers.MASK.showBg && registers.MASK.showSprites)
+      registers.STATUS.spriteZeroHit = 1;
+  }
+
+  startVerticalBlank();
+  nextCycle();
+}
+
+template <typename M> void Ppu2C02::useMapper() {
+  clockFn = &Ppu2C02::clockT<M>;
+  ppuReadFn = &Ppu2C02::ppuReadT<M>;
+  ppuWriteFn = &Ppu2C02::ppuWriteT<M>;
+}
+
+// instantiate the PPU for every mapper type, see NesBus::useMapper()
+#define XN_PPU_MAPPER(M)                                                       \
+  template void Ppu2C02::useMapper<M>();                                       \
+  template void Ppu2C02::clockT<M>();                                          \
+  template uint8_t Ppu2C02::ppuReadT<M>(uint16_t addr, bool rdOnly);           \
+  template void Ppu2C02::ppuWriteT<M>(uint16_t addr, uint8_t data);
+
+XN_PPU_MAPPER(Mapper)
+XN_PPU_MAPPER(Mapper000)
+XN_PPU_MAPPER(Mapper001)
+XN_PPU_MAPPER(Mapper002)
+XN_PPU_MAPPER(Mapper004)
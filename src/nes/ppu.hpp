@@ -71,7 +71,7 @@ public:
     ScrollRegister v;
     ScrollRegister t;
     uint8_t fineX;
-  } registers;
+  };
 
   struct BackgroundData {
     uint8_t NextTileId = 0;
@@ -82,7 +82,7 @@ public:
     uint16_t ShiftPatternHi = 0;
     uint16_t ShiftAttribLo = 0;
     uint16_t ShiftAttribHi = 0;
-  } bg;
+  };
 
   struct ObjectAttributeMemory {
     struct Entry {
@@ -96,7 +96,7 @@ public:
       uint8_t data[64 * sizeof(Entry)];
     } memory;
     uint8_t address;
-  } OAM;
+  };
 
   struct SpriteInfo {
     ObjectAttributeMemory::Entry scanlineSprites[8];
@@ -105,49 +105,83 @@ public:
     uint8_t shiftPatternHi[8];
     bool zeroHitPossible = false;
     bool zeroDrawing = false;
-  } sprites;
+  };
 
-  std::array<std::array<uint8_t, 1024>, 2> nameTable;
-  std::array<std::array<uint8_t, 4096>, 2> patternTable;
+  // per cycle state first: registers, shifters, beam position and flags
+  Registers registers;
+  BackgroundData bg;
+  SpriteInfo sprites;
+  int16_t scanline = 0, cycle = 0;
+  uint8_t addressLatch = 0, dataBuffer = 0;
+  bool frameComplete = false, nmi = false, nmiIgnore = false;
+  bool use_vsync = true;
+  bool odd = false;
+  bool audioOnly = false; // skip all video work, see clockTiming()
+  // draw palette indices only, getFramebuffer() converts them when called.
+  // Usually with use_vsync off, drawFrame() leaves a whole frame either way
+  bool lean = false;
+  uint32_t framecount = 0;
+
+private:
+  // mapper specialized paths, picked by useMapper()
+  void (Ppu2C02::*clockFn)() = &Ppu2C02::clockT<Mapper>;
+  uint8_t (Ppu2C02::*ppuReadFn)(uint16_t, bool) = &Ppu2C02::ppuReadT<Mapper>;
+  void (Ppu2C02::*ppuWriteFn)(uint16_t, uint8_t) = &Ppu2C02::ppuWriteT<Mapper>;
+
+public:
   std::array<uint8_t, 32> paletteTable;
   std::shared_ptr<NesRom> rom;
-  uint8_t addressLatch = 0, dataBuffer = 0;
-  int16_t scanline = 0, cycle = 0;
+  ObjectAttributeMemory OAM;
 
+  // buffers, pointers to memory allocated on demand
   NesRenderer renderer;
 
-  bool frameComplete = false, nmi = false, nmiIgnore = false;
-  bool use_vsync = true;
-  uint32_t framecount = 0;
-  bool odd = false;
+  // 2 KB of VRAM and 8 KB of pattern memory, last
+  std::array<std::array<uint8_t, 1024>, 2> nameTable;
+  std::array<std::array<uint8_t, 4096>, 2> patternTable;
 
-  NesRenderer::Sprite<NesRenderer::NES_WIDTH, NesRenderer::NES_HEIGHT> &
-  getFramebuffer(bool active = false);
+  NesRenderer::Frame &getFramebuffer(bool active = false);
+  NesRenderer::IndexFrame &getIndexFramebuffer(bool active = false);
 
   NesPixel getColorFromPalette(uint8_t palette, uint8_t pixel);
 
   NesRenderer::Sprite<128, 128> &getPatternTable(uint8_t i, uint8_t palette);
 
-  NesRenderer::Sprite<NesRenderer::NES_WIDTH, NesRenderer::NES_HEIGHT> &
-  getNameTable(uint8_t i);
+  NesRenderer::Frame &getNameTable(uint8_t i);
 
   uint8_t cpuRead(uint16_t addr, bool rdOnly = false);
 
   void cpuWrite(uint16_t addr, uint8_t data);
 
-  uint8_t &mirroredNameTableEntry(uint16_t addr);
+  uint8_t ppuRead(uint16_t addr, bool rdOnly = false) {
+    return (this->*ppuReadFn)(addr, rdOnly);
+  }
 
-  uint8_t ppuRead(uint16_t addr, bool rdOnly = false);
-
-  void ppuWrite(uint16_t addr, uint8_t data);
+  void ppuWrite(uint16_t addr, uint8_t data) {
+    (this->*ppuWriteFn)(addr, data);
+  }
 
   void connectRom(const std::shared_ptr<NesRom> &rom) { this->rom = rom; }
 
   void reset();
 
-  void clock();
+  void serializeState(StateArchive &ar);
+
+  void clock() { (this->*clockFn)(); }
+
+  // route clock() and PPU bus access through the versions specialized for
+  // mapper type M. Instantiated in ppu.cpp for every supported mapper
+  template <typename M> void useMapper();
 
 private:
+  template <typename M> void clockT();
+
+  template <typename M> uint8_t ppuReadT(uint16_t addr, bool rdOnly = false);
+
+  template <typename M> void ppuWriteT(uint16_t addr, uint8_t data);
+
+  template <typename M> uint8_t &mirroredNameTableEntryT(uint16_t addr);
+
   bool renderEnabled();
 
   void scrollX();
@@ -161,4 +195,18 @@ private:
   void loadBackgroundShifters();
 
   void updateShifters();
+
+  void evaluateSprites();
+
+  void loadSpritePattern(uint8_t i, uint8_t &lo, uint8_t &hi);
+
+  void predictSpriteZeroHit();
+
+  void startVerticalBlank();
+
+  void nextCycle();
+
+  void clockTiming();
+
+  int16_t zeroHitScanline = -2, zeroHitCycle = 0;
 };
\ No newline at end of file
@@ -0,0 +1,143 @@
+#pragma once
+#include "../util/xn_mapped_file.hpp"
+#include "state.hpp"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/**
+ * Cartridge work RAM at CPU $6000-$7FFF
+ *
+ * Battery backed carts attach a .sav file, which is then mapped in as the RAM
+ * itself. Stores only mark their 256 byte page dirty; a background thread
+ * writes dirty pages to disk when a frame ends (requestFlush()) or every
+ * FLUSH_INTERVAL, so saving never costs the emulation thread any time and a
+ * crash loses at most what the OS hadn't written yet.
+ * */
+struct PrgRam {
+  static const size_t SIZE = 8 * 1024;
+  static const size_t PAGE_SIZE = 256; // dirty tracking granularity
+  static constexpr std::chrono::milliseconds FLUSH_INTERVAL{1000};
+
+  PrgRam() { local.fill(0); }
+  PrgRam(const PrgRam &) = delete;
+  PrgRam &operator=(const PrgRam &) = delete;
+  ~PrgRam() { detach(); }
+
+  uint8_t read(uint16_t addr) const { return memory[addr & (SIZE - 1)]; }
+
+  void write(uint16_t addr, uint8_t data) {
+    addr &= SIZE - 1;
+    memory[addr] = data;
+    if (file.isOpen()) {
+      uint32_t page = 1u << (addr / PAGE_SIZE);
+      if (!(dirty.load(std::memory_order_relaxed) & page))
+        dirty.fetch_or(page, std::memory_order_relaxed);
+    }
+  }
+
+  uint8_t *data() { return memory; }
+
+  // a loaded state counts as a write to every page it changes. Run-ahead
+  // restores a state every frame, usually identical to the RAM
+  void serializeState(StateArchive &ar) {
+    if (!ar.loading() || !file.isOpen()) {
+      ar.bytes(memory, SIZE);
+      return;
+    }
+    uint8_t before[SIZE];
+    std::memcpy(before, memory, SIZE);
+    ar.bytes(memory, SIZE);
+    uint32_t pages = 0;
+    for (size_t i = 0; i < SIZE / PAGE_SIZE; i++) {
+      if (std::memcmp(before + i * PAGE_SIZE, memory + i * PAGE_SIZE,
+                      PAGE_SIZE) != 0)
+        pages |= 1u << i;
+    }
+    if (pages != 0)
+      dirty.fetch_or(pages, std::memory_order_relaxed);
+  }
+
+  bool isBatteryBacked() const { return file.isOpen(); }
+
+  // use `path` as battery backed storage, its contents become the RAM
+  bool attach(const std::string &path) {
+    detach();
+    if (!file.open(path, SIZE))
+      return false;
+    memory = file.data();
+#ifndef __EMSCRIPTEN__
+    stopping = false;
+    flusher = std::thread(&PrgRam::flushLoop, this);
+#endif
+    return true;
+  }
+
+  void detach() {
+    if (!file.isOpen())
+      return;
+    if (flusher.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(guard);
+        stopping = true;
+      }
+      wake.notify_one();
+      flusher.join();
+    }
+    flush();
+    std::memcpy(local.data(), memory, SIZE);
+    memory = local.data();
+    file.close();
+  }
+
+  // called at frame boundaries, cheap when nothing was written
+  void requestFlush() {
+    if (dirty.load(std::memory_order_relaxed) == 0)
+      return;
+#ifdef __EMSCRIPTEN__
+    flush();
+#else
+    wake.notify_one();
+#endif
+  }
+
+  // write dirty pages to disk, safe to call from any thread
+  void flush() {
+    uint32_t pages = dirty.exchange(0, std::memory_order_relaxed);
+    for (size_t i = 0; i < 32 && pages != 0; i++) {
+      if (!(pages & (1u << i)))
+        continue;
+      size_t first = i;
+      while (i < 32 && (pages & (1u << i)))
+        pages &= ~(1u << i++);
+      file.sync(first * PAGE_SIZE, (i - first) * PAGE_SIZE);
+    }
+  }
+
+private:
+  std::array<uint8_t, SIZE> local;
+  uint8_t *memory = local.data();
+  std::atomic<uint32_t> dirty{0}; // one bit per page
+  xn::SharedMappedFile file;
+
+  std::thread flusher;
+  std::mutex guard;
+  std::condition_variable wake;
+  bool stopping = false;
+
+  void flushLoop() {
+    std::unique_lock<std::mutex> lock(guard);
+    while (!stopping) {
+      wake.wait_for(lock, FLUSH_INTERVAL);
+      lock.unlock();
+      flush();
+      lock.lock();
+    }
+  }
+};
@@ -2,6 +2,7 @@
 #include <array>
 #include <assert.h>
 #include <cstdint>
+#include <memory>
 
 struct NesPixel {
   uint8_t r;
@@ -21,10 +22,26 @@ struct NesRenderer {
   };
 
   static const uint32_t NES_WIDTH = 256, NES_HEIGHT = 240;
-  Sprite<NES_WIDTH, NES_HEIGHT> framebuffer;
-  std::array<Sprite<NES_WIDTH, NES_HEIGHT>, 2> framebuffers;
-  std::array<Sprite<NES_WIDTH, NES_HEIGHT>, 2> spriteNameTable;
-  std::array<Sprite<128, 128>, 2> spritePatternTable;
+  using Frame = Sprite<NES_WIDTH, NES_HEIGHT>;
+  // the same frames as palette indices (0-63) instead of colors
+  using IndexFrame = std::array<uint8_t, NES_WIDTH * NES_HEIGHT>;
+
+  // An instance only pays for the buffers it draws into: one frame without
+  // vsync or two with it, RGB unless the PPU is lean. Ppu2C02::reset()
+  // makes those; the debug views, and a lean PPU's RGB frame, are made by
+  // use() on first access, from one thread only
+  std::unique_ptr<Frame> framebuffer;
+  std::unique_ptr<std::array<Frame, 2>> framebuffers;
+  std::unique_ptr<IndexFrame> indexFramebuffer;
+  std::unique_ptr<std::array<IndexFrame, 2>> indexFramebuffers;
+  std::unique_ptr<std::array<Frame, 2>> spriteNameTable;
+  std::unique_ptr<std::array<Sprite<128, 128>, 2>> spritePatternTable;
+
+  template <typename T> static T &use(std::unique_ptr<T> &buffer) {
+    if (buffer == nullptr)
+      buffer = std::make_unique<T>();
+    return *buffer;
+  }
 
   static const inline std::array<NesPixel, 64> palettes = {{
       {84, 84, 84},    {0, 30, 116},    {8, 16, 144},    {48, 0, 136},
@@ -0,0 +1,210 @@
+#pragma once
+#include "bus.hpp"
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <vector>
+
+/**
+ * Rewind history
+ *
+ * Keeps the newest save state in full and every older one as the XOR of it
+ * and its successor. Between consecutive frames only RAM, nametables, OAM,
+ * palettes, mapper RAM and a handful of registers change, so the deltas are
+ * almost all zeros; they're stored zero-run-length encoded:
+ *
+ *   [zero run length][literal count][literal bytes]...  (LEB128 varints)
+ *
+ * Records live in a fixed size byte ring, the oldest are dropped when it
+ * fills up. Stepping back XORs the newest delta into the full state in place,
+ * so neither direction needs a decompression buffer or allocates once the
+ * buffers are sized for the current rom.
+ *
+ * capture() and step() must be called from the thread that runs the
+ * emulation, with the bus lock held. The counters and `held` can be used from
+ * anywhere.
+ * */
+struct RewindBuffer {
+  static const size_t MIN_ZERO_RUN = 8; // shorter runs stay in literals
+
+  uint32_t interval = 1; // frames between snapshots
+  std::atomic<bool> held{false}; // rewind input is down
+
+  std::atomic<size_t> snapshots{0}; // steps available
+  std::atomic<size_t> bytesUsed{0}; // compressed bytes in the ring
+
+  RewindBuffer(size_t budget_bytes = 0) { setBudget(budget_bytes); }
+
+  void setBudget(size_t budget_bytes) {
+    ring.assign(budget_bytes, 0);
+    clear();
+  }
+
+  size_t budget() const { return ring.size(); }
+
+  void clear() {
+    records.clear();
+    head.clear();
+    writePos = 0;
+    snapshots = 0;
+    bytesUsed = 0;
+  }
+
+  // call after emulating, saves a snapshot every `interval` frames
+  void capture(NesBus &nes) {
+    if (ring.empty() || nes.ppu.framecount - lastFrame < interval)
+      return;
+    lastFrame = nes.ppu.framecount;
+
+    size_t size = nes.stateSize();
+    if (size != head.size() || nes.rom->image->hash != romHash) {
+      // new rom, start over
+      clear();
+      romHash = nes.rom->image->hash;
+      head.resize(size);
+      current.resize(size);
+      packed.resize(size + size / 4 + 64);
+      nes.saveState(head.data(), head.size());
+      return;
+    }
+
+    nes.saveState(current.data(), current.size());
+    size_t packed_size = pack(current.data(), head.data(), size, packed.data());
+    store(packed.data(), packed_size);
+    head.swap(current);
+  }
+
+  // go back one snapshot and load it into `nes`, false if there is none
+  bool step(NesBus &nes) {
+    if (records.empty())
+      return false;
+    const Record &r = records.back();
+    unpack(ring.data() + r.offset, r.size, head.data());
+    bytesUsed -= r.size;
+    records.pop_back();
+    snapshots = records.size();
+    if (!records.empty())
+      writePos = records.back().offset + records.back().size;
+    if (!nes.loadState(head.data(), head.size()))
+      return false;
+    lastFrame = nes.ppu.framecount;
+    return true;
+  }
+
+  // zero-run-length encode a ^ b into out, returns the encoded size
+  static size_t pack(const uint8_t *a, const uint8_t *b, size_t n,
+                     uint8_t *out) {
+    uint8_t *o = out;
+    size_t i = 0;
+    while (i < n) {
+      size_t zeros_end = i;
+      uint64_t wa, wb;
+      while (zeros_end + 8 <= n) {
+        std::memcpy(&wa, a + zeros_end, 8);
+        std::memcpy(&wb, b + zeros_end, 8);
+        if (wa != wb)
+          break;
+        zeros_end += 8;
+      }
+      while (zeros_end < n && a[zeros_end] == b[zeros_end])
+        zeros_end++;
+
+      // literals run until MIN_ZERO_RUN matching bytes in a row
+      size_t literal_end = zeros_end, run = 0;
+      while (literal_end < n) {
+        if (a[literal_end] != b[literal_end])
+          run = 0;
+        else if (++run == MIN_ZERO_RUN) {
+          literal_end -= MIN_ZERO_RUN - 1;
+          break;
+        }
+        literal_end++;
+      }
+
+      o = putVarint(o, zeros_end - i);
+      o = putVarint(o, literal_end - zeros_end);
+      for (size_t k = zeros_end; k < literal_end; k++)
+        *o++ = a[k] ^ b[k];
+      i = literal_end;
+    }
+    return o - out;
+  }
+
+  // XOR an encoded delta into state
+  static void unpack(const uint8_t *in, size_t size, uint8_t *state) {
+    const uint8_t *end = in + size;
+    while (in < end) {
+      uint64_t zeros, literals;
+      in = getVarint(in, zeros);
+      in = getVarint(in, literals);
+      state += zeros;
+      for (uint64_t k = 0; k < literals; k++)
+        *state++ ^= *in++;
+    }
+  }
+
+private:
+  struct Record {
+    size_t offset, size;
+  };
+
+  std::vector<uint8_t> ring;
+  std::deque<Record> records; // oldest first
+  size_t writePos = 0;
+  uint32_t lastFrame = 0; // ppu frame of the newest snapshot
+
+  std::string romHash;
+  std::vector<uint8_t> head;    // newest state, in full
+  std::vector<uint8_t> current; // scratch for the state being captured
+  std::vector<uint8_t> packed;  // scratch for its encoded delta
+
+  void store(const uint8_t *data, size_t size) {
+    if (size > ring.size()) {
+      // a single delta bigger than the budget, history can't go past here
+      records.clear();
+      bytesUsed = 0;
+      snapshots = 0;
+      return;
+    }
+    size_t pos = writePos;
+    bool wrapped = pos + size > ring.size();
+    if (wrapped)
+      pos = 0;
+    // the oldest records sit right after the write position
+    while (!records.empty()) {
+      const Record &r = records.front();
+      bool skipped = wrapped && r.offset >= writePos;
+      bool overlaps = r.offset < pos + size && r.offset + r.size > pos;
+      if (!skipped && !overlaps)
+        break;
+      bytesUsed -= r.size;
+      records.pop_front();
+    }
+    std::memcpy(ring.data() + pos, data, size);
+    records.push_back({pos, size});
+    writePos = pos + size;
+    bytesUsed += size;
+    snapshots = records.size();
+  }
+
+  static uint8_t *putVarint(uint8_t *o, uint64_t v) {
+    while (v >= 0x80) {
+      *o++ = (uint8_t)(v | 0x80);
+      v >>= 7;
+    }
+    *o++ = (uint8_t)v;
+    return o;
+  }
+
+  static const uint8_t *getVarint(const uint8_t *in, uint64_t &v) {
+    v = 0;
+    for (int shift = 0;; shift += 7) {
+      uint8_t b = *in++;
+      v |= (uint64_t)(b & 0x7F) << shift;
+      if (!(b & 0x80))
+        return in;
+    }
+  }
+};
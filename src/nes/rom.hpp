@@ -1,11 +1,19 @@
 #pragma once
+#include "../util/xn_hash.hpp"
+#include "../util/xn_mapped_file.hpp"
 #include "mappers.hpp"
+#include <algorithm>
 #include <bitset>
 #include <cstdint>
+#include <cstring>
+#include <deque>
 #include <fstream>
 #include <iostream>
 #include <vector>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <sys/stat.h>
 
 // reflection 4 dummies
 #define DUMP(a)                                                                \
@@ -42,108 +50,149 @@ struct NesRom {
 
     bool hasTrainer() { return std::bitset<8>{flags6}[2]; }
 
+    bool hasBattery() { return std::bitset<8>{flags6}[1]; }
+
     Mapper::MirrorMode getMirrorMode() {
       bool b = !(std::bitset<8>{flags6}[0]);
       return (Mapper::MirrorMode)b;
     }
 
-    unsigned getMapperNumber() {
+    unsigned getMapperNumber() const {
       return static_cast<unsigned>(
           (std::bitset<8>{flags6} >> 4).to_ulong() +
           ((std::bitset<8>{flags7} >> 4) << 4).to_ulong());
     }
-
-    void print() {
-      printf("PRG ROM Size: %d * 16 KB = %d bytes\n", prgSize, 16384 * prgSize);
-      printf("CHR ROM Size: %d *  8 KB = %d bytes\n", chrSize, 8192 * chrSize);
-    }
   } header;
 
-  // Mapper000 mapper;
-  std::shared_ptr<Mapper> mapper;
-  // std::shared_ptr<Mapper002> mapper;
-
-  std::vector<uint8_t> trainer, prg, chr;
+  // read-only view into a rom image
+  struct Segment {
+    const uint8_t *ptr = nullptr;
+    size_t length = 0;
 
-  NesRom(const std::string &filename) {
-    std::ifstream rom_file;
-    { // print rom file info
-      rom_file.open(filename, std::ios::binary | std::ios::ate);
-      auto rom_size = rom_file.tellg();
-      DUMP(filename);
-      DUMP(rom_size);
-    }
+    const uint8_t &operator[](size_t i) const { return ptr[i]; }
+    const uint8_t *data() const { return ptr; }
+    size_t size() const { return length; }
+  };
 
-    { // read header
-      rom_file.seekg(0, std::ios::beg);
-      rom_file.read((char *)&header, sizeof(header));
+  /**
+   * Immutable contents of a rom file, shared by every NesRom running it
+   *
+   * Images are cached by a SHA-1 of the whole file and live while some
+   * NesRom holds them, the last 4 acquired a while longer. Loading a path
+   * that was already loaded, with the same size and modification time, only
+   * costs a stat() call.
+   * */
+  struct Image {
+    Header header;
+    Segment trainer, prg, chr; // chr is empty for CHR-RAM carts
+    // 16 KB PRG and 8 KB CHR banks, with the NES 2.0 high bits that the
+    // 8 bit header fields leave out
+    uint16_t prgBanks = 0, chrBanks = 0;
+    std::string hash;
+    xn::MappedFile file;
+    std::vector<uint8_t> padded; // used if the file is shorter than its header
 
-      if (!header.isValid()) {
-        std::cerr << "invalid header!\n";
-        return;
-      }
+    static std::shared_ptr<const Image> acquire(const std::string &filename);
 
-      header.print();
+    void print() const {
+      printf("mapper %u, PRG %d * 16 KB, CHR %d * 8 KB\n",
+             header.getMapperNumber(), prgBanks, chrBanks);
     }
 
-    uint8_t rom_file_format = 1;
-    if ((header.flags7 & 0x0C) == 0x08)
-      rom_file_format = 2;
+  private:
+    bool load(const std::string &filename);
+  };
 
-    if (rom_file_format == 1) { // read rom data
-      prg.resize(16 * 1024 * header.prgSize);
-      if (header.chrSize == 0)
-        chr.resize(8 * 1024);
-      else
-        chr.resize(8 * 1024 * header.chrSize);
+  std::shared_ptr<const Image> image;
+  Segment trainer, prg, chr;
 
-    } else {
-      header.prgSize = ((header.flags8 & 0x07) << 8) | header.prgSize;
-      prg.resize(header.prgSize * 16384);
-      header.chrSize = ((header.flags8 & 0x38) << 8) | header.chrSize;
-      if (header.chrSize == 0)
-        chr.resize(8 * 1024);
-      else
-        chr.resize(header.chrSize * 8192);
-    }
+  // per instance state, everything else is borrowed from the image
+  std::shared_ptr<Mapper> mapper;
+  std::vector<uint8_t> chrRam;
 
-    if (header.hasTrainer()) {
-      trainer.resize(512);
-      rom_file.read((char *)trainer.data(), trainer.size());
+  // battery_file: back battery RAM with a .sav file next to the rom
+  NesRom(const std::string &filename, bool battery_file = true)
+      : NesRom(Image::acquire(filename)) {
+    if (battery_file && header.hasBattery() && mapper != nullptr &&
+        mapper->prgRam() != nullptr) {
+      std::string save_path = savePath(filename);
+      if (!mapper->prgRam()->attach(save_path))
+        std::cerr << "could not open " << save_path << "\n";
     }
+  }
 
-    rom_file.read((char *)prg.data(), prg.size());
-    if (header.chrSize > 0)
-      rom_file.read((char *)chr.data(), chr.size());
-
-    std::cout << "Successfully read "
-              << trainer.size() + prg.size() + chr.size()
-              << " byte ROM contents\n";
+  // another cartridge with an already loaded image, battery RAM is volatile
+  NesRom(const std::shared_ptr<const Image> &rom_image) {
+    image = rom_image;
+    if (image == nullptr)
+      return;
+    header = image->header;
+    trainer = image->trainer;
+    prg = image->prg;
+    chr = image->chr;
+    if (image->chrBanks == 0) {
+      chrRam.assign(8 * 1024, 0);
+      chr.ptr = chrRam.data();
+      chr.length = chrRam.size();
+    }
 
     switch (header.getMapperNumber()) {
     case 0:
-      mapper = std::make_shared<Mapper000>(header.prgSize, header.chrSize);
+      mapper = std::make_shared<Mapper000>(image->prgBanks,
+                                             image->chrBanks);
       break;
     case 1:
-      mapper = std::make_shared<Mapper001>(header.prgSize, header.chrSize);
+      mapper = std::make_shared<Mapper001>(image->prgBanks,
+                                             image->chrBanks);
       break;
     case 2:
-      mapper = std::make_shared<Mapper002>(header.prgSize, header.chrSize);
+      mapper = std::make_shared<Mapper002>(image->prgBanks,
+                                             image->chrBanks);
       break;
     case 4:
-      mapper = std::make_shared<Mapper004>(header.prgSize, header.chrSize);
+      mapper = std::make_shared<Mapper004>(image->prgBanks,
+                                             image->chrBanks);
       break;
     default:
       std::cerr << "Unsupported Rom mapper number: " << header.getMapperNumber()
                 << "\n";
       break;
     }
-    rom_file.close();
   }
 
-  bool cpuRead(uint16_t addr, uint8_t &data) {
+  // foo.nes -> foo.sav
+  static std::string savePath(const std::string &filename) {
+    size_t dot = filename.find_last_of('.');
+    size_t slash = filename.find_last_of("/\\");
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+      return filename + ".sav";
+    return filename.substr(0, dot) + ".sav";
+  }
+
+  // queue dirty battery RAM for writing, call at frame boundaries
+  void requestSaveRamFlush() {
+    if (mapper != nullptr && mapper->prgRam() != nullptr)
+      mapper->prgRam()->requestFlush();
+  }
+
+  // mappers the constructor above can create
+  static bool isSupportedMapper(unsigned mapper) {
+    return mapper == 0 || mapper == 1 || mapper == 2 || mapper == 4;
+  }
+
+  // read and validate only the 16 byte iNES header
+  static bool readHeader(const std::string &filename, Header &header) {
+    std::ifstream rom_file(filename, std::ios::binary);
+    if (!rom_file.read((char *)&header, sizeof(header)))
+      return false;
+    return header.isValid();
+  }
+
+  // memory access through a mapper of known type M. Calls on a final mapper
+  // class resolve statically and inline, M = Mapper is the virtual path
+  template <typename M> bool cpuReadT(uint16_t addr, uint8_t &data) {
     uint32_t mapped_addr;
-    if (mapper->cpuMapRead(addr, mapped_addr, data)) {
+    if (static_cast<M *>(mapper.get())->cpuMapRead(addr, mapped_addr, data)) {
       if (mapped_addr == 0xFFFFFFFF)
         return true; // mapper set the value
       data = prg[mapped_addr];
@@ -152,59 +201,191 @@ struct NesRom {
     return false;
   }
 
-  bool cpuWrite(uint16_t addr, uint8_t data) {
+  template <typename M> bool cpuWriteT(uint16_t addr, uint8_t data) {
     uint32_t mapped_addr;
-    if (mapper->cpuMapWrite(addr, mapped_addr, data)) {
-      if (mapped_addr == 0xFFFFFFFF)
-        return true; // mapper set the value
-      prg[mapped_addr] = data;
+    if (static_cast<M *>(mapper.get())->cpuMapWrite(addr, mapped_addr, data)) {
+      // PRG is ROM and shared between instances, writes only reach mapper
+      // registers and RAM
       return true;
     }
     return false;
   }
-  bool ppuRead(uint16_t addr, uint8_t &data) {
+
+  template <typename M> bool ppuReadT(uint16_t addr, uint8_t &data) {
     uint32_t mapped_addr;
-    if (mapper->ppuMapRead(addr, mapped_addr)) {
+    if (static_cast<M *>(mapper.get())->ppuMapRead(addr, mapped_addr)) {
       if (mapped_addr < chr.size())
         data = chr[mapped_addr];
       return true;
     }
     return false;
   }
-  bool ppuWrite(uint16_t addr, uint8_t data) {
+
+  template <typename M> bool ppuWriteT(uint16_t addr, uint8_t data) {
     uint32_t mapped_addr;
-    if (mapper->ppuMapWrite(addr, mapped_addr)) {
-      chr[mapped_addr] = data;
+    if (static_cast<M *>(mapper.get())->ppuMapWrite(addr, mapped_addr)) {
+      if (!chrRam.empty() && mapped_addr < chrRam.size())
+        chrRam[mapped_addr] = data;
       return true;
     }
     return false;
   }
 
+  template <typename M> Mapper::MirrorMode getMirrorModeT() {
+    Mapper::MirrorMode m = static_cast<M *>(mapper.get())->getMirror();
+    if (m == Mapper::MIRROR_HARDWARE) {
+      return header.getMirrorMode();
+    } else {
+      return m;
+    }
+  }
+
+  bool cpuRead(uint16_t addr, uint8_t &data) {
+    return cpuReadT<Mapper>(addr, data);
+  }
+  bool cpuWrite(uint16_t addr, uint8_t data) {
+    return cpuWriteT<Mapper>(addr, data);
+  }
+  bool ppuRead(uint16_t addr, uint8_t &data) {
+    return ppuReadT<Mapper>(addr, data);
+  }
+  bool ppuWrite(uint16_t addr, uint8_t data) {
+    return ppuWriteT<Mapper>(addr, data);
+  }
+
   void reset() {
     if (mapper != nullptr)
       mapper->reset();
   }
 
-  static int read_rom(const std::string &filename,
-                      std::shared_ptr<NesRom> &rom) {
-    rom = std::make_shared<NesRom>(filename);
+  bool isLoaded() const { return mapper != nullptr; }
+
+  // rom is only replaced if the new file loads
+  static int read_rom(const std::string &filename, std::shared_ptr<NesRom> &rom,
+                      bool battery_file = true) {
+    auto loaded = std::make_shared<NesRom>(filename, battery_file);
+    if (!loaded->isLoaded())
+      return -1;
+    rom = std::move(loaded);
     return 0;
   }
 
-  static void writeSegment(const std::string &filename,
-                           std::vector<uint8_t> &seg) {
+  static void writeSegment(const std::string &filename, const Segment &seg) {
     std::fstream ofile;
     ofile.open(filename, std::ios::out | std::ios::binary);
     ofile.write((char *)seg.data(), seg.size());
     ofile.close();
   }
 
-  Mapper::MirrorMode getMirrorMode() {
-    Mapper::MirrorMode m = mapper->getMirror();
-    if (m == Mapper::MIRROR_HARDWARE) {
-      return header.getMirrorMode();
-    } else {
-      return m;
+  Mapper::MirrorMode getMirrorMode() { return getMirrorModeT<Mapper>(); }
+};
+
+inline std::shared_ptr<const NesRom::Image>
+NesRom::Image::acquire(const std::string &filename) {
+  struct Known {
+    off_t size;
+    time_t mtime;
+    std::string hash;
+  };
+  static std::mutex guard;
+  static std::map<std::string, std::weak_ptr<const Image>> images; // by hash
+  static std::map<std::string, Known> paths;
+  // the last few images stay loaded after their last NesRom is gone, so
+  // switching back to a rom doesn't map and hash the file again
+  static const size_t RECENT = 4;
+  static std::deque<std::shared_ptr<const Image>> recent;
+
+  struct stat st;
+  if (stat(filename.c_str(), &st) != 0) {
+    std::cerr << "could not open " << filename << "\n";
+    return nullptr;
+  }
+
+  std::lock_guard<std::mutex> lock(guard);
+  auto keep = [](const std::shared_ptr<const Image> &image) {
+    auto it = std::find(recent.begin(), recent.end(), image);
+    if (it != recent.end())
+      recent.erase(it);
+    recent.push_front(image);
+    if (recent.size() > RECENT)
+      recent.pop_back();
+    return image;
+  };
+
+  auto known = paths.find(filename);
+  if (known != paths.end() && known->second.size == st.st_size &&
+      known->second.mtime == st.st_mtime) {
+    auto image = images.find(known->second.hash);
+    if (image != images.end()) {
+      if (auto cached = image->second.lock())
+        return keep(cached);
     }
   }
-};
+
+  // forget images nobody holds any more, and the paths that led to them
+  for (auto it = images.begin(); it != images.end();) {
+    if (it->second.expired())
+      it = images.erase(it);
+    else
+      ++it;
+  }
+  for (auto it = paths.begin(); it != paths.end();) {
+    if (images.count(it->second.hash) == 0)
+      it = paths.erase(it);
+    else
+      ++it;
+  }
+
+  auto loaded = std::make_shared<Image>();
+  if (!loaded->load(filename))
+    return nullptr;
+  paths[filename] = {st.st_size, st.st_mtime, loaded->hash};
+  // an identical file under another name shares the same image
+  auto &entry = images[loaded->hash];
+  if (auto cached = entry.lock())
+    return keep(cached);
+  entry = loaded;
+  loaded->print();
+  return keep(loaded);
+}
+
+inline bool NesRom::Image::load(const std::string &filename) {
+  if (!readHeader(filename, header)) {
+    std::cerr << "invalid header: " << filename << "\n";
+    return false;
+  }
+  if (!file.open(filename)) {
+    std::cerr << "could not map " << filename << "\n";
+    return false;
+  }
+
+  xn::Sha1 sha;
+  sha.update(file.data(), file.size());
+  hash = sha.hex();
+
+  prgBanks = header.prgSize;
+  chrBanks = header.chrSize;
+  if ((header.flags7 & 0x0C) == 0x08) { // NES 2.0, high bits in flags9
+    prgBanks |= (header.flags9 & 0x0F) << 8;
+    chrBanks |= (header.flags9 & 0xF0) << 4;
+  }
+
+  size_t trainer_size = header.hasTrainer() ? 512 : 0;
+  size_t prg_size = 16384 * (size_t)prgBanks;
+  size_t chr_size = 8192 * (size_t)chrBanks;
+
+  size_t offset = sizeof(Header);
+  size_t payload = trainer_size + prg_size + chr_size;
+  const uint8_t *base = file.data() + offset;
+  if (file.size() < offset + payload) {
+    std::cerr << filename << " is shorter than its header, padded\n";
+    padded.assign(payload, 0);
+    std::memcpy(padded.data(), base, file.size() - offset);
+    base = padded.data();
+  }
+
+  trainer = {base, trainer_size};
+  prg = {base + trainer_size, prg_size};
+  chr = {base + trainer_size + prg_size, chr_size};
+  return true;
+}
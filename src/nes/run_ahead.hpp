@@ -0,0 +1,173 @@
+#pragma once
+#include "bus.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Run-ahead
+ *
+ * Many games only react to input a frame or two after reading it. After
+ * every emulated frame, run-ahead saves the state, emulates `frames` more
+ * frames with the current input, keeps the picture of the last one and
+ * restores the state, so what's on screen is that many frames ahead of the
+ * real emulation and the game's own lag disappears.
+ *
+ * The hidden frames are speculative (no audio, scope or latch callbacks) and
+ * all but the last skip video (Ppu2C02::audioOnly).
+ *
+ * With `threaded` set, a second NesBus loads the state instead and runs ahead
+ * on its own thread, so the main instance only pays for a save state. On the
+ * web build it always runs inline.
+ *
+ * update() must be called from the thread that runs the emulation, with the
+ * bus lock held. frame() from one other thread: pictures are triple
+ * buffered, so the one it returns isn't written until the next frame() call.
+ * */
+struct RunAhead {
+  using Frame =
+      NesRenderer::Sprite<NesRenderer::NES_WIDTH, NesRenderer::NES_HEIGHT>;
+
+  std::atomic<uint32_t> frames{0}; // 0 turns run-ahead off
+  std::atomic<bool> threaded{false};
+
+  std::atomic<uint32_t> presentedFrame{0}; // ppu frame of the last frame()
+
+  RunAhead() {}
+  RunAhead(const RunAhead &) = delete;
+  ~RunAhead() { stop(); }
+
+  bool enabled() const { return frames > 0; }
+
+  // newest look-ahead picture, valid until the next call
+  const Frame &frame() {
+    if (middle.load(std::memory_order_acquire) & FRESH) {
+      front = middle.exchange(front, std::memory_order_acq_rel) & ~FRESH;
+      presentedFrame = presentedFrames[front];
+    }
+    return presented[front];
+  }
+
+  // call after emulating, runs ahead once per completed frame
+  void update(NesBus &nes) {
+    uint32_t n = frames;
+#ifdef __EMSCRIPTEN__
+    bool use_thread = false;
+#else
+    bool use_thread = threaded;
+#endif
+    if (!use_thread && worker.joinable())
+      stop();
+    if (n == 0 || nes.ppu.framecount == lastFrame)
+      return;
+    lastFrame = nes.ppu.framecount;
+
+    if (use_thread) {
+      post(nes, n);
+      return;
+    }
+
+    state.resize(nes.stateSize());
+    nes.saveState(state.data(), state.size());
+    run(nes, n);
+    nes.loadState(state.data(), state.size());
+  }
+
+  void stop() {
+    if (!worker.joinable())
+      return;
+    {
+      std::lock_guard<std::mutex> lock(guard);
+      stopping = true;
+    }
+    wake.notify_one();
+    worker.join();
+    stopping = false;
+    shadow.reset();
+  }
+
+private:
+  // triple buffer: run() draws into back, frame() reads front, and they
+  // swap theirs with middle. FRESH marks a middle frame() hasn't taken
+  static const int FRESH = 4;
+  Frame presented[3];
+  uint32_t presentedFrames[3] = {};
+  int back = 0, front = 1; // owned by the producer and by frame()
+  std::atomic<int> middle{2};
+  uint32_t lastFrame = 0;
+  std::vector<uint8_t> state;
+
+  // second core
+  std::unique_ptr<NesBus> shadow;
+  std::thread worker;
+  std::mutex guard;
+  std::condition_variable wake;
+  bool stopping = false, pending = false;
+  std::vector<uint8_t> job; // newest state for the worker, under guard
+  std::shared_ptr<const NesRom::Image> jobImage;
+  uint32_t jobFrames = 0;
+
+  // emulate n frames speculatively, the last one with video, and present it
+  void run(NesBus &bus, uint32_t n) {
+    bool audio_only = bus.ppu.audioOnly;
+    uint32_t target = bus.ppu.framecount + n;
+    bus.speculative = true;
+    bus.ppu.audioOnly = true;
+    while (bus.ppu.framecount + 1 < target)
+      bus.clock();
+    bus.ppu.audioOnly = false;
+    while (bus.ppu.framecount < target)
+      bus.clock();
+    bus.ppu.audioOnly = audio_only;
+    bus.speculative = false;
+
+    presented[back] = bus.ppu.getFramebuffer();
+    presentedFrames[back] = target - 1;
+    back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & ~FRESH;
+  }
+
+  // hand the current state to the worker, replacing one it hasn't started
+  void post(NesBus &nes, uint32_t n) {
+    {
+      std::lock_guard<std::mutex> lock(guard);
+      job.resize(nes.stateSize());
+      nes.saveState(job.data(), job.size());
+      jobImage = nes.rom->image;
+      jobFrames = n;
+      pending = true;
+    }
+    if (!worker.joinable())
+      worker = std::thread(&RunAhead::workLoop, this);
+    wake.notify_one();
+  }
+
+  void workLoop() {
+    std::vector<uint8_t> work;
+    std::unique_lock<std::mutex> lock(guard);
+    while (true) {
+      wake.wait(lock, [this] { return stopping || pending; });
+      if (stopping)
+        return;
+      work.swap(job);
+      auto image = jobImage;
+      uint32_t n = jobFrames;
+      pending = false;
+      lock.unlock();
+
+      if (shadow == nullptr || shadow->rom->image != image) {
+        shadow = std::make_unique<NesBus>();
+        shadow->batterySaves = false;
+        shadow->loadRom(image);
+        shadow->init();
+        shadow->setSampleFrequency(44100);
+      }
+      if (shadow->loadState(work.data(), work.size()))
+        run(*shadow, n);
+
+      lock.lock();
+    }
+  }
+};
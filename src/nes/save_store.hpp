@@ -0,0 +1,357 @@
+#pragma once
+#include "../util/xn_hash.hpp"
+#include "../util/xn_json.hpp"
+#include "../util/xn_lz.hpp"
+#include "../util/xn_mapped_file.hpp"
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+/**
+ * Deduplicating store for save state slots
+ *
+ * A state is cut into CHUNK_SIZE pieces, each stored once under the SHA-1 of
+ * its contents and LZ compressed (xn::lz). The state layout only depends on
+ * the rom, so slots of the same game share every chunk that didn't change:
+ * CHR-RAM, untouched PRG-RAM and zero filled pages are kept once no matter
+ * how many slots there are.
+ *
+ *   <dir>/index.json          name, rom, size and time of every slot
+ *   <dir>/index.log           slots saved or removed since index.json
+ *   <dir>/slots/<id>.json     chunk list of one slot
+ *   <dir>/chunks/ab/cdef...   one chunk: 1 byte codec + data
+ *
+ * Listing works from the index kept in memory; loading reads one manifest and
+ * its chunks. A save or removal appends one line to index.log instead of
+ * rewriting the index, open() and every LOG_THRESHOLD lines fold the log back
+ * into index.json. Every other file is replaced atomically and chunks are
+ * written before the manifest pointing at them, so a crash never leaves a
+ * broken slot, at most a torn last line in the log that open() skips.
+ * Chunks no slot uses are deleted by collectGarbage(), run by open() once
+ * enough slots were overwritten or removed.
+ * */
+struct SaveStore {
+  static const size_t CHUNK_SIZE = 1024;
+  static constexpr int FORMAT_VERSION = 1;
+  static const uint32_t GARBAGE_THRESHOLD = 64; // stale slots before a sweep
+  static const uint32_t LOG_THRESHOLD = 256;    // log lines before compacting
+
+  enum Codec : uint8_t { STORED, LZ };
+
+  struct Slot {
+    std::string name;
+    std::string romHash;
+    uint64_t size = 0; // state bytes
+    int64_t time = 0;  // unix time of the last save
+  };
+
+  SaveStore() {}
+  SaveStore(const SaveStore &) = delete;
+
+  bool open(const std::string &store_dir) {
+    std::lock_guard<std::mutex> lock(guard);
+    namespace fs = std::filesystem;
+    directory = fs::path(store_dir);
+    std::error_code ec;
+    fs::create_directories(directory / "slots", ec);
+    fs::create_directories(directory / "chunks", ec);
+    if (ec)
+      return false;
+    slots.clear();
+    knownChunks.clear();
+    staleSlots = 0;
+    logLines = 0;
+    if (!loadIndex())
+      rebuildIndex();
+    if (staleSlots >= GARBAGE_THRESHOLD)
+      sweep();
+    return true;
+  }
+
+  bool isOpen() const { return !directory.empty(); }
+
+  bool put(const std::string &name, const std::string &rom_hash,
+           const uint8_t *state, size_t size) {
+    std::lock_guard<std::mutex> lock(guard);
+    if (!isOpen())
+      return false;
+    json chunks = json::array();
+    for (size_t offset = 0; offset < size; offset += CHUNK_SIZE) {
+      size_t n = std::min(CHUNK_SIZE, size - offset);
+      std::string id = writeChunk(state + offset, n);
+      if (id.empty())
+        return false;
+      chunks.push_back(id);
+    }
+
+    Slot slot{name, rom_hash, size, (int64_t)std::time(nullptr)};
+    json manifest = toJson(slot);
+    manifest["chunks"] = std::move(chunks);
+    std::string text = manifest.dump();
+    if (!xn::writeFileAtomic(manifestPath(name).string(), text.data(),
+                             text.size()))
+      return false;
+
+    if (slots.count(name))
+      staleSlots++; // its old chunks may be unused now
+    slots[name] = slot;
+    return appendIndex(toJson(slot));
+  }
+
+  bool get(const std::string &name, std::vector<uint8_t> &state) {
+    std::lock_guard<std::mutex> lock(guard);
+    auto it = slots.find(name);
+    if (it == slots.end())
+      return false;
+    json manifest = readJson(manifestPath(name));
+    if (!manifest["chunks"].is_array())
+      return false;
+    size_t size = it->second.size;
+    state.resize(size);
+    size_t offset = 0;
+    for (const json &id : manifest["chunks"]) {
+      if (offset >= size || !id.is_string())
+        return false;
+      size_t n = std::min(CHUNK_SIZE, size - offset);
+      if (!readChunk(id.get<std::string>(), state.data() + offset, n))
+        return false;
+      offset += n;
+    }
+    return offset == size;
+  }
+
+  bool remove(const std::string &name) {
+    std::lock_guard<std::mutex> lock(guard);
+    if (slots.erase(name) == 0)
+      return false;
+    std::error_code ec;
+    std::filesystem::remove(manifestPath(name), ec);
+    staleSlots++;
+    return appendIndex({{"name", name}, {"removed", true}});
+  }
+
+  // newest first
+  std::vector<Slot> list() {
+    std::lock_guard<std::mutex> lock(guard);
+    std::vector<Slot> result;
+    result.reserve(slots.size());
+    for (const auto &[name, slot] : slots)
+      result.push_back(slot);
+    std::sort(result.begin(), result.end(),
+              [](const Slot &a, const Slot &b) { return a.time > b.time; });
+    return result;
+  }
+
+  size_t slotCount() {
+    std::lock_guard<std::mutex> lock(guard);
+    return slots.size();
+  }
+
+  // delete chunks that no slot refers to, returns how many
+  size_t collectGarbage() {
+    std::lock_guard<std::mutex> lock(guard);
+    return sweep();
+  }
+
+private:
+  std::mutex guard;
+  std::filesystem::path directory;
+  std::map<std::string, Slot> slots;
+  std::set<std::string> knownChunks; // seen on disk since open()
+  uint32_t staleSlots = 0;
+  uint32_t logLines = 0; // in index.log
+
+  static json toJson(const Slot &slot) {
+    return {{"name", slot.name},
+            {"rom", slot.romHash},
+            {"size", slot.size},
+            {"time", slot.time}};
+  }
+
+  static Slot fromJson(const json &j) {
+    Slot slot;
+    slot.name = j.value("name", "");
+    slot.romHash = j.value("rom", "");
+    slot.size = j.value("size", (uint64_t)0);
+    slot.time = j.value("time", (int64_t)0);
+    return slot;
+  }
+
+  static json readJson(const std::filesystem::path &path) {
+    std::ifstream file(path);
+    if (!file.is_open())
+      return json::object();
+    json j = json::parse(file, nullptr, false);
+    return j.is_object() ? j : json::object();
+  }
+
+  // slot names can be anything, file names are a hash of them
+  std::filesystem::path manifestPath(const std::string &name) const {
+    xn::Sha1 sha;
+    sha.update(name.data(), name.size());
+    return directory / "slots" / (sha.hex().substr(0, 16) + ".json");
+  }
+
+  std::filesystem::path chunkPath(const std::string &id) const {
+    return directory / "chunks" / id.substr(0, 2) / id.substr(2);
+  }
+
+  // store one chunk unless it already exists, returns its id or "" on error
+  std::string writeChunk(const uint8_t *data, size_t size) {
+    xn::Sha1 sha;
+    sha.update(data, size);
+    std::string id = sha.hex();
+    if (knownChunks.count(id))
+      return id;
+    std::filesystem::path path = chunkPath(id);
+    std::error_code ec;
+    if (!std::filesystem::exists(path, ec)) {
+      uint8_t packed[1 + xn::lz::bound(CHUNK_SIZE)];
+      size_t n = xn::lz::compress(data, size, packed + 1);
+      if (n < size) {
+        packed[0] = LZ;
+      } else {
+        packed[0] = STORED;
+        std::memcpy(packed + 1, data, size);
+        n = size;
+      }
+      std::filesystem::create_directories(path.parent_path(), ec);
+      if (!xn::writeFileAtomic(path.string(), packed, n + 1))
+        return "";
+    }
+    knownChunks.insert(id);
+    return id;
+  }
+
+  bool readChunk(const std::string &id, uint8_t *out, size_t size) {
+    if (id.size() != 40)
+      return false;
+    xn::MappedFile file;
+    if (!file.open(chunkPath(id).string()) || file.size() < 1)
+      return false;
+    const uint8_t *data = file.data() + 1;
+    size_t n = file.size() - 1;
+    if (file.data()[0] == STORED) {
+      if (n != size)
+        return false;
+      std::memcpy(out, data, size);
+      return true;
+    }
+    return file.data()[0] == LZ && xn::lz::decompress(data, n, out, size);
+  }
+
+  bool loadIndex() {
+    json j = readJson(directory / "index.json");
+    if (j.value("format", 0) != FORMAT_VERSION || !j["slots"].is_array())
+      return false;
+    for (const json &s : j["slots"]) {
+      Slot slot = fromJson(s);
+      if (!slot.name.empty())
+        slots[slot.name] = slot;
+    }
+    staleSlots = j.value("stale", 0u);
+
+    // replay index.log, a put over an existing slot or a removal makes it
+    // stale exactly like it did when it was logged. A torn last line is
+    // skipped, and compacting right away keeps later lines off its tail
+    std::ifstream log(directory / "index.log", std::ios::binary);
+    std::string line;
+    bool replayed = false;
+    while (std::getline(log, line)) {
+      replayed = true;
+      json record = json::parse(line, nullptr, false);
+      std::string name = record.is_object() ? record.value("name", "") : "";
+      if (name.empty())
+        continue;
+      if (slots.count(name))
+        staleSlots++;
+      if (record.value("removed", false))
+        slots.erase(name);
+      else
+        slots[name] = fromJson(record);
+    }
+    if (replayed)
+      saveIndex();
+    return true;
+  }
+
+  // the manifests hold everything the index does
+  void rebuildIndex() {
+    std::error_code ec;
+    for (const auto &item :
+         std::filesystem::directory_iterator(directory / "slots", ec)) {
+      if (item.path().extension() != ".json")
+        continue;
+      Slot slot = fromJson(readJson(item.path()));
+      if (!slot.name.empty())
+        slots[slot.name] = slot;
+    }
+    staleSlots = GARBAGE_THRESHOLD; // unknown, check once
+    saveIndex();
+  }
+
+  // one line of index.log, compacted into index.json every LOG_THRESHOLD
+  bool appendIndex(const json &record) {
+    if (++logLines >= LOG_THRESHOLD)
+      return saveIndex();
+    std::string line = record.dump() + "\n";
+    return xn::appendFile((directory / "index.log").string(), line.data(),
+                          line.size());
+  }
+
+  // write the whole index and empty the log. A crash in between replays the
+  // log again on open(), which at worst counts some slots as stale twice
+  bool saveIndex() {
+    json j;
+    j["format"] = FORMAT_VERSION;
+    j["stale"] = staleSlots;
+    j["slots"] = json::array();
+    for (const auto &[name, slot] : slots)
+      j["slots"].push_back(toJson(slot));
+    std::string text = j.dump(1);
+    if (!xn::writeFileAtomic((directory / "index.json").string(), text.data(),
+                             text.size()))
+      return false;
+    std::error_code ec;
+    std::filesystem::remove(directory / "index.log", ec);
+    logLines = 0;
+    return !ec;
+  }
+
+  size_t sweep() {
+    std::set<std::string> used;
+    for (const auto &[name, slot] : slots) {
+      json manifest = readJson(manifestPath(name));
+      if (!manifest["chunks"].is_array())
+        continue;
+      for (const json &id : manifest["chunks"])
+        if (id.is_string())
+          used.insert(id.get<std::string>());
+    }
+
+    std::vector<std::filesystem::path> unused;
+    std::error_code ec;
+    for (const auto &item : std::filesystem::recursive_directory_iterator(
+             directory / "chunks", ec)) {
+      std::string id = item.path().parent_path().filename().string() +
+                       item.path().filename().string();
+      if (item.is_regular_file(ec) && !used.count(id))
+        unused.push_back(item.path());
+    }
+    size_t removed = 0;
+    for (const auto &path : unused)
+      removed += std::filesystem::remove(path, ec);
+
+    knownChunks.clear();
+    staleSlots = 0;
+    saveIndex();
+    return removed;
+  }
+};
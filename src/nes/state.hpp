@@ -0,0 +1,107 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+/**
+ * Save state serialization
+ *
+ * Every component has a `serializeState(StateArchive &ar)` that passes each
+ * field through `ar(field)`. The same function saves, loads, or measures
+ * depending on the archive's mode, so the two directions can't drift apart.
+ *
+ * - SAVE and LOAD work on a caller owned contiguous buffer, nothing is
+ *   allocated
+ * - MEASURE only counts bytes, for sizing the buffer up front
+ * - fields are stored one by one in native byte order, never as whole
+ *   structs, so padding and bitfield layout don't leak into the format
+ * - components are wrapped in tagged, length prefixed sections that are
+ *   checked on load
+ *
+ * A failed read or write sets `ok()` to false and turns every later call into
+ * a no-op.
+ * */
+struct StateArchive {
+  enum Mode { SAVE, LOAD, MEASURE };
+
+  static constexpr uint32_t tag(const char (&s)[5]) {
+    return (uint32_t)s[0] | (uint32_t)s[1] << 8 | (uint32_t)s[2] << 16 |
+           (uint32_t)s[3] << 24;
+  }
+
+  // measure
+  StateArchive() : mode(MEASURE) {}
+
+  // save into buffer
+  StateArchive(uint8_t *buffer, size_t capacity)
+      : mode(SAVE), buffer(buffer), capacity(capacity) {}
+
+  // load from buffer
+  StateArchive(const uint8_t *buffer, size_t size)
+      : mode(LOAD), buffer(const_cast<uint8_t *>(buffer)), capacity(size) {}
+
+  bool loading() const { return mode == LOAD; }
+  bool ok() const { return !failed; }
+  size_t size() const { return pos; } // bytes used so far
+
+  template <typename T> void operator()(T &value) {
+    static_assert(std::is_arithmetic<T>::value || std::is_enum<T>::value,
+                  "serialize structs field by field");
+    bytes(&value, sizeof(T));
+  }
+
+  template <typename T, size_t N> void operator()(T (&values)[N]) {
+    for (T &v : values)
+      (*this)(v);
+  }
+
+  void bytes(void *data, size_t size) {
+    if (failed)
+      return;
+    if (mode != MEASURE) {
+      if (pos + size > capacity) {
+        failed = true;
+        return;
+      }
+      if (mode == SAVE)
+        std::memcpy(buffer + pos, data, size);
+      else
+        std::memcpy(data, buffer + pos, size);
+    }
+    pos += size;
+  }
+
+  // a section is its tag and byte length followed by the contents
+  size_t beginSection(uint32_t section_tag) {
+    uint32_t t = section_tag, length = 0;
+    (*this)(t);
+    (*this)(length);
+    if (mode == LOAD && t != section_tag)
+      failed = true;
+    return pos;
+  }
+
+  void endSection(size_t start) {
+    if (failed)
+      return;
+    uint32_t length = (uint32_t)(pos - start);
+    uint8_t *length_ptr = buffer + start - sizeof(length);
+    if (mode == SAVE) {
+      std::memcpy(length_ptr, &length, sizeof(length));
+    } else if (mode == LOAD) {
+      uint32_t expected;
+      std::memcpy(&expected, length_ptr, sizeof(expected));
+      failed = expected != length;
+    }
+  }
+
+  void fail() { failed = true; }
+
+private:
+  Mode mode;
+  uint8_t *buffer = nullptr;
+  size_t capacity = 0;
+  size_t pos = 0;
+  bool failed = false;
+};
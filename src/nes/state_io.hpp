@@ -0,0 +1,199 @@
+#pragma once
+#include "bus.hpp"
+#include "save_store.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Save state files without blocking emulation or the UI
+ *
+ * - save() snapshots the machine into memory under the bus lock (a few
+ *   microseconds) and queues the buffer; a worker thread writes it with
+ *   xn::writeFileAtomic (fsync + rename). A save right behind a queued save
+ *   of the same file replaces it, so repeated saves never pile up
+ * - load() queues a read; the worker reads and checks the header against the
+ *   current rom, then apply() swaps the state in on the emulation thread
+ *
+ * With `store` set, names are SaveStore slots instead of file paths.
+ *
+ * On the web build, where there are no threads, the file work happens inline.
+ * */
+struct StateIo {
+  std::atomic<size_t> queued{0}; // requests not finished yet
+
+  SaveStore *store = nullptr; // set before the first request
+
+  StateIo() {}
+  StateIo(const StateIo &) = delete;
+  ~StateIo() { stop(); }
+
+  void save(NesBus &nes, const std::string &filename) {
+    Request r{Request::SAVE, filename, spareBuffer(), nes.rom->image->hash};
+    {
+      std::lock_guard<std::mutex> lock(nes.guard);
+      r.data.resize(nes.stateSize());
+      nes.saveState(r.data.data(), r.data.size());
+    }
+    post(std::move(r));
+  }
+
+  // call from the thread that loads roms, the state is checked against the
+  // rom running now
+  void load(NesBus &nes, const std::string &filename) {
+    post({Request::LOAD, filename, {}, nes.rom->image->hash});
+  }
+
+  // swap in a finished load. Call from the emulation thread with the bus lock
+  // held; false if there was nothing to load or the rom changed since
+  bool apply(NesBus &nes) {
+    if (!loadReady.load(std::memory_order_acquire))
+      return false;
+    std::vector<uint8_t> data;
+    std::string filename;
+    {
+      std::lock_guard<std::mutex> lock(guard);
+      data.swap(loaded);
+      filename.swap(loadedName);
+      loadReady = false;
+    }
+    bool ok = nes.loadState(data.data(), data.size());
+    if (!ok)
+      std::cerr << filename << " is from a different rom or version\n";
+    recycle(std::move(data));
+    return ok;
+  }
+
+  // finish queued saves and stop the worker
+  void stop() {
+    if (!worker.joinable())
+      return;
+    {
+      std::lock_guard<std::mutex> lock(guard);
+      stopping = true;
+    }
+    wake.notify_one();
+    worker.join();
+    stopping = false;
+  }
+
+private:
+  struct Request {
+    enum Kind { SAVE, LOAD } kind;
+    std::string filename;
+    std::vector<uint8_t> data;
+    std::string romHash;
+  };
+
+  std::mutex guard;
+  std::condition_variable wake;
+  std::deque<Request> requests;
+  std::vector<std::vector<uint8_t>> spare; // finished buffers, for reuse
+  std::thread worker;
+  bool stopping = false;
+
+  std::atomic<bool> loadReady{false};
+  std::vector<uint8_t> loaded;
+  std::string loadedName;
+
+  std::vector<uint8_t> spareBuffer() {
+    std::lock_guard<std::mutex> lock(guard);
+    if (spare.empty())
+      return {};
+    std::vector<uint8_t> buffer = std::move(spare.back());
+    spare.pop_back();
+    return buffer;
+  }
+
+  void recycle(std::vector<uint8_t> &&buffer) {
+    std::lock_guard<std::mutex> lock(guard);
+    keep(std::move(buffer));
+  }
+
+  // with `guard` held
+  void keep(std::vector<uint8_t> &&buffer) {
+    if (spare.size() < 4 && buffer.capacity() > 0)
+      spare.push_back(std::move(buffer));
+  }
+
+  void post(Request &&r) {
+#ifdef __EMSCRIPTEN__
+    queued++;
+    process(r);
+#else
+    {
+      std::lock_guard<std::mutex> lock(guard);
+      Request *last = requests.empty() ? nullptr : &requests.back();
+      if (last != nullptr && last->kind == r.kind &&
+          last->filename == r.filename) {
+        // a repeat of the newest request, which hasn't started yet
+        last->data.swap(r.data);
+        last->romHash = r.romHash;
+        keep(std::move(r.data));
+      } else {
+        requests.push_back(std::move(r));
+        queued++;
+      }
+      if (!worker.joinable())
+        worker = std::thread(&StateIo::workLoop, this);
+    }
+    wake.notify_one();
+#endif
+  }
+
+  void workLoop() {
+    std::unique_lock<std::mutex> lock(guard);
+    while (true) {
+      wake.wait(lock, [this] { return stopping || !requests.empty(); });
+      if (requests.empty())
+        return; // stopping, and every save is written
+      Request r = std::move(requests.front());
+      requests.pop_front();
+      lock.unlock();
+      process(r);
+      lock.lock();
+    }
+  }
+
+  void process(Request &r) {
+    if (r.kind == Request::SAVE) {
+      bool ok = store != nullptr
+                    ? store->put(r.filename, r.romHash, r.data.data(),
+                                 r.data.size())
+                    : xn::writeFileAtomic(r.filename, r.data.data(),
+                                          r.data.size());
+      if (!ok)
+        std::cerr << "could not write " << r.filename << "\n";
+      recycle(std::move(r.data));
+    } else {
+      std::vector<uint8_t> data = spareBuffer();
+      if (!read(r.filename, data)) {
+        std::cerr << "could not read " << r.filename << "\n";
+      } else if (!NesBus::isStateFor(data.data(), data.size(), r.romHash)) {
+        std::cerr << r.filename << " is from a different rom or version\n";
+      } else {
+        std::lock_guard<std::mutex> lock(guard);
+        loaded.swap(data);
+        loadedName = r.filename;
+        loadReady.store(true, std::memory_order_release);
+      }
+      recycle(std::move(data));
+    }
+    queued--;
+  }
+
+  bool read(const std::string &name, std::vector<uint8_t> &data) {
+    if (store != nullptr)
+      return store->get(name, data);
+    xn::MappedFile file;
+    if (!file.open(name))
+      return false;
+    data.assign(file.data(), file.data() + file.size());
+    return true;
+  }
+};
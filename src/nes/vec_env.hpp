@@ -0,0 +1,218 @@
+#pragma once
+#include "bus.hpp"
+#include "core.hpp"
+#include "observation.hpp"
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * K instances of one game stepped together, for reinforcement learning
+ *
+ * step() runs one frame on every instance with the given controller bytes
+ * and leaves the results in contiguous buffers owned by the VecEnv:
+ *
+ *   observations()  [K, HEIGHT, WIDTH] palette indices (0-63)
+ *   ram()           [K, RAM_SIZE] CPU RAM after the frame
+ *   done()          [K] 1 when the episode hit maxFrames
+ *   frames()        [K] frames into the current episode
+ *
+ * setObservation() adds preprocessed observations, [K, stack, height,
+ * width] grayscale frames from an ObservationFilter, made on the worker
+ * threads.
+ *
+ * Episodes start from one shared state, captured after the first frame, so
+ * every reset is identical. An instance that is done starts over on the
+ * next step() (auto reset), and reset() starts any over right away.
+ *
+ * Instances are split between `threads` persistent workers, the calling
+ * thread being one of them. Nothing is allocated per step.
+ * */
+struct VecEnv {
+  static const uint32_t WIDTH = NesCore::WIDTH;
+  static const uint32_t HEIGHT = NesCore::HEIGHT;
+  static const size_t OBSERVATION_SIZE = WIDTH * HEIGHT;
+  static const size_t RAM_SIZE = 2048;
+
+  uint32_t maxFrames = 0; // episode length, 0 for endless
+
+  // players: controller bytes per instance in step(), 1 or 2
+  VecEnv(const std::string &rom, uint32_t count, unsigned threads = 0,
+         uint32_t players = 1)
+      : count(count), players(std::clamp(players, 1u, 2u)),
+        observationBlock(count * OBSERVATION_SIZE), ramBlock(count * RAM_SIZE),
+        doneFlags(count), frameCounts(count) {
+    NesCore::Options options;
+    options.sampleRate = 0;
+    options.lean = true;
+    for (uint32_t i = 0; i < count; i++) {
+      cores.push_back(std::make_unique<NesCore>(options));
+      if (!cores.back()->loadRom(rom)) {
+        cores.clear();
+        return;
+      }
+    }
+    if (count == 0)
+      return;
+
+    NesBus &first = cores[0]->bus();
+    first.drawFrame();
+    initialState.resize(first.stateSize());
+    first.saveState(initialState.data(), initialState.size());
+    initialObservation = first.ppu.getIndexFramebuffer();
+    std::memcpy(initialRam.data(), first.memory.data(), RAM_SIZE);
+    reset(-1);
+
+    if (threads == 0)
+      threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min(threads, count);
+    for (unsigned t = 1; t < threads; t++)
+      workers.emplace_back(&VecEnv::workLoop, this, t, threads);
+    workerCount = threads;
+  }
+
+  VecEnv(const VecEnv &) = delete;
+
+  ~VecEnv() {
+    {
+      std::lock_guard<std::mutex> lock(guard);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (auto &w : workers)
+      w.join();
+  }
+
+  bool ok() const { return count > 0 && cores.size() == count; }
+  uint32_t size() const { return count; }
+  uint32_t playerCount() const { return players; }
+
+  // one frame on every instance, actions is [K, players] controller bytes
+  void step(const uint8_t *actions) {
+    {
+      std::lock_guard<std::mutex> lock(guard);
+      stepActions = actions;
+      generation++;
+      running = workerCount - 1;
+    }
+    wake.notify_all();
+    runRange(0, workerCount);
+    std::unique_lock<std::mutex> lock(guard);
+    finished.wait(lock, [this] { return running == 0; });
+  }
+
+  // start instance i over, or all of them for -1
+  void reset(int64_t i) {
+    if (i < 0) {
+      for (uint32_t k = 0; k < count; k++)
+        resetInstance(k);
+    } else if ((uint64_t)i < count) {
+      resetInstance(i);
+    }
+  }
+
+  // preprocessed observations from now on, starting every instance over.
+  // Not while step() is running
+  bool setObservation(const ObservationFilter::Options &options) {
+    if (!options.valid())
+      return false;
+    filters.assign(count, ObservationFilter(options));
+    processedBlock.assign(count * filters[0].size(), 0);
+    reset(-1);
+    return true;
+  }
+
+  void clearObservation() {
+    filters.clear();
+    processedBlock.clear();
+  }
+
+  const uint8_t *observations() const { return observationBlock.data(); }
+  // [K, stack, height, width], null without setObservation()
+  const uint8_t *processed() const {
+    return processedBlock.empty() ? nullptr : processedBlock.data();
+  }
+  const uint8_t *ram() const { return ramBlock.data(); }
+  const uint8_t *done() const { return doneFlags.data(); }
+  const uint32_t *frames() const { return frameCounts.data(); }
+
+private:
+  uint32_t count;
+  uint32_t players;
+  std::vector<std::unique_ptr<NesCore>> cores;
+  std::vector<uint8_t> observationBlock, ramBlock, doneFlags;
+  std::vector<uint32_t> frameCounts;
+  std::vector<ObservationFilter> filters; // one per instance, or none
+  std::vector<uint8_t> processedBlock;
+
+  std::vector<uint8_t> initialState;
+  NesRenderer::IndexFrame initialObservation;
+  std::array<uint8_t, RAM_SIZE> initialRam;
+
+  std::vector<std::thread> workers;
+  unsigned workerCount = 1;
+  std::mutex guard;
+  std::condition_variable wake, finished;
+  uint64_t generation = 0;
+  unsigned running = 0;
+  bool stopping = false;
+  const uint8_t *stepActions = nullptr;
+
+  void resetInstance(uint32_t k) {
+    cores[k]->loadState(initialState.data(), initialState.size());
+    std::memcpy(&observationBlock[k * OBSERVATION_SIZE],
+                initialObservation.data(), OBSERVATION_SIZE);
+    std::memcpy(&ramBlock[k * RAM_SIZE], initialRam.data(), RAM_SIZE);
+    doneFlags[k] = 0;
+    frameCounts[k] = 0;
+    if (!filters.empty())
+      filters[k].reset(initialObservation.data(), processedAt(k));
+  }
+
+  uint8_t *processedAt(uint32_t k) {
+    return &processedBlock[k * filters[k].size()];
+  }
+
+  // the share of worker t out of n
+  void runRange(unsigned t, unsigned n) {
+    uint32_t begin = (uint64_t)count * t / n;
+    uint32_t end = (uint64_t)count * (t + 1) / n;
+    for (uint32_t k = begin; k < end; k++) {
+      if (doneFlags[k])
+        resetInstance(k);
+      NesBus &nes = cores[k]->bus();
+      nes.controller[0] = stepActions[k * players];
+      nes.controller[1] = players > 1 ? stepActions[k * players + 1] : 0;
+      nes.drawFrame();
+      std::memcpy(&observationBlock[k * OBSERVATION_SIZE],
+                  nes.ppu.getIndexFramebuffer().data(), OBSERVATION_SIZE);
+      std::memcpy(&ramBlock[k * RAM_SIZE], nes.memory.data(), RAM_SIZE);
+      if (!filters.empty())
+        filters[k].push(&observationBlock[k * OBSERVATION_SIZE],
+                        processedAt(k));
+      frameCounts[k]++;
+      doneFlags[k] = maxFrames > 0 && frameCounts[k] >= maxFrames;
+    }
+  }
+
+  void workLoop(unsigned t, unsigned n) {
+    uint64_t seen = 0;
+    std::unique_lock<std::mutex> lock(guard);
+    while (true) {
+      wake.wait(lock, [&] { return stopping || generation != seen; });
+      if (stopping)
+        return;
+      seen = generation;
+      lock.unlock();
+      runRange(t, n);
+      lock.lock();
+      if (--running == 0)
+        finished.notify_one();
+    }
+  }
+};
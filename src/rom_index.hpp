@@ -0,0 +1,245 @@
+#pragma once
+#include "nes/rom.hpp"
+#include "util/xn_hash.hpp"
+#include "util/xn_json.hpp"
+#include "util/xn_mapped_file.hpp"
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <thread>
+
+/**
+ * Persistent index of a ROM folder
+ *
+ * Every .nes file gets its header parsed and a CRC32 / SHA-1 of its PRG + CHR
+ * data (the usual headerless hash ROM databases use). Results are saved to a
+ * JSON file and reused on the next start as long as the file's size and
+ * modification time haven't changed, so only new or edited ROMs are read.
+ *
+ * The folder scan runs on a background thread when `threaded` is set. The UI
+ * works from snapshots and rebuilds its list when `version` changes.
+ * */
+struct RomIndex {
+  static constexpr int FORMAT_VERSION = 1;
+
+  struct Entry {
+    std::string filename;
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    bool valid = false; // has an iNES header
+    unsigned mapper = 0;
+    uint16_t prgBanks = 0, chrBanks = 0; // 16 KB / 8 KB units
+    bool nes2 = false, battery = false, trainer = false;
+    uint32_t crc32 = 0;
+    std::string sha1;
+
+    bool supported() const {
+      return valid && NesRom::isSupportedMapper(mapper);
+    }
+  };
+
+  std::string directory;
+  std::string indexPath;
+
+  std::atomic<uint32_t> version{0}; // bumped whenever entries change
+  std::atomic<bool> scanning{false};
+  std::atomic<size_t> scanned{0}, hashed{0}, total{0};
+
+  RomIndex() {}
+  RomIndex(const RomIndex &) = delete;
+  ~RomIndex() { stop(); }
+
+  // load the saved index for `rom_dir`, then rescan the folder
+  void open(const std::string &rom_dir, const std::string &index_path,
+            bool threaded) {
+    stop();
+    directory = rom_dir;
+    indexPath = index_path;
+    load();
+    if (threaded)
+      worker = std::thread(&RomIndex::scan, this);
+    else
+      scan();
+  }
+
+  void stop() {
+    stopRequested = true;
+    if (worker.joinable())
+      worker.join();
+    stopRequested = false;
+  }
+
+  std::vector<Entry> snapshot() {
+    std::lock_guard<std::mutex> lock(guard);
+    return entries;
+  }
+
+  // header and hashes of one file, reading only what is needed
+  static Entry parse(const std::string &path, const std::string &filename,
+                     uint64_t size, int64_t mtime) {
+    Entry e;
+    e.filename = filename;
+    e.size = size;
+    e.mtime = mtime;
+
+    NesRom::Header h;
+    if (!NesRom::readHeader(path, h))
+      return e;
+    e.valid = true;
+    e.mapper = h.getMapperNumber();
+    e.nes2 = (h.flags7 & 0x0C) == 0x08;
+    e.battery = h.flags6 & 0x02;
+    e.trainer = h.hasTrainer();
+    e.prgBanks = h.prgSize;
+    e.chrBanks = h.chrSize;
+    if (e.nes2) {
+      e.prgBanks |= (h.flags9 & 0x0F) << 8;
+      e.chrBanks |= (h.flags9 & 0xF0) << 4;
+    }
+
+    xn::MappedFile image;
+    if (!image.open(path))
+      return e;
+    size_t start = sizeof(NesRom::Header) + (e.trainer ? 512 : 0);
+    size_t end =
+        start + 16384 * (size_t)e.prgBanks + 8192 * (size_t)e.chrBanks;
+    start = std::min(start, image.size());
+    end = std::min(end, image.size());
+    e.crc32 = xn::crc32(image.data() + start, end - start);
+    xn::Sha1 sha;
+    sha.update(image.data() + start, end - start);
+    e.sha1 = sha.hex();
+    return e;
+  }
+
+private:
+  std::mutex guard;
+  std::vector<Entry> entries; // sorted by filename
+  std::thread worker;
+  std::atomic<bool> stopRequested{false};
+
+  static int64_t modifiedTime(const std::filesystem::path &path) {
+    std::error_code ec;
+    auto t = std::filesystem::last_write_time(path, ec);
+    return ec ? 0 : (int64_t)t.time_since_epoch().count();
+  }
+
+  void scan() {
+    namespace fs = std::filesystem;
+    scanning = true;
+    scanned = hashed = 0;
+
+    std::map<std::string, Entry> cached;
+    for (Entry &e : snapshot())
+      cached[e.filename] = std::move(e);
+
+    std::vector<fs::path> files;
+    std::error_code ec;
+    for (const auto &item : fs::directory_iterator(directory, ec)) {
+      if (item.path().extension() == ".nes" && item.is_regular_file(ec))
+        files.push_back(item.path());
+    }
+    std::sort(files.begin(), files.end());
+    total = files.size();
+
+    std::vector<Entry> found;
+    bool changed = files.size() != cached.size();
+    for (const fs::path &path : files) {
+      if (stopRequested) {
+        scanning = false;
+        return;
+      }
+      std::string name = path.filename().string();
+      uint64_t size = fs::file_size(path, ec);
+      int64_t mtime = modifiedTime(path);
+
+      auto it = cached.find(name);
+      if (it != cached.end() && it->second.size == size &&
+          it->second.mtime == mtime) {
+        found.push_back(it->second);
+      } else {
+        found.push_back(parse(path.string(), name, size, mtime));
+        hashed++;
+        changed = true;
+      }
+      scanned++;
+    }
+
+    if (changed) {
+      {
+        std::lock_guard<std::mutex> lock(guard);
+        entries = std::move(found);
+      }
+      version++;
+      save();
+    }
+    scanning = false;
+  }
+
+  void load() {
+    std::ifstream file(indexPath);
+    if (!file.is_open())
+      return;
+    json j = json::parse(file, nullptr, false);
+    if (j.is_discarded() || j.value("format", 0) != FORMAT_VERSION ||
+        j.value("directory", "") != directory || !j["roms"].is_array())
+      return;
+
+    std::vector<Entry> loaded;
+    for (const json &r : j["roms"]) {
+      Entry e;
+      e.filename = r.value("file", "");
+      e.size = r.value("size", (uint64_t)0);
+      e.mtime = r.value("mtime", (int64_t)0);
+      e.valid = r.value("valid", false);
+      e.mapper = r.value("mapper", 0u);
+      e.prgBanks = r.value("prg", 0);
+      e.chrBanks = r.value("chr", 0);
+      e.nes2 = r.value("nes2", false);
+      e.battery = r.value("battery", false);
+      e.trainer = r.value("trainer", false);
+      e.crc32 = r.value("crc32", 0u);
+      e.sha1 = r.value("sha1", "");
+      if (!e.filename.empty())
+        loaded.push_back(e);
+    }
+    {
+      std::lock_guard<std::mutex> lock(guard);
+      entries = std::move(loaded);
+    }
+    version++;
+  }
+
+  void save() {
+    json j;
+    j["format"] = FORMAT_VERSION;
+    j["directory"] = directory;
+    j["roms"] = json::array();
+    for (const Entry &e : snapshot()) {
+      j["roms"].push_back({{"file", e.filename},
+                           {"size", e.size},
+                           {"mtime", e.mtime},
+                           {"valid", e.valid},
+                           {"mapper", e.mapper},
+                           {"prg", e.prgBanks},
+                           {"chr", e.chrBanks},
+                           {"nes2", e.nes2},
+                           {"battery", e.battery},
+                           {"trainer", e.trainer},
+                           {"crc32", e.crc32},
+                           {"sha1", e.sha1}});
+    }
+    // write then rename so a crash never leaves a truncated index
+    std::string tmp = indexPath + ".tmp";
+    {
+      std::ofstream file(tmp);
+      if (!file.is_open())
+        return;
+      file << j.dump(1);
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmp, indexPath, ec);
+  }
+};
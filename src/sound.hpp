@@ -1,6 +1,9 @@
 #pragma once
+#include "latency.hpp"
+#include "util/xn_ring_buffer.hpp"
 #include "xn_openal.hpp"
 #include <atomic>
+#include <chrono>
 #include <cstdint>
 #include <functional>
 #include <list>
@@ -32,6 +35,25 @@ float SoundClamp(float fSample, float fMax) {
 }
 #endif
 
+// Dynamic rate control: nudges the emulator's output sample rate by a
+// fraction of a percent so the ring buffer fill level (and with it the audio
+// latency) stays close to a target, instead of drifting until it under/overruns
+struct RateControl {
+  float maxDelta = 0.005f; // maximum pitch deviation, +-0.5% is inaudible
+  float targetFill = 0;    // desired ring buffer fill level in samples
+  float ratio = 1.0f;
+
+  float update(size_t fill) {
+    if (targetFill <= 0)
+      return ratio = 1.0f;
+    // positive error = buffer running low, produce slightly more samples
+    float err = (targetFill - (float)fill) / targetFill;
+    err = fmax(fmin(err, 1.0f), -1.0f);
+    ratio = 1.0f + maxDelta * err;
+    return ratio;
+  }
+};
+
 struct SoundInfo {
   bool muted = false;
   uint32_t sampleRate;
@@ -40,20 +62,44 @@ struct SoundInfo {
   uint32_t blockSamples;
 
   std::thread audioThreadHandle;
+  std::thread emulationThreadHandle;
   std::atomic<bool> audioThreadActive;
-  std::atomic<float> systemTime;
-  std::function<float(void)> mixerCallback;
-  // std::function<float(int, float, float)> mixerCallback;
+
+  // fills a block with `count` samples generated at `rate_ratio` * sampleRate.
+  // Returns how many of them, from the start, are emulated audio rather than
+  // silence, and sets `first` to the NesBus::audioSampleCount of the first.
+  // Read by the emulation thread without a lock, set it before init()
+  std::function<uint32_t(float *samples, uint32_t count, float rate_ratio,
+                         uint64_t &first)>
+      producerCallback;
+
+  // emulation thread -> OpenAL thread sample queue
+  xn::SpscRingBuffer<float> sampleRing;
+  RateControl rateControl;
+  std::atomic<uint32_t> underrunCount{0};
+  std::atomic<uint32_t> overrunCount{0};
+  std::atomic<float> rateRatio{1.0f};
+  std::atomic<uint64_t> droppedSamples{0};
+  bool primed = false;
+
+  // which emulated samples have left the queue, see AudioClock. Without the
+  // audio thread, the caller of step() reports what it put in the queue
+  AudioClock sampleClock;
+
+  // called on the audio thread after each block taken from the queue, queued
+  // to OpenAL or skipped while muted, with sampleClock.emulated. Set it
+  // before init()
+  std::function<void(uint64_t samples)> queuedCallback;
 
   // OpenAL
   std::queue<ALuint> availableBufferQueue;
   std::vector<ALuint> audioBuffers;
   std::vector<SoundPacket> blockMemory;
+  std::vector<float> blockSamplesIn;
 
   int init(bool createThread = false, uint32_t sample_rate = 44100,
            uint32_t channel_count = 1, uint32_t block_count = 8,
            uint32_t block_samples = 512) {
-    systemTime = 0;
     audioThreadActive = false;
     sampleRate = sample_rate;
     channelCount = channel_count;
@@ -70,27 +116,64 @@ struct SoundInfo {
       availableBufferQueue.push(audioBuffers[i]);
 
     blockMemory.resize(blockSamples);
+    blockSamplesIn.resize(blockSamples);
+
+    // room for 4 blocks on top of OpenAL's queue, aim to keep 2 buffered
+    sampleRing.resize(blockSamples * 4);
+    rateControl.targetFill = blockSamples * 2;
 
     audioThreadActive = true;
     if (createThread) {
+      emulationThreadHandle = std::thread(&SoundInfo::emulationThread, this);
       audioThreadHandle = std::thread(&SoundInfo::audioThread, this);
     }
     return true;
   }
 
-  float getSample() {
-    float mix_sample = 0;
+  // generates audio in real time, paced by the wall clock. The rate control
+  // ratio changes how many samples each block of emulated time turns into, so
+  // drift between the system clock and the audio device clock is absorbed
+  static void emulationThread(SoundInfo *inst) {
+    using clock = std::chrono::steady_clock;
+    const auto block_time = std::chrono::duration_cast<clock::duration>(
+        std::chrono::duration<double>((double)inst->blockSamples /
+                                      inst->sampleRate));
+    std::vector<float> block(inst->blockSamples * 2);
+    float fractional_samples = 0;
+    auto deadline = clock::now();
+
+    while (inst->audioThreadActive) {
+      float ratio = inst->rateControl.update(inst->sampleRing.size());
+      inst->rateRatio = ratio;
+
+      fractional_samples += inst->blockSamples * ratio;
+      uint32_t count = (uint32_t)fractional_samples;
+      fractional_samples -= count;
 
-    if (mixerCallback != nullptr)
-      mix_sample += mixerCallback();
+      uint32_t emulated = 0;
+      uint64_t first = 0;
+      if (inst->producerCallback != nullptr)
+        emulated = inst->producerCallback(block.data(), count, ratio, first);
+      size_t pushed = inst->sampleRing.push(block.data(), count);
+      inst->sampleClock.produced(first, emulated, pushed);
+      if (pushed < count) {
+        inst->overrunCount++;
+        inst->droppedSamples += count - pushed;
+      }
 
-    return mix_sample;
+      deadline += block_time;
+      auto now = clock::now();
+      if (now > deadline + block_time * 4)
+        deadline = now; // fell too far behind, don't try to catch up
+      std::this_thread::sleep_until(deadline);
+    }
   }
 
   static void audioThread(SoundInfo *inst) {
     std::vector<ALuint> processed_buffers;
     while (inst->audioThreadActive) {
-      inst->step(processed_buffers);
+      if (!inst->step(processed_buffers, inst->sampleRing))
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
     }
   }
 
@@ -123,22 +206,39 @@ struct SoundInfo {
       alSourcePlay(g_OpenAL_Instance.source);
   }
 
-  // generate & upload audio samples with mixer callback
-  bool step(std::vector<ALuint> &processed_buffers) {
+  // upload audio samples from the emulation thread's ring buffer
+  bool step(std::vector<ALuint> &processed_buffers,
+            xn::SpscRingBuffer<float> &ring) {
     ALint source_state = unqueueBuffers(processed_buffers);
     if (availableBufferQueue.empty())
       return false;
 
-    // get new samples
+    size_t count = blockSamples;
+    if (ring.size() < blockSamples) {
+      // only an underrun once OpenAL has played everything it was given
+      bool starved = availableBufferQueue.size() == blockCount;
+      if (!starved || !primed || muted)
+        return false;
+      underrunCount++;
+      count = ring.size();
+    }
+
+    ring.pop(blockSamplesIn.data(), count);
+    sampleClock.consumed(count);
+    std::fill(blockSamplesIn.begin() + count, blockSamplesIn.end(), 0.0f);
     for (unsigned int n = 0; n < blockSamples; n += channelCount) {
       for (unsigned int c = 0; c < channelCount; c++) {
-        blockMemory[n + c] =
-            (SoundPacket)(SoundClamp(getSample(), 1.0) * fMaxSample);
+        blockMemory[n + c] = (SoundPacket)(
+            SoundClamp(blockSamplesIn[n + c], 1.0) * fMaxSample);
       }
     }
 
-    if (!muted)
+    if (!muted) {
       queueBuffers(source_state);
+      primed = true;
+    }
+    if (queuedCallback != nullptr)
+      queuedCallback(sampleClock.emulated);
 
     return true;
   }
@@ -162,14 +262,20 @@ struct SoundInfo {
       }
     }
 
+    sampleClock.consumed(blockSamples);
+
     if (!muted)
       queueBuffers(source_state);
+    if (queuedCallback != nullptr)
+      queuedCallback(sampleClock.emulated);
 
     return true;
   }
 
   int destroy() {
     audioThreadActive = false;
+    if (emulationThreadHandle.joinable())
+      emulationThreadHandle.join();
     if (audioThreadHandle.joinable())
       audioThreadHandle.join();
 
@@ -183,7 +289,9 @@ struct SoundInfo {
     return false;
   }
 
-  void setMixerCallback(std::function<float(void)> func) {
-    mixerCallback = func;
+  // before init(), see producerCallback
+  void setProducerCallback(
+      std::function<uint32_t(float *, uint32_t, float, uint64_t &)> func) {
+    producerCallback = func;
   }
 } Sound;
\ No newline at end of file
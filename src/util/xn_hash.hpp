@@ -0,0 +1,246 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) &&         \
+    !defined(USE_SCALAR_CRC)
+#include <immintrin.h>
+#define XN_CRC_PCLMUL 1
+#endif
+
+namespace xn {
+
+/**
+ * CRC-32 (IEEE 802.3, same as zlib and the No-Intro/GoodNES databases)
+ *
+ * - slice-by-8 table lookup on every platform
+ * - on x86 CPUs with PCLMULQDQ, 64 byte blocks are folded with carry-less
+ *   multiplies (Intel, "Fast CRC Computation for Generic Polynomials Using
+ *   PCLMULQDQ Instruction"), picked at runtime
+ *
+ * Usage: crc = crc32(data, size); crc = crc32(more, more_size, crc);
+ * */
+namespace crc32_detail {
+
+inline const std::array<std::array<uint32_t, 256>, 8> &tables() {
+  static const auto t = [] {
+    std::array<std::array<uint32_t, 256>, 8> t;
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++)
+        c = (c >> 1) ^ (0xEDB88320u & (0u - (c & 1)));
+      t[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; i++)
+      for (size_t s = 1; s < 8; s++)
+        t[s][i] = (t[s - 1][i] >> 8) ^ t[0][t[s - 1][i] & 0xFF];
+    return t;
+  }();
+  return t;
+}
+
+// crc is the running, non inverted register
+inline uint32_t scalar(const uint8_t *p, size_t n, uint32_t crc) {
+  const auto &t = tables();
+  for (; n >= 8; n -= 8, p += 8) {
+    uint32_t lo, hi;
+    std::memcpy(&lo, p, 4);
+    std::memcpy(&hi, p + 4, 4);
+    lo ^= crc; // little endian
+    crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^
+          t[4][lo >> 24] ^ t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^
+          t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+  }
+  for (; n > 0; n--)
+    crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xFF];
+  return crc;
+}
+
+#ifdef XN_CRC_PCLMUL
+#define XN_CRC_TARGET __attribute__((target("pclmul,sse4.1")))
+
+XN_CRC_TARGET inline __m128i load(const uint8_t *p) {
+  return _mm_loadu_si128((const __m128i *)p);
+}
+
+// x * k folded onto the next 128 bits of data
+XN_CRC_TARGET inline __m128i fold(__m128i x, __m128i k, __m128i next) {
+  __m128i lo = _mm_clmulepi64_si128(x, k, 0x00);
+  __m128i hi = _mm_clmulepi64_si128(x, k, 0x11);
+  return _mm_xor_si128(_mm_xor_si128(hi, lo), next);
+}
+
+// n >= 64 and a multiple of 16
+XN_CRC_TARGET inline uint32_t folded(const uint8_t *p, size_t n, uint32_t crc) {
+  alignas(16) static const uint64_t k1k2[] = {0x0154442bd4, 0x01c6e41596};
+  alignas(16) static const uint64_t k3k4[] = {0x01751997d0, 0x00ccaa009e};
+  alignas(16) static const uint64_t k5k0[] = {0x0163cd6124, 0x0000000000};
+  alignas(16) static const uint64_t poly[] = {0x01db710641, 0x01f7011641};
+
+  __m128i x1 = _mm_xor_si128(load(p), _mm_cvtsi32_si128(crc));
+  __m128i x2 = load(p + 16), x3 = load(p + 32), x4 = load(p + 48);
+  p += 64;
+  n -= 64;
+
+  // four independent 128 bit lanes
+  __m128i k = _mm_load_si128((const __m128i *)k1k2);
+  for (; n >= 64; n -= 64, p += 64) {
+    x1 = fold(x1, k, load(p));
+    x2 = fold(x2, k, load(p + 16));
+    x3 = fold(x3, k, load(p + 32));
+    x4 = fold(x4, k, load(p + 48));
+  }
+
+  // fold down to one lane, then the remaining 16 byte blocks
+  k = _mm_load_si128((const __m128i *)k3k4);
+  x1 = fold(x1, k, x2);
+  x1 = fold(x1, k, x3);
+  x1 = fold(x1, k, x4);
+  for (; n >= 16; n -= 16, p += 16)
+    x1 = fold(x1, k, load(p));
+
+  // 128 -> 64 bits
+  __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+  x2 = _mm_clmulepi64_si128(x1, k, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+  k = _mm_loadl_epi64((const __m128i *)k5k0);
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), k, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  // Barrett reduction to 32 bits
+  k = _mm_load_si128((const __m128i *)poly);
+  x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), k, 0x10);
+  x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask), k, 0x00);
+  return _mm_extract_epi32(_mm_xor_si128(x1, x2), 1);
+}
+
+inline bool hasPclmul() {
+  static const bool supported =
+      __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+  return supported;
+}
+#endif
+
+} // namespace crc32_detail
+
+inline uint32_t crc32(const void *data, size_t size, uint32_t crc = 0) {
+  const uint8_t *p = (const uint8_t *)data;
+  crc = ~crc;
+#ifdef XN_CRC_PCLMUL
+  if (size >= 64 && crc32_detail::hasPclmul()) {
+    size_t n = size & ~(size_t)15;
+    crc = crc32_detail::folded(p, n, crc);
+    p += n;
+    size -= n;
+  }
+#endif
+  return ~crc32_detail::scalar(p, size, crc);
+}
+
+/**
+ * SHA-1 (FIPS 180-4), incremental
+ *
+ * Sha1 h; h.update(a, n); h.update(b, m); std::string hex = h.hex();
+ * */
+struct Sha1 {
+  std::array<uint32_t, 5> state = {0x67452301, 0xEFCDAB89, 0x98BADCFE,
+                                   0x10325476, 0xC3D2E1F0};
+  std::array<uint8_t, 64> buffer;
+  uint64_t length = 0; // bytes hashed so far
+
+  void update(const void *data, size_t size) {
+    const uint8_t *p = (const uint8_t *)data;
+    size_t used = length % 64;
+    length += size;
+    if (used > 0) {
+      size_t n = std::min(size, 64 - used);
+      std::memcpy(buffer.data() + used, p, n);
+      p += n;
+      size -= n;
+      if (used + n < 64)
+        return;
+      block(buffer.data());
+    }
+    for (; size >= 64; size -= 64, p += 64)
+      block(p);
+    std::memcpy(buffer.data(), p, size);
+  }
+
+  std::array<uint8_t, 20> digest() {
+    uint64_t bits = length * 8;
+    uint8_t pad = 0x80;
+    update(&pad, 1);
+    pad = 0;
+    while (length % 64 != 56)
+      update(&pad, 1);
+    uint8_t len[8];
+    for (int i = 0; i < 8; i++)
+      len[i] = (uint8_t)(bits >> (56 - 8 * i));
+    update(len, 8);
+
+    std::array<uint8_t, 20> out;
+    for (size_t i = 0; i < 20; i++)
+      out[i] = (uint8_t)(state[i / 4] >> (24 - 8 * (i % 4)));
+    return out;
+  }
+
+  std::string hex() {
+    std::string s;
+    char byte[3];
+    for (uint8_t b : digest()) {
+      std::snprintf(byte, sizeof(byte), "%02x", b);
+      s += byte;
+    }
+    return s;
+  }
+
+private:
+  static uint32_t rol(uint32_t x, int n) { return (x << n) | (x >> (32 - n)); }
+
+  void block(const uint8_t *p) {
+    uint32_t w[80];
+    for (int i = 0; i < 16; i++)
+      w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 |
+             (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+    for (int i = 16; i < 80; i++)
+      w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3],
+             e = state[4];
+    for (int i = 0; i < 80; i++) {
+      uint32_t f, k;
+      if (i < 20) {
+        f = (b & c) | (~b & d);
+        k = 0x5A827999;
+      } else if (i < 40) {
+        f = b ^ c ^ d;
+        k = 0x6ED9EBA1;
+      } else if (i < 60) {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8F1BBCDC;
+      } else {
+        f = b ^ c ^ d;
+        k = 0xCA62C1D6;
+      }
+      uint32_t t = rol(a, 5) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = rol(b, 30);
+      b = a;
+      a = t;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+  }
+};
+
+} // namespace xn
@@ -0,0 +1,128 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace xn {
+
+/**
+ * Small LZ77 block codec, LZ4 style
+ *
+ * A block is a list of sequences, each
+ *
+ *   token: high nibble literal count, low nibble match length - 4
+ *          (15 = more length bytes follow, 255 each until one is smaller)
+ *   literal bytes
+ *   2 byte little endian match offset, absent in the last sequence
+ *
+ * Greedy matching with a 4096 entry hash table, no allocations. Meant for
+ * blocks of a few KB where speed matters more than ratio.
+ * */
+namespace lz {
+
+static const size_t MIN_MATCH = 4;
+
+// largest compressed size for `size` input bytes
+constexpr size_t bound(size_t size) { return size + size / 255 + 16; }
+
+// compress into dst (at least bound(size) bytes), returns the bytes written
+inline size_t compress(const uint8_t *src, size_t size, uint8_t *dst) {
+  const int HASH_BITS = 12;
+  uint32_t table[1 << HASH_BITS] = {}; // position + 1, 0 is empty
+  uint8_t *o = dst;
+
+  auto put_length = [&](size_t length) {
+    for (; length >= 255; length -= 255)
+      *o++ = 255;
+    *o++ = (uint8_t)length;
+  };
+  auto put_sequence = [&](const uint8_t *literals, size_t literal_count,
+                          size_t offset, size_t match_length) {
+    size_t extra = match_length >= MIN_MATCH ? match_length - MIN_MATCH : 0;
+    *o++ = (uint8_t)((literal_count < 15 ? literal_count : 15) << 4 |
+                     (extra < 15 ? extra : 15));
+    if (literal_count >= 15)
+      put_length(literal_count - 15);
+    std::memcpy(o, literals, literal_count);
+    o += literal_count;
+    if (match_length == 0)
+      return; // last sequence
+    *o++ = (uint8_t)offset;
+    *o++ = (uint8_t)(offset >> 8);
+    if (extra >= 15)
+      put_length(extra - 15);
+  };
+
+  size_t anchor = 0, i = 0;
+  while (size >= MIN_MATCH && i <= size - MIN_MATCH) {
+    uint32_t sequence;
+    std::memcpy(&sequence, src + i, 4);
+    uint32_t h = (sequence * 2654435761u) >> (32 - HASH_BITS);
+    size_t candidate = table[h];
+    table[h] = (uint32_t)i + 1;
+    if (candidate == 0 || i - (candidate - 1) > 0xFFFF ||
+        std::memcmp(src + candidate - 1, src + i, MIN_MATCH) != 0) {
+      i++;
+      continue;
+    }
+    candidate--;
+    size_t length = MIN_MATCH;
+    while (i + length < size && src[candidate + length] == src[i + length])
+      length++;
+    put_sequence(src + anchor, i - anchor, i - candidate, length);
+    i += length;
+    anchor = i;
+  }
+  put_sequence(src + anchor, size - anchor, 0, 0);
+  return o - dst;
+}
+
+// decompress exactly `size` bytes into dst, false if the block is corrupt
+inline bool decompress(const uint8_t *src, size_t src_size, uint8_t *dst,
+                       size_t size) {
+  const uint8_t *end = src + src_size;
+  size_t out = 0;
+
+  auto get_length = [&](size_t &length) {
+    uint8_t b;
+    do {
+      if (src == end)
+        return false;
+      b = *src++;
+      length += b;
+    } while (b == 255);
+    return true;
+  };
+
+  while (src < end) {
+    uint8_t token = *src++;
+    size_t literal_count = token >> 4;
+    if (literal_count == 15 && !get_length(literal_count))
+      return false;
+    if (literal_count > (size_t)(end - src) || literal_count > size - out)
+      return false;
+    std::memcpy(dst + out, src, literal_count);
+    src += literal_count;
+    out += literal_count;
+    if (src == end)
+      break; // last sequence
+
+    if (end - src < 2)
+      return false;
+    size_t offset = src[0] | src[1] << 8;
+    src += 2;
+    size_t length = token & 0x0F;
+    if (length == 15 && !get_length(length))
+      return false;
+    length += MIN_MATCH;
+    if (offset == 0 || offset > out || length > size - out)
+      return false;
+    // byte by byte, matches may overlap what they produce
+    for (size_t k = 0; k < length; k++, out++)
+      dst[out] = dst[out - offset];
+  }
+  return out == size;
+}
+
+} // namespace lz
+} // namespace xn
@@ -0,0 +1,265 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace xn {
+
+/**
+ * Read-only view of a whole file
+ *
+ * - Mapped with mmap, pages are only read from disk when touched and are
+ *   shared with every other mapping of the file
+ * - Falls back to reading the file into memory where mmap isn't available
+ * */
+struct MappedFile {
+  MappedFile() {}
+
+  MappedFile(const std::string &path) { open(path); }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  MappedFile(MappedFile &&other) { *this = std::move(other); }
+
+  MappedFile &operator=(MappedFile &&other) {
+    if (this != &other) {
+      close();
+      ptr = other.ptr;
+      length = other.length;
+      mapped = other.mapped;
+      fallback = std::move(other.fallback);
+      other.ptr = nullptr;
+      other.length = 0;
+      other.mapped = false;
+    }
+    return *this;
+  }
+
+  ~MappedFile() { close(); }
+
+  bool open(const std::string &path) {
+    close();
+#ifndef _WIN32
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      return false;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p != MAP_FAILED) {
+        ptr = (uint8_t *)p;
+        length = st.st_size;
+        mapped = true;
+      }
+    }
+    ::close(fd);
+    if (mapped)
+      return true;
+#endif
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file.is_open())
+      return false;
+    fallback.resize((size_t)file.tellg());
+    file.seekg(0, std::ios::beg);
+    file.read((char *)fallback.data(), fallback.size());
+    ptr = fallback.data();
+    length = fallback.size();
+    return true;
+  }
+
+  void close() {
+#ifndef _WIN32
+    if (mapped)
+      munmap((void *)ptr, length);
+#endif
+    fallback.clear();
+    fallback.shrink_to_fit();
+    ptr = nullptr;
+    length = 0;
+    mapped = false;
+  }
+
+  bool isOpen() const { return ptr != nullptr; }
+  const uint8_t *data() const { return ptr; }
+  size_t size() const { return length; }
+
+private:
+  const uint8_t *ptr = nullptr;
+  size_t length = 0;
+  bool mapped = false;
+  std::vector<uint8_t> fallback;
+};
+
+/**
+ * Fixed size, writable view of a file, created or extended as needed
+ *
+ * - Mapped with mmap(MAP_SHARED): stores land in the OS page cache and survive
+ *   the process crashing, sync() writes them to disk
+ * - Without mmap the contents live in memory and sync() writes the range back
+ * */
+struct SharedMappedFile {
+  SharedMappedFile() {}
+  SharedMappedFile(const SharedMappedFile &) = delete;
+  SharedMappedFile &operator=(const SharedMappedFile &) = delete;
+  ~SharedMappedFile() { close(); }
+
+  bool open(const std::string &file_path, size_t size) {
+    close();
+    path = file_path;
+#ifndef _WIN32
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+      return false;
+    struct stat st;
+    bool sized = fstat(fd, &st) == 0 &&
+                 ((size_t)st.st_size >= size || ftruncate(fd, size) == 0);
+    void *p = sized ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                           fd, 0)
+                    : MAP_FAILED;
+    ::close(fd);
+    if (p == MAP_FAILED)
+      return false;
+    ptr = (uint8_t *)p;
+    length = size;
+    mapped = true;
+    return true;
+#else
+    fallback.assign(size, 0);
+    std::ifstream file(path, std::ios::binary);
+    file.read((char *)fallback.data(), size);
+    ptr = fallback.data();
+    length = size;
+    return true;
+#endif
+  }
+
+  // write [offset, offset + size) back to the file, blocks until done
+  void sync(size_t offset, size_t size) {
+    if (ptr == nullptr || offset >= length)
+      return;
+    size = std::min(size, length - offset);
+#ifndef _WIN32
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = offset / page * page;
+    msync(ptr + start, offset + size - start, MS_SYNC);
+#else
+    std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+    if (!file.is_open())
+      file.open(path, std::ios::binary | std::ios::out);
+    file.seekp(offset);
+    file.write((char *)ptr + offset, size);
+#endif
+  }
+
+  void close() {
+#ifndef _WIN32
+    if (mapped)
+      munmap(ptr, length);
+#else
+    sync(0, length);
+#endif
+    fallback.clear();
+    ptr = nullptr;
+    length = 0;
+    mapped = false;
+  }
+
+  bool isOpen() const { return ptr != nullptr; }
+  uint8_t *data() const { return ptr; }
+  size_t size() const { return length; }
+
+private:
+  std::string path;
+  uint8_t *ptr = nullptr;
+  size_t length = 0;
+  bool mapped = false;
+  std::vector<uint8_t> fallback;
+};
+
+/**
+ * Replace a file's contents all at once
+ *
+ * Writes path + ".tmp", flushes it to disk and renames it over `path`, so a
+ * crash or power loss leaves either the old file or the new one, never a
+ * truncated mix. Blocks until the data is on disk.
+ * */
+inline bool writeFileAtomic(const std::string &path, const void *data,
+                            size_t size) {
+  std::string tmp = path + ".tmp";
+#ifndef _WIN32
+  int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return false;
+  const uint8_t *p = (const uint8_t *)data;
+  bool ok = true;
+  for (size_t left = size; ok && left > 0;) {
+    ssize_t n = ::write(fd, p, left);
+    ok = n > 0;
+    if (ok) {
+      p += n;
+      left -= n;
+    }
+  }
+  ok = fsync(fd) == 0 && ok;
+  ok = ::close(fd) == 0 && ok;
+#else
+  bool ok;
+  {
+    std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+    ok = file.write((const char *)data, size).flush().good();
+  }
+#endif
+  std::error_code ec;
+  if (ok)
+    std::filesystem::rename(tmp, path, ec);
+  if (!ok || ec) {
+    std::filesystem::remove(tmp, ec);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Add to the end of a file, creating it if needed
+ *
+ * Blocks until the data is on disk. A crash can still leave a partly written
+ * tail, so readers of the file must be able to skip one.
+ * */
+inline bool appendFile(const std::string &path, const void *data,
+                       size_t size) {
+#ifndef _WIN32
+  int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (fd < 0)
+    return false;
+  const uint8_t *p = (const uint8_t *)data;
+  bool ok = true;
+  for (size_t left = size; ok && left > 0;) {
+    ssize_t n = ::write(fd, p, left);
+    ok = n > 0;
+    if (ok) {
+      p += n;
+      left -= n;
+    }
+  }
+  ok = fsync(fd) == 0 && ok;
+  ok = ::close(fd) == 0 && ok;
+  return ok;
+#else
+  std::ofstream file(path, std::ios::binary | std::ios::app);
+  return file.write((const char *)data, size).flush().good();
+#endif
+}
+
+} // namespace xn
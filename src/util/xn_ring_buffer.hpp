@@ -0,0 +1,138 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+namespace xn {
+
+/**
+ * Lock-free single producer / single consumer ring buffer
+ *
+ * - One thread may push, one (other) thread may pop, no locks on either side
+ * - Capacity is rounded up to a power of 2 so indices wrap with a mask
+ * - Head and tail live on separate cache lines to avoid false sharing
+ *   between the producer and consumer cores
+ * */
+template <typename T> struct SpscRingBuffer {
+  static_assert(std::is_trivially_copyable_v<T>,
+                "SpscRingBuffer only stores trivially copyable types");
+
+  std::vector<T> buffer;
+  size_t mask = 0;
+
+  alignas(64) std::atomic<size_t> head{0}; // next write position (producer)
+  alignas(64) std::atomic<size_t> tail{0}; // next read position (consumer)
+
+  SpscRingBuffer() {}
+
+  SpscRingBuffer(size_t min_capacity) { resize(min_capacity); }
+
+  // not thread safe, call before starting the producer/consumer threads
+  void resize(size_t min_capacity) {
+    size_t cap = 1;
+    while (cap < min_capacity)
+      cap <<= 1;
+    buffer.assign(cap, T{});
+    mask = cap - 1;
+    head = tail = 0;
+  }
+
+  size_t capacity() const { return buffer.size(); }
+
+  // number of elements ready to be read. Exact from the producer or the
+  // consumer, a snapshot from any other thread: tail is loaded first, so
+  // head can only have moved further, and the result is clamped to capacity
+  size_t size() const {
+    size_t t = tail.load(std::memory_order_acquire);
+    size_t h = head.load(std::memory_order_acquire);
+    return std::min(h - t, capacity());
+  }
+
+  size_t space() const { return capacity() - size(); }
+
+  // producer: copy up to n elements in, returns the number written
+  size_t push(const T *data, size_t n) {
+    size_t h = head.load(std::memory_order_relaxed);
+    size_t t = tail.load(std::memory_order_acquire);
+    n = std::min(n, capacity() - (h - t));
+    copyIn(h, data, n);
+    head.store(h + n, std::memory_order_release);
+    return n;
+  }
+
+  // consumer: copy up to n elements out, returns the number read
+  size_t pop(T *out, size_t n) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    size_t h = head.load(std::memory_order_acquire);
+    n = std::min(n, h - t);
+    copyOut(t, out, n);
+    tail.store(t + n, std::memory_order_release);
+    return n;
+  }
+
+private:
+  void copyIn(size_t pos, const T *data, size_t n) {
+    size_t first = std::min(n, capacity() - (pos & mask));
+    std::memcpy(&buffer[pos & mask], data, first * sizeof(T));
+    std::memcpy(&buffer[0], data + first, (n - first) * sizeof(T));
+  }
+
+  void copyOut(size_t pos, T *out, size_t n) const {
+    size_t first = std::min(n, capacity() - (pos & mask));
+    std::memcpy(out, &buffer[pos & mask], first * sizeof(T));
+    std::memcpy(out + first, &buffer[0], (n - first) * sizeof(T));
+  }
+};
+
+/**
+ * Wait-free single writer ring that only keeps the most recent samples
+ *
+ * - The writer never blocks and never fails, old samples are overwritten
+ * - Readers copy out the latest N samples whenever they like, and retry if
+ *   the writer lapped the region they were copying
+ * - N must be a power of 2, storage is 2 * N so a reader has N samples of
+ *   slack before the writer catches up with it
+ * */
+template <typename T, size_t N> struct ScopeRingBuffer {
+  static_assert((N & (N - 1)) == 0,
+                "ScopeRingBuffer size must be a power of 2");
+  static const size_t CAPACITY = N * 2;
+  static const size_t MASK = CAPACITY - 1;
+
+  std::array<std::atomic<T>, CAPACITY> buffer{};
+  std::atomic<size_t> head{0};     // samples published so far
+  std::atomic<size_t> writeEnd{0}; // samples published + being written
+
+  // writer: append a block of samples
+  void push(const T *data, size_t n) {
+    size_t h = head.load(std::memory_order_relaxed);
+    writeEnd.store(h + n, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (size_t i = 0; i < n; i++)
+      buffer[(h + i) & MASK].store(data[i], std::memory_order_relaxed);
+    head.store(h + n, std::memory_order_release);
+  }
+
+  // reader: copy the latest N samples (oldest first) to out, returns false if
+  // the writer kept overwriting them and no consistent copy could be made
+  bool snapshot(T *out, unsigned attempts = 4) const {
+    while (attempts--) {
+      size_t h = head.load(std::memory_order_acquire);
+      size_t start = h - N;
+      for (size_t i = 0; i < N; i++)
+        out[i] = (h < N - i) ? T{}
+                             : buffer[(start + i) & MASK].load(
+                                   std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (writeEnd.load(std::memory_order_relaxed) - start <= CAPACITY)
+        return true;
+    }
+    return false;
+  }
+};
+
+} // namespace xn
@@ -0,0 +1,73 @@
+#include "xnes_env.h"
+#include "nes/vec_env.hpp"
+
+struct xnes_env {
+  VecEnv env;
+  xnes_env(const char *rom, uint32_t count, uint32_t threads, uint32_t players)
+      : env(rom, count, threads, players) {}
+};
+
+static_assert(VecEnv::WIDTH == XNES_WIDTH && VecEnv::HEIGHT == XNES_HEIGHT &&
+                  VecEnv::RAM_SIZE == XNES_RAM_SIZE,
+              "xnes_env.h sizes are out of date");
+static_assert(sizeof(NesPixel) == 3, "palette is read as RGB triples");
+
+xnes_env *xnes_env_create(const char *rom, uint32_t count, uint32_t threads,
+                          uint32_t players) {
+  if (rom == nullptr)
+    return nullptr;
+  xnes_env *env = new xnes_env(rom, count, threads, players);
+  if (!env->env.ok()) {
+    delete env;
+    return nullptr;
+  }
+  return env;
+}
+
+void xnes_env_destroy(xnes_env *env) { delete env; }
+
+void xnes_env_set_max_frames(xnes_env *env, uint32_t frames) {
+  env->env.maxFrames = frames;
+}
+
+void xnes_env_reset(xnes_env *env, int64_t index) { env->env.reset(index); }
+
+void xnes_env_step(xnes_env *env, const uint8_t *actions) {
+  env->env.step(actions);
+}
+
+int xnes_env_set_observation(xnes_env *env, uint32_t width, uint32_t height,
+                             uint32_t stack, int max_pool) {
+  if (width == 0) {
+    env->env.clearObservation();
+    return 1;
+  }
+  ObservationFilter::Options options;
+  options.width = width;
+  options.height = height;
+  options.stack = stack;
+  options.maxPool = max_pool != 0;
+  return env->env.setObservation(options);
+}
+
+uint32_t xnes_env_count(const xnes_env *env) { return env->env.size(); }
+
+const uint8_t *xnes_env_observations(const xnes_env *env) {
+  return env->env.observations();
+}
+
+const uint8_t *xnes_env_ram(const xnes_env *env) { return env->env.ram(); }
+
+const uint8_t *xnes_env_done(const xnes_env *env) { return env->env.done(); }
+
+const uint32_t *xnes_env_frames(const xnes_env *env) {
+  return env->env.frames();
+}
+
+const uint8_t *xnes_env_processed(const xnes_env *env) {
+  return env->env.processed();
+}
+
+const uint8_t *xnes_env_palette(void) {
+  return &NesRenderer::palettes[0].r;
+}
@@ -0,0 +1,86 @@
+#pragma once
+#include <stdint.h>
+
+/*
+ * Plain C interface to VecEnv (nes/vec_env.hpp), built as the xnes_env
+ * shared library for reinforcement learning code in other languages.
+ *
+ * An env runs `count` instances of one rom. xnes_env_step() takes one
+ * controller byte per instance and player (A 0x80, B 0x40, Select 0x20,
+ * Start 0x10, Up 0x08, Down 0x04, Left 0x02, Right 0x01) and runs a frame
+ * on all of them. The result buffers belong to the env, stay at the same
+ * address for its lifetime and are overwritten by every step:
+ *
+ *   observations  uint8  [count, XNES_HEIGHT, XNES_WIDTH] palette indices
+ *   ram           uint8  [count, XNES_RAM_SIZE]
+ *   done          uint8  [count]
+ *   frames        uint32 [count]
+ *
+ * xnes_env_palette() gives the RGB color of each palette index.
+ * xnes_env_set_observation() adds grayscale, downsampled, max pooled and
+ * stacked observations made on the worker threads:
+ *
+ *   processed     uint8  [count, stack, height, width], newest frame last
+ *
+ * From Python, wrap the buffers once with numpy.ctypeslib.as_array:
+ *
+ *   lib = ctypes.CDLL("libxnes_env.so")
+ *   lib.xnes_env_create.restype = ctypes.c_void_p
+ *   lib.xnes_env_observations.restype = ctypes.POINTER(ctypes.c_uint8)
+ *   env = ctypes.c_void_p(lib.xnes_env_create(b"game.nes", 16, 0, 1))
+ *   obs = numpy.ctypeslib.as_array(lib.xnes_env_observations(env),
+ *                                  (16, 240, 256))
+ */
+
+#define XNES_WIDTH 256
+#define XNES_HEIGHT 240
+#define XNES_RAM_SIZE 2048
+
+#ifdef _WIN32
+#define XNES_API __declspec(dllexport)
+#else
+#define XNES_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct xnes_env xnes_env;
+
+/* NULL when the rom can't be loaded. threads 0 uses every hardware thread,
+ * players is the number of controller bytes per instance, 1 or 2 */
+XNES_API xnes_env *xnes_env_create(const char *rom, uint32_t count,
+                                   uint32_t threads, uint32_t players);
+XNES_API void xnes_env_destroy(xnes_env *env);
+
+/* episodes end after this many frames, 0 (the default) never */
+XNES_API void xnes_env_set_max_frames(xnes_env *env, uint32_t frames);
+
+/* start instance `index` over, or all of them for -1 */
+XNES_API void xnes_env_reset(xnes_env *env, int64_t index);
+
+/* actions: [count, players] controller bytes. Instances that were done
+ * start over first */
+XNES_API void xnes_env_step(xnes_env *env, const uint8_t *actions);
+
+/* preprocessed observations, e.g. 84, 84, 4, 1. Starts every instance
+ * over. width 0 turns them off. 0 for invalid sizes (up to 256 x 240) */
+XNES_API int xnes_env_set_observation(xnes_env *env, uint32_t width,
+                                      uint32_t height, uint32_t stack,
+                                      int max_pool);
+
+XNES_API uint32_t xnes_env_count(const xnes_env *env);
+XNES_API const uint8_t *xnes_env_observations(const xnes_env *env);
+XNES_API const uint8_t *xnes_env_ram(const xnes_env *env);
+XNES_API const uint8_t *xnes_env_done(const xnes_env *env);
+XNES_API const uint32_t *xnes_env_frames(const xnes_env *env);
+/* NULL without xnes_env_set_observation(), moves when it is called again */
+XNES_API const uint8_t *xnes_env_processed(const xnes_env *env);
+
+/* 64 RGB triples */
+XNES_API const uint8_t *xnes_env_palette(void);
+
+#ifdef __cplusplus
+}
+#endif